@@ -19,6 +19,9 @@
 #else
 #include <time.h>
 #endif
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
 #include "clock.h"
 
 int gverbose = 1;
@@ -150,3 +153,42 @@ double get_counter()
     double delta_secs = get_timer();
     return delta_secs * cpu_mhz * 1e6;
 }
+
+/*
+ * The time stamp counter is read without serializing the pipeline, which
+ * keeps a read down to a few dozen cycles at the price of letting it
+ * overlap slightly with the instructions around it
+ */
+uint64_t read_tsc()
+{
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Ticks of the time stamp counter per nanosecond; 0 until calibrated */
+static double tsc_rate = 0.0;
+
+double tsc_ghz()
+{
+    struct timespec t0, t1;
+    if (tsc_rate > 0.0)
+        return tsc_rate;
+
+    /* Count ticks over 20 ms of wall-clock time */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t c0 = read_tsc();
+    double ns;
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns = 1e9 * (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec);
+    } while (ns < 2e7);
+    uint64_t c1 = read_tsc();
+    tsc_rate = (c1 - c0) / ns;
+    return tsc_rate;
+}
@@ -1,5 +1,7 @@
 /* Routines for timing functions */
 
+#include <stdint.h>
+
 /*  minimum resolution of timer (secs) */
 extern const double timer_resolution;
 
@@ -20,3 +22,11 @@ void start_counter();
 
 /* Get # cycles since counter started.  Returns 1e20 if detect timing anomaly */
 double get_counter();
+
+/* Time stamp counter: for timing intervals too short for the counter */
+
+/* Read the time stamp counter (nanoseconds where there is none) */
+uint64_t read_tsc();
+
+/* Determine the rate of the time stamp counter, in ticks per nanosecond */
+double tsc_ghz();
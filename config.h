@@ -148,11 +148,6 @@
  */
 #define SPARSE_PAGE_SIZE (1 << 10)
 
-/*
- * Maximum target load for hash table
- */
-#define HASH_LOAD 10.0
-
 /***************** Parameters for looking up reference throughput *********/
 /*
  * Location of information on CPU type
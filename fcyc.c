@@ -1,7 +1,12 @@
 /* Compute time used by function f */
+#include <linux/perf_event.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/times.h>
+#include <unistd.h>
 
 #include "clock.h"
 #include "fcyc.h"
@@ -37,6 +42,93 @@ static long int samplecount = 0;
 static double *samples = NULL;
 #endif
 
+/* Hardware event counters, opened in the process event_pid */
+static int count_events = 0;
+static int event_fd[FCYC_NUM_EVENTS];
+static pid_t event_pid = 0;
+static long int event_calls = 0; /* calls of f while the counters ran */
+
+#define CACHE_MISSES(cache)                                                    \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                            \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct
+{
+    __u32 type;
+    __u64 config;
+} event_attrs[FCYC_NUM_EVENTS] = {
+    [FCYC_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [FCYC_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                         CACHE_MISSES(PERF_COUNT_HW_CACHE_L1D)},
+    [FCYC_LLC_MISSES] = {PERF_TYPE_HW_CACHE,
+                         CACHE_MISSES(PERF_COUNT_HW_CACHE_LL)},
+    [FCYC_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                          CACHE_MISSES(PERF_COUNT_HW_CACHE_DTLB)},
+    [FCYC_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/* Close the counters of this process, if any */
+static void close_events()
+{
+    int e;
+    if (event_pid == 0)
+        return;
+    for (e = 0; e < FCYC_NUM_EVENTS; e++)
+        if (event_fd[e] >= 0)
+            close(event_fd[e]);
+    event_pid = 0;
+}
+
+/* Open a disabled counter of the calling thread for each event, in user
+   mode only so that it works at the default perf_event_paranoid level,
+   and return how many could be opened */
+static int open_events()
+{
+    struct perf_event_attr attr;
+    int e, opened = 0;
+    close_events();
+    for (e = 0; e < FCYC_NUM_EVENTS; e++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = event_attrs[e].type;
+        attr.config = event_attrs[e].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        event_fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (event_fd[e] >= 0)
+            opened++;
+    }
+    event_pid = getpid();
+    return opened;
+}
+
+/* Apply a PERF_EVENT_IOC_ request to every open counter */
+static void control_events(unsigned long request)
+{
+    int e;
+    if (!count_events)
+        return;
+    for (e = 0; e < FCYC_NUM_EVENTS; e++)
+        if (event_fd[e] >= 0)
+            ioctl(event_fd[e], request, 0);
+}
+
+/* Zero the counters before sampling, reopening them in a forked child,
+   since counters only follow the thread that opened them */
+static void reset_events()
+{
+    if (!count_events)
+        return;
+    if (event_pid != getpid())
+        open_events();
+    control_events(PERF_EVENT_IOC_RESET);
+    event_calls = 0;
+}
+
 /* Initialize the minimum time threshold */
 static void init_min_time()
 {
@@ -146,16 +238,20 @@ double fcyc(test_funct f, void *args)
             reps += reps;
     }
     init_sampler();
+    reset_events();
     do
     {
         if (clear_cache)
             clear();
+        control_events(PERF_EVENT_IOC_ENABLE);
         start_counter();
         for (r = 0; r < reps; r++)
         {
             f(args);
         }
         cyc = (double)get_counter() / reps;
+        control_events(PERF_EVENT_IOC_DISABLE);
+        event_calls += reps;
         if (cyc > 0.0)
             add_sample(cyc);
     } while (!has_converged() && samplecount < maxsamples);
@@ -190,17 +286,21 @@ double fsec(test_funct f, void *args)
         //        printf("uSecs = %.3f, reps = %ld\n", sec * 1e6, reps);
     }
     init_sampler();
+    reset_events();
     //    printf("\nuSecs (reps=%ld):", reps);
     do
     {
         if (clear_cache)
             clear();
+        control_events(PERF_EVENT_IOC_ENABLE);
         start_timer();
         for (r = 0; r < reps; r++)
         {
             f(args);
         }
         sec = get_timer() / reps;
+        control_events(PERF_EVENT_IOC_DISABLE);
+        event_calls += reps;
         //        printf(" %.3f", sec * 1e6);
         if (sec > 0.0)
             add_sample(sec);
@@ -214,6 +314,25 @@ double fsec(test_funct f, void *args)
     return result;
 }
 
+/* Get the events counted by the last call of fcyc or fsec, scaled up
+   for any time the kernel had to multiplex the counters */
+void get_fcyc_events(fcyc_events_t *events)
+{
+    int e;
+    for (e = 0; e < FCYC_NUM_EVENTS; e++)
+    {
+        __u64 buf[3]; /* value, time enabled, time running */
+        events->count[e] = -1.0;
+        if (!count_events || event_pid != getpid() || event_fd[e] < 0 ||
+            event_calls == 0)
+            continue;
+        if (read(event_fd[e], buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0)
+            continue;
+        events->count[e] =
+            (double)buf[0] * ((double)buf[1] / buf[2]) / event_calls;
+    }
+}
+
 /***********************************************************/
 /* Set the various parameters used by measurement routines */
 
@@ -278,6 +397,21 @@ void set_fcyc_maxsamples(long int maxsamples_arg)
     maxsamples = maxsamples_arg;
 }
 
+/* When set, will count hardware events while measuring.  Returns the
+   number of events that can be counted, 0 if perf_event_open fails
+   Default = 0
+*/
+int set_fcyc_events(int count)
+{
+    count_events = count;
+    if (!count)
+    {
+        close_events();
+        return 0;
+    }
+    return open_events();
+}
+
 /* Tolerance required for K-best
    Default = 0.01
 */
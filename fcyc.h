@@ -2,7 +2,8 @@
    is passed a list of integer parameters, which it may interpret
    in any way it chooses.
 
-   Time can be measured in seconds or clock cycles.
+   Time can be measured in seconds or clock cycles.  Optionally,
+   hardware events are counted with perf_event_open while timing.
 */
 
 typedef void (*test_funct)(void *);
@@ -13,6 +14,26 @@ double fcyc(test_funct f, void *args);
 /* Compute number of cycles used by function f on given set of parameters */
 double fsec(test_funct f, void *args);
 
+/* Hardware events that can be counted while timing */
+enum
+{
+    FCYC_INSTRUCTIONS,
+    FCYC_L1D_MISSES,
+    FCYC_LLC_MISSES,
+    FCYC_DTLB_MISSES,
+    FCYC_BRANCH_MISSES,
+    FCYC_NUM_EVENTS
+};
+
+/* Counts of each event per call of f, or -1 if it could not be counted */
+typedef struct
+{
+    double count[FCYC_NUM_EVENTS];
+} fcyc_events_t;
+
+/* Get the events counted by the last call of fcyc or fsec */
+void get_fcyc_events(fcyc_events_t *events);
+
 /***********************************************************/
 /* Set the various parameters used by measurement routines */
 
@@ -53,6 +74,12 @@ void set_fcyc_k(long int k);
 */
 void set_fcyc_maxsamples(long int maxsamples);
 
+/* When set, will count hardware events while measuring.  Returns the
+   number of events that can be counted, 0 if perf_event_open fails
+   Default = 0
+*/
+int set_fcyc_events(int count);
+
 /* Tolerance required for K-best
    Default = 0.01
 */
@@ -7,10 +7,13 @@
  * Copyright (c) 2004-2016, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* for sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
 #include <math.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -18,6 +21,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -25,6 +32,11 @@
 #include <sanitizer/msan_interface.h>
 #endif
 
+#if MM_THREADS
+#include <pthread.h>
+#endif
+
+#include "clock.h"
 #include "config.h"
 #include "fcyc.h"
 #include "memlib.h"
@@ -45,6 +57,34 @@
 #define REF_ONLY 0
 #endif
 
+/* Set when linked against an mm.c built with -DMM_THREADS=1 */
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+
+/* Number of timed runs in multi-threaded mode; the fastest one counts */
+#define MT_REPS 3
+
+/*
+ * Latency histograms (-L) have one row per request type, with
+ * 2^LAT_SUB_BITS buckets per power of two, so that a bucket is never
+ * wider than 1/8 of the times it holds
+ */
+#define LAT_OPS 5
+#define LAT_SUB_BITS 3
+#define LAT_BUCKETS (48 << LAT_SUB_BITS)
+
+/*
+ * Heap profiles (-P) count free bytes in power-of-two size classes from
+ * 16 bytes, the last class holding everything larger, and map the heap
+ * onto PROFILE_CELLS cells
+ */
+#define PROFILE_CLASSES 20
+#define PROFILE_CELLS 64
+
+/* Batched replay (-b) hands at most this many requests to one batch call */
+#define BATCH_MAX 256
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -82,26 +122,70 @@ typedef struct range_t
 } range_t;
 
 /*
- * All information about set of ranges represented as doubly-linked
- * list of ranges, plus a splay tree keyed by lo addresses
+ * The flat index keeps the payload extents in address order, in a row of
+ * fixed-size chunks of sorted entries. A lookup is a binary search of the
+ * first address of each chunk and then of one chunk, and an insertion or
+ * removal moves at most one chunk's worth of entries, so there is no
+ * allocation per block and no pointer to chase but the chunk's own.
+ */
+#define RANGE_CHUNK 128 /* entries per chunk of the flat index */
+
+typedef struct
+{
+    char *lo;  /* low payload address */
+    char *hi;  /* high payload address */
+    int index; /* same index as free; for debugging */
+} range_entry_t;
+
+typedef struct range_chunk_t
+{
+    int count;                  /* entries in use */
+    struct range_chunk_t *next; /* next unused chunk, while on the spares */
+    range_entry_t entries[RANGE_CHUNK];
+} range_chunk_t;
+
+/*
+ * All information about set of ranges. Either a flat index (the default),
+ * or as with -R a doubly-linked list of ranges, plus a splay tree keyed by
+ * lo addresses
  */
 typedef struct
 {
+    bool flat;
     range_t *list;
     tree_t *lo_tree;
+
+    range_chunk_t **chunks; /* flat index, in address order */
+    char **chunk_lo;        /* lo of the first entry of each chunk */
+    size_t num_chunks;
+    size_t max_chunks;
+    range_chunk_t *spares; /* emptied chunks, for reuse */
 } range_set_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* Types of trace operations */
+enum
+{
+    ALLOC,
+    FREE,
+    REALLOC,
+    MEMALIGN,     /* mm_memalign, "m <id> <alignment> <size>" */
+    FREE_SIZED,   /* mm_free_sized, "s <id> <size>" */
+    REGION_BEGIN, /* mm_region_begin, "b" */
+    REGION_END    /* mm_region_release, "e" */
+};
+
+/*
+ * Characterizes a single trace operation (allocator request). The type
+ * takes one byte so that the alignment of a memalign fits in the record
+ * without making it larger than 16 bytes
+ */
 typedef struct
 {
-    enum
-    {
-        ALLOC,
-        FREE,
-        REALLOC
-    } type;      /* type of request */
-    int index;   /* index for free() to use later */
-    size_t size; /* byte size of alloc/realloc request */
+    unsigned char type;        /* type of request */
+    unsigned char align_shift; /* log2 of the alignment of a memalign */
+    int index;                 /* index for free() to use later */
+    size_t size; /* byte size of alloc/realloc/memalign request, and of
+                    the block a sized free frees */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -116,8 +200,46 @@ typedef struct
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     size_t *block_rand_base; /* index into random_data, if debug is on */
+    size_t *realloc_from; /* with -z, the size each realloc op resizes from */
+    void *map;            /* mapping of a binary trace that ops points into */
+    size_t map_bytes;     /* ... and its length */
 } trace_t;
 
+/*
+ * Binary traces (.bin) hold the four header fields of a text trace,
+ * followed by num_ops traceop_t records exactly as they sit in memory in
+ * this 64-bit driver, so that a trace is mapped in and used without any
+ * parsing.  "mdriver -B" writes one next to each .rep trace it is given.
+ * BIN_VERSION goes up whenever the layout or meaning of traceop_t changes,
+ * and a .bin of another version is not read.
+ */
+#define BIN_MAGIC "MMTRC64"
+#define BIN_VERSION 2 /* 1 had an int type, before memalign and sized free */
+
+typedef struct
+{
+    char magic[8];     /* BIN_MAGIC, with its terminating null */
+    int version;       /* BIN_VERSION of the driver that wrote it */
+    int weight;        /* the header fields of the text trace */
+    int num_ids;
+    int num_ops;
+    int op_bytes;      /* sizeof(traceop_t) of the driver that wrote it */
+    size_t data_bytes;
+} bin_header_t;
+
+/* What one walk of the heap found, for a row of a heap profile */
+typedef struct
+{
+    char *lo;             /* where the heap map starts */
+    size_t end;           /* offset of the end of the last block */
+    size_t cell;          /* bytes per map cell, 0 on the first walk */
+    size_t free_bytes;    /* bytes in free blocks */
+    size_t free_blocks;   /* number of free blocks */
+    size_t largest;       /* size of the largest free block */
+    size_t class_bytes[PROFILE_CLASSES]; /* free bytes by size class */
+    size_t cell_free[PROFILE_CELLS];     /* free bytes in each map cell */
+} profile_t;
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -144,6 +266,23 @@ typedef struct
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    double sbrks; /* heap extensions while measuring util (0 for libc) */
+
+    /* time stamp counter ticks of each request, by type (set by -L) */
+    unsigned int lat_hist[LAT_OPS][LAT_BUCKETS];
+
+    /* allocator counters after measuring util (set by -S) */
+    bool mm_counted; /* did mm.c keep counters? */
+    mm_stats_t mm;
+
+    /* hardware events per replay of the trace while timing (set by -E) */
+    bool evented; /* were the events counted? */
+    fcyc_events_t events;
+
+    /* how memlib backed the heap (0 for libc) */
+    bool paged;         /* was the trace run on a memlib heap? */
+    mem_pages_t pages;  /* page mode, after any fallback */
+    size_t prefaulted;  /* bytes of the heap faulted in up front */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -186,6 +325,7 @@ typedef enum
 static debug_mode_t debug_mode = REF_ONLY ? DBG_NONE : DBG_CHEAP;
 int verbose = REF_ONLY ? 0 : 1; /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
+static bool convert_traces = false; /* Write .bin copies of the traces (-B) */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
 /* If set, use sparse memory emulation */
@@ -199,6 +339,58 @@ size_t queryGlobalSpaceUsage(void);
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* Number of threads replaying each trace during timing (set by -N) */
+static int num_threads = 1;
+
+/* Number of traces run at once, each in a worker process (set by -j) */
+static int num_jobs = 1;
+
+/* If set, also replay each trace timing every request (set by -L) */
+static bool latency_mode = false;
+
+#if !REF_ONLY
+/* Profile the heap every this many ops while measuring util (set by -P) */
+static int profile_ops = 0;
+#endif
+
+/* If set, get the allocator's own counters for each trace (set by -S) */
+static bool counters_mode = false;
+
+/* If set, count hardware events while timing each trace (set by -E) */
+static bool events_mode = false;
+
+/* If set, workers time their traces one at a time (set by -I) */
+static bool isolate_timing = false;
+
+/* If set, check for overlaps with the splay tree of stree.c (set by -R) */
+static bool splay_ranges = false;
+
+/* If set, replay runs of allocs and frees through the batch calls (-b) */
+static bool batch_mode = false;
+
+/* If set, replay the regions of a trace through the region calls (-g) */
+static bool region_mode = false;
+
+/* If set, replay reallocs through mm_realloc_sized (set by -z) */
+static bool sized_realloc = false;
+
+/* How memlib backs the heap (set by -H), and the MB it faults in (-F) */
+static mem_pages_t heap_pages = MEM_PAGES_DEFAULT;
+static size_t prefault_mb = 0;
+
+/* Names of the page modes, for -H and printresults */
+static const char *const page_names[] = {
+    [MEM_PAGES_DEFAULT] = "default",
+    [MEM_PAGES_THP] = "thp",
+    [MEM_PAGES_HUGETLB] = "hugetlb",
+};
+
+/*
+ * Lock file of the workers when isolate_timing is set: a worker holds it
+ * shared while it checks its trace and exclusively while it times it
+ */
+static int isolate_fd = -1;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -235,6 +427,8 @@ static range_set_t *new_range_set();
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
                       const trace_t *trace, int opnum, int index);
 static void remove_range(range_set_t *ranges, char *lo);
+static bool check_ranges(const trace_t *trace, const range_set_t *ranges,
+                         int opnum);
 static void free_range_set(range_set_t *ranges);
 
 /* These functions implement the debugging code */
@@ -245,6 +439,9 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static void parse_trace(trace_t *trace);
+static bool map_bin_trace(trace_t *trace, const char *path);
+static void write_bin_trace(const trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -256,10 +453,25 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
+static void replay_mm_ops(const trace_t *trace, char **blocks);
+#if !REF_ONLY
+static int batch_run(const trace_t *trace, int i);
+static bool replay_batch(const trace_t *trace, char **blocks, int i, int n);
+static bool eval_mm_valid_batch(trace_t *trace, range_set_t *ranges, int i,
+                                int n, bool *allCheck);
+static FILE *profile_open(const trace_t *trace);
+static void profile_heap(FILE *prof, int ops, size_t payload);
+#endif
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
+#if MM_THREADS
+static double eval_mm_speed_mt(trace_t *trace, int nthreads);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printlatency(int n, stats_t *stats);
+static void printcounters(int n, stats_t *stats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
@@ -283,6 +495,16 @@ static void timeout_handler(int sig __attribute__((unused)))
 static double lookup_ref_throughput(bool checkpoint);
 static double measure_ref_throughput(bool checkpoint);
 
+/*
+ * isolate_lock - change how this worker holds the lock file of
+ *     isolate_timing (LOCK_SH or LOCK_EX); does nothing without one
+ */
+static void isolate_lock(int op)
+{
+    if (isolate_fd >= 0 && flock(isolate_fd, op) < 0)
+        unix_error("flock failed in isolate_lock");
+}
+
 /*
  * Run the tests; return the number of tests run (may be less than
  * num_tracefiles, if there's a timeout)
@@ -298,6 +520,9 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         /* initialize simulated memory system in memlib.c *
          * start each trace with a clean system */
         mem_init(sparse_mode);
+        mm_stats[i].paged = true;
+        mm_stats[i].pages = mem_pages();
+        mm_stats[i].prefaulted = mem_prefaulted();
         range_set_t *ranges = new_range_set();
 
         // NOTE: If times out, then it will reread the trace file
@@ -337,12 +562,54 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("efficiency, ");
             mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].sbrks = mem_sbrk_calls();
+#if !REF_ONLY
+            if (counters_mode)
+                mm_stats[i].mm_counted = mm_get_stats(&mm_stats[i].mm);
+#endif
+#if MM_THREADS
+            size_t heap_bytes = mem_peak_heapsize();
+#endif
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
+
+            /* With -I, wait until no other worker is running at all */
+            isolate_lock(LOCK_EX);
+#if MM_THREADS
+            /*
+             * Each thread needs room for a heap as large as the one the
+             * trace grew to above, and with per-thread arenas only gets an
+             * even share of the heap area, less some slack
+             */
+            bool fits = heap_bytes * num_threads < MAX_DENSE_HEAP / 10 * 9;
+            if (num_threads > 1 && !fits && verbose > 0)
+                printf("\n%s: live set too large for %d threads, timing "
+                       "single-threaded\n",
+                       trace->filename, num_threads);
+            if (num_threads > 1 && fits && !sparse_mode)
+            {
+                /* Every thread replays the whole trace */
+                mm_stats[i].secs = eval_mm_speed_mt(trace, num_threads);
+                mm_stats[i].ops = (double)trace->num_ops * num_threads;
+            }
+            else
+            {
+                mm_stats[i].secs =
+                    sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
+                mm_stats[i].evented = events_mode && !sparse_mode;
+            }
+#else
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
+            mm_stats[i].evented = events_mode && !sparse_mode;
+#endif
+            if (mm_stats[i].evented)
+                get_fcyc_events(&mm_stats[i].events);
+            if (latency_mode && !sparse_mode)
+                eval_mm_latency(trace, &mm_stats[i]);
+            isolate_lock(LOCK_SH);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
         }
 
@@ -362,6 +629,150 @@ static void run_tests(int num_tracefiles, const char *tracedir,
 /**************
  * Main routine
  **************/
+/* What a worker of run_tests_parallel sends back for its trace */
+typedef struct
+{
+    stats_t stats;
+    int errors;
+} worker_result_t;
+
+/*
+ * run_tests_parallel - run_tests with up to num_jobs traces at a time.
+ *     Each trace is run by a forked worker with a simulated heap of its
+ *     own, pinned to one CPU (a CPU of its own unless there are more jobs
+ *     than CPUs), which sends its stats back over a pipe.  A worker that
+ *     dies leaves its trace marked invalid.  With
+ *     isolate_timing, a worker only times its trace once every other
+ *     worker is waiting, so that caches, memory bandwidth and the clock
+ *     frequency budget are not shared while timing, as in a serial run.
+ */
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *mm_stats,
+                               speed_t *speed_params)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int num_cpus = 0;
+    int k;
+
+    /* Hand out the CPUs this process may run on to the workers in turn */
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        unix_error("sched_getaffinity failed in run_tests_parallel");
+    for (k = 0; k < CPU_SETSIZE; k++)
+        if (CPU_ISSET(k, &allowed))
+            cpus[num_cpus++] = k;
+    int jobs = num_jobs < CPU_SETSIZE ? num_jobs : CPU_SETSIZE;
+    if (verbose > 1)
+        printf("Running %d traces at a time on %d CPUs\n", jobs, num_cpus);
+
+    char lock_path[] = "/tmp/mdriver-lock-XXXXXX";
+    if (isolate_timing)
+    {
+        int fd = mkstemp(lock_path);
+        if (fd < 0)
+            unix_error("mkstemp failed in run_tests_parallel");
+        close(fd);
+    }
+
+    /* The timeout applies to each worker rather than to the whole run */
+    alarm(0);
+
+    pid_t pids[CPU_SETSIZE];
+    int fds[CPU_SETSIZE];
+    int slot_trace[CPU_SETSIZE];
+    int next = 0;
+    int running = 0;
+    for (k = 0; k < jobs; k++)
+        pids[k] = 0;
+
+    while (next < num_tracefiles || running > 0)
+    {
+        /* Start a worker in every free slot */
+        for (k = 0; k < jobs && next < num_tracefiles; k++)
+        {
+            if (pids[k] != 0)
+                continue;
+            int fd[2];
+            if (pipe(fd) < 0)
+                unix_error("pipe failed in run_tests_parallel");
+            fflush(NULL);
+            pid_t pid = fork();
+            if (pid < 0)
+                unix_error("fork failed in run_tests_parallel");
+            if (pid == 0)
+            {
+                worker_result_t result;
+                cpu_set_t cpu;
+                close(fd[0]);
+                CPU_ZERO(&cpu);
+                CPU_SET(cpus[k % num_cpus], &cpu);
+                if (sched_setaffinity(0, sizeof(cpu), &cpu) < 0)
+                    unix_error("sched_setaffinity failed in worker");
+                if (isolate_timing)
+                {
+                    /* A descriptor of its own, so the lock is its own too */
+                    if ((isolate_fd = open(lock_path, O_RDWR)) < 0)
+                        unix_error("Could not open %s in worker", lock_path);
+                    isolate_lock(LOCK_SH);
+                }
+                if (set_timeout > 0)
+                    alarm(set_timeout);
+
+                memset(&result, 0, sizeof(result));
+                run_tests(1, tracedir, &tracefiles[next], &result.stats,
+                          speed_params);
+                result.errors = errors;
+                if (write(fd[1], &result, sizeof(result)) != sizeof(result))
+                    unix_error("write failed in worker");
+                fflush(NULL);
+                _exit(0);
+            }
+            close(fd[1]);
+            pids[k] = pid;
+            fds[k] = fd[0];
+            slot_trace[k] = next++;
+            running++;
+        }
+
+        /* Collect the results of the next worker to finish */
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+            unix_error("waitpid failed in run_tests_parallel");
+        for (k = 0; k < jobs && pids[k] != pid; k++)
+            ;
+        if (k == jobs)
+            continue;
+
+        worker_result_t result;
+        int i = slot_trace[k];
+        if (read(fds[k], &result, sizeof(result)) == sizeof(result))
+        {
+            mm_stats[i] = result.stats;
+            errors += result.errors;
+        }
+        else
+        {
+            errors++;
+            strcpy(mm_stats[i].filename, tracedir);
+            strcat(mm_stats[i].filename, tracefiles[i]);
+            mm_stats[i].valid = false;
+            if (WIFSIGNALED(status))
+                printf("ERROR [trace %s]: worker killed by signal %d\n",
+                       mm_stats[i].filename, WTERMSIG(status));
+            else
+                printf("ERROR [trace %s]: worker exited with status %d\n",
+                       mm_stats[i].filename, WEXITSTATUS(status));
+        }
+        close(fds[k]);
+        pids[k] = 0;
+        running--;
+    }
+
+    if (isolate_timing)
+        unlink(lock_path);
+}
+
 int main(int argc, char **argv)
 {
     int i;
@@ -388,7 +799,8 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv,
+                       "d:f:c:j:s:t:v:F:H:N:P:hpbgzBCEILORSVAlDT")) != EOF)
     {
         switch (c)
         {
@@ -425,6 +837,10 @@ int main(int argc, char **argv)
             run_libc = true;
             break;
 
+        case 'B': /* Convert the traces to binary and exit */
+            convert_traces = true;
+            break;
+
         case 'V': /* Increase verbosity level */
             verbose += 1;
             break;
@@ -449,6 +865,74 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'N': /* Replay each trace on this many threads when timing */
+            num_threads = atoi(optarg);
+            if (num_threads < 1)
+                app_error("-N needs a positive thread count\n");
+            if (!MM_THREADS && num_threads > 1)
+                app_error("-N requires a driver built with MM_THREADS "
+                          "(mdriver-threads)\n");
+            break;
+
+        case 'j': /* Run this many traces at a time */
+            num_jobs = atoi(optarg);
+            if (num_jobs < 1)
+                app_error("-j needs a positive number of jobs\n");
+            break;
+
+        case 'E': /* Count hardware events while timing */
+            events_mode = true;
+            break;
+
+        case 'I': /* Time the traces of -j one at a time */
+            isolate_timing = true;
+            break;
+
+        case 'L': /* Report latency percentiles of each request type */
+            latency_mode = true;
+            break;
+
+        case 'P': /* Write a heap profile of each trace */
+            profile_ops = atoi(optarg);
+            if (profile_ops < 1)
+                app_error("-P needs a positive number of ops\n");
+            break;
+
+        case 'S': /* Report the allocator's own counters */
+            counters_mode = true;
+            break;
+
+        case 'R': /* Check overlaps with the splay tree */
+            splay_ranges = true;
+            break;
+
+        case 'b': /* Replay runs of requests through the batch calls */
+            batch_mode = true;
+            break;
+
+        case 'g': /* Replay regions through the region calls */
+            region_mode = true;
+            break;
+
+        case 'z': /* Replay reallocs through mm_realloc_sized */
+            sized_realloc = true;
+            break;
+
+        case 'H': /* Back the heap with huge pages */
+            for (heap_pages = MEM_PAGES_DEFAULT;
+                 heap_pages <= MEM_PAGES_HUGETLB; heap_pages++)
+                if (strcmp(optarg, page_names[heap_pages]) == 0)
+                    break;
+            if (heap_pages > MEM_PAGES_HUGETLB)
+                app_error("-H needs default, thp or hugetlb\n");
+            break;
+
+        case 'F': /* Fault in the start of the heap */
+            if (atoi(optarg) < 0)
+                app_error("-F needs a number of MB\n");
+            prefault_mb = (size_t)atoi(optarg);
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -458,7 +942,31 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
+    if (num_jobs > 1 && num_threads > 1)
+        app_error("-j pins each trace to one CPU, so it cannot be used "
+                  "with -N\n");
+    /*
+     * Open the counters here to find out whether any can be, and workers
+     * of -j reopen them for themselves.  Events the hardware or a VM
+     * does not count print as --
+     */
+    if (events_mode && !sparse_mode)
+    {
+        int counted = set_fcyc_events(1);
+        if (counted == 0)
+        {
+            fprintf(stderr, "Warning: no hardware events can be counted "
+                            "(see /proc/sys/kernel/perf_event_paranoid), "
+                            "ignoring -E\n");
+            set_fcyc_events(0);
+            events_mode = false;
+        }
+        else if (num_threads > 1)
+            fprintf(stderr, "Warning: -E only counts traces timed on a "
+                            "single thread\n");
+    }
 #endif /* !REF_ONLY */
+    mem_set_pages(heap_pages, prefault_mb << 20);
 
     if (num_global_tracefiles == 0)
     {
@@ -472,6 +980,19 @@ int main(int argc, char **argv)
             add_tracefile(default_tracefiles[i]);
     }
 
+    /* Write a binary copy of every trace instead of running them */
+    if (convert_traces)
+    {
+        for (i = 0; i < num_global_tracefiles; i++)
+        {
+            stats_t stats;
+            trace_t *trace = read_trace(&stats, tracedir, global_tracefiles[i]);
+            write_bin_trace(trace);
+            free_trace(trace);
+        }
+        exit(0);
+    }
+
     if (debug_mode != DBG_NONE)
     {
         init_random_data();
@@ -512,6 +1033,9 @@ int main(int argc, char **argv)
                 if (verbose > 1)
                     printf("and performance.\n");
                 libc_stats[i].secs = fsec(eval_libc_speed, &speed_params);
+                libc_stats[i].evented = events_mode;
+                if (events_mode)
+                    get_fcyc_events(&libc_stats[i].events);
             }
             free_trace(trace);
         }
@@ -542,6 +1066,8 @@ int main(int argc, char **argv)
     {
         printf("Throughput targets: min=%.0f, max=%.0f, benchmark=%.0f\n",
                min_throughput, max_throughput, ref_throughput);
+        if (num_threads > 1)
+            printf("Timing each trace on %d threads\n", num_threads);
     }
 #endif
 
@@ -556,8 +1082,12 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
-              &speed_params);
+    if (num_jobs > 1 && !onetime_flag)
+        run_tests_parallel(num_global_tracefiles, tracedir, global_tracefiles,
+                           mm_stats, &speed_params);
+    else
+        run_tests(num_global_tracefiles, tracedir, global_tracefiles,
+                  mm_stats, &speed_params);
 
     /* Display the mm results in a compact table */
     if (verbose)
@@ -582,6 +1112,16 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (latency_mode && !sparse_mode)
+            {
+                printlatency(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
+            if (counters_mode)
+            {
+                printcounters(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
         }
     }
 
@@ -778,12 +1318,190 @@ static void add_tracefile(char *trace)
  */
 static range_set_t *new_range_set()
 {
-    range_set_t *ranges = (range_set_t *)malloc(sizeof(range_set_t));
-    ranges->list = NULL;
-    ranges->lo_tree = tree_new();
+    range_set_t *ranges = (range_set_t *)calloc(1, sizeof(range_set_t));
+    if (ranges == NULL)
+        unix_error("malloc error in new_range_set");
+    ranges->flat = !splay_ranges;
+    if (!ranges->flat)
+        ranges->lo_tree = tree_new();
     return ranges;
 }
 
+/*
+ * overlap_error - Report that the payload lo:hi of request opnum overlaps
+ *     the payload olo:ohi of another block, if it does
+ */
+static bool overlap_error(const trace_t *trace, int opnum, char *lo, char *hi,
+                          char *olo, char *ohi)
+{
+    if (lo > ohi || hi < olo)
+        return false;
+    malloc_error(trace, opnum,
+                 "Payload (%p:%p) overlaps another payload (%p:%p)\n", lo, hi,
+                 olo, ohi);
+    return true;
+}
+
+/*
+ * flat_chunk - Index of the chunk of the flat index that holds lo, or
+ *     would hold it: the last chunk starting at or below lo, else the first
+ */
+static size_t flat_chunk(const range_set_t *ranges, const char *lo)
+{
+    size_t l = 0;
+    size_t h = ranges->num_chunks;
+    while (h - l > 1)
+    {
+        size_t m = l + (h - l) / 2;
+        if (ranges->chunk_lo[m] <= lo)
+            l = m;
+        else
+            h = m;
+    }
+    return l;
+}
+
+/*
+ * flat_slot - Number of entries of the chunk that start at or below lo
+ */
+static int flat_slot(const range_chunk_t *chunk, const char *lo)
+{
+    int l = 0;
+    int h = chunk->count;
+    while (l < h)
+    {
+        int m = (l + h) / 2;
+        if (chunk->entries[m].lo <= lo)
+            l = m + 1;
+        else
+            h = m;
+    }
+    return l;
+}
+
+/*
+ * flat_new_chunk - Put an empty chunk at position pos of the flat index
+ */
+static range_chunk_t *flat_new_chunk(range_set_t *ranges, size_t pos)
+{
+    if (ranges->num_chunks == ranges->max_chunks)
+    {
+        ranges->max_chunks = ranges->max_chunks ? 2 * ranges->max_chunks : 64;
+        ranges->chunks = realloc(ranges->chunks, ranges->max_chunks *
+                                                     sizeof(range_chunk_t *));
+        ranges->chunk_lo =
+            realloc(ranges->chunk_lo, ranges->max_chunks * sizeof(char *));
+        if (ranges->chunks == NULL || ranges->chunk_lo == NULL)
+            unix_error("malloc error in flat_new_chunk");
+    }
+
+    range_chunk_t *chunk = ranges->spares;
+    if (chunk)
+        ranges->spares = chunk->next;
+    else if ((chunk = (range_chunk_t *)malloc(sizeof(range_chunk_t))) == NULL)
+        unix_error("malloc error in flat_new_chunk");
+    chunk->count = 0;
+
+    size_t after = ranges->num_chunks - pos;
+    memmove(&ranges->chunks[pos + 1], &ranges->chunks[pos],
+            after * sizeof(range_chunk_t *));
+    memmove(&ranges->chunk_lo[pos + 1], &ranges->chunk_lo[pos],
+            after * sizeof(char *));
+    ranges->chunks[pos] = chunk;
+    ranges->num_chunks++;
+    return chunk;
+}
+
+/*
+ * flat_add - Add the payload lo:hi to the flat index, unless it overlaps
+ *     the payload before or after it
+ */
+static bool flat_add(range_set_t *ranges, char *lo, char *hi,
+                     const trace_t *trace, int opnum, int index)
+{
+    if (ranges->num_chunks == 0)
+        flat_new_chunk(ranges, 0);
+
+    size_t c = flat_chunk(ranges, lo);
+    range_chunk_t *chunk = ranges->chunks[c];
+    int slot = flat_slot(chunk, lo);
+
+    /* See if it overlaps previous or next blocks */
+    const range_entry_t *prev = slot > 0 ? &chunk->entries[slot - 1] : NULL;
+    const range_entry_t *next = NULL;
+    if (slot < chunk->count)
+        next = &chunk->entries[slot];
+    else if (c + 1 < ranges->num_chunks)
+        next = &ranges->chunks[c + 1]->entries[0];
+    if (prev && overlap_error(trace, opnum, lo, hi, prev->lo, prev->hi))
+        return false;
+    if (next && overlap_error(trace, opnum, lo, hi, next->lo, next->hi))
+        return false;
+
+    /* Split a full chunk, moving its upper half into a new one */
+    if (chunk->count == RANGE_CHUNK)
+    {
+        const int half = RANGE_CHUNK / 2;
+        range_chunk_t *upper = flat_new_chunk(ranges, c + 1);
+        memcpy(upper->entries, &chunk->entries[half],
+               half * sizeof(range_entry_t));
+        upper->count = half;
+        chunk->count = half;
+        ranges->chunk_lo[c + 1] = upper->entries[0].lo;
+        if (slot > half)
+        {
+            chunk = upper;
+            slot -= half;
+            c++;
+        }
+    }
+
+    memmove(&chunk->entries[slot + 1], &chunk->entries[slot],
+            (chunk->count - slot) * sizeof(range_entry_t));
+    chunk->entries[slot].lo = lo;
+    chunk->entries[slot].hi = hi;
+    chunk->entries[slot].index = index;
+    chunk->count++;
+    if (slot == 0)
+        ranges->chunk_lo[c] = lo;
+    return true;
+}
+
+/*
+ * flat_remove - Remove the payload starting at lo from the flat index;
+ *     chunks that empty go back to the spares
+ */
+static void flat_remove(range_set_t *ranges, char *lo)
+{
+    if (ranges->num_chunks == 0)
+        return;
+
+    size_t c = flat_chunk(ranges, lo);
+    range_chunk_t *chunk = ranges->chunks[c];
+    int slot = flat_slot(chunk, lo) - 1;
+    if (slot < 0 || chunk->entries[slot].lo != lo)
+        return;
+
+    chunk->count--;
+    memmove(&chunk->entries[slot], &chunk->entries[slot + 1],
+            (chunk->count - slot) * sizeof(range_entry_t));
+    if (chunk->count > 0)
+    {
+        if (slot == 0)
+            ranges->chunk_lo[c] = chunk->entries[0].lo;
+        return;
+    }
+
+    chunk->next = ranges->spares;
+    ranges->spares = chunk;
+    ranges->num_chunks--;
+    size_t after = ranges->num_chunks - c;
+    memmove(&ranges->chunks[c], &ranges->chunks[c + 1],
+            after * sizeof(range_chunk_t *));
+    memmove(&ranges->chunk_lo[c], &ranges->chunk_lo[c + 1],
+            after * sizeof(char *));
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
@@ -820,24 +1538,17 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     if (debug_mode == DBG_NONE)
         return 1;
 
+    if (ranges->flat)
+        return flat_add(ranges, lo, hi, trace, opnum, index);
+
     /* Look in the tree for the predecessor block */
     range_t *prev = tree_find_nearest(ranges->lo_tree, (long unsigned)lo);
     range_t *next = prev ? prev->next : NULL;
     /* See if it overlaps previous or next blocks */
-    if (prev && lo <= prev->hi)
-    {
-        malloc_error(trace, opnum,
-                     "Payload (%p:%p) overlaps another payload (%p:%p)\n", lo,
-                     hi, prev->lo, prev->hi);
+    if (prev && overlap_error(trace, opnum, lo, hi, prev->lo, prev->hi))
         return false;
-    }
-    if (next && hi >= next->lo)
-    {
-        malloc_error(trace, opnum,
-                     "Payload (%p:%p) overlaps another payload (%p:%p)\n", lo,
-                     hi, next->lo, next->hi);
+    if (next && overlap_error(trace, opnum, lo, hi, next->lo, next->hi))
         return false;
-    }
     /*
      * Everything looks OK, so remember the extent of this block
      * by creating a range struct and adding it the range list.
@@ -865,6 +1576,12 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
  */
 static void remove_range(range_set_t *ranges, char *lo)
 {
+    if (ranges->flat)
+    {
+        flat_remove(ranges, lo);
+        return;
+    }
+
     range_t *p = (range_t *)tree_remove(ranges->lo_tree, (long unsigned)lo);
     if (!p)
         return;
@@ -879,12 +1596,49 @@ static void remove_range(range_set_t *ranges, char *lo)
     free(p);
 }
 
+/*
+ * check_ranges - Check the data of every block in the range set, as of
+ *     request opnum
+ */
+static bool check_ranges(const trace_t *trace, const range_set_t *ranges,
+                         int opnum)
+{
+    bool ok = true;
+    if (!ranges->flat)
+    {
+        for (range_t *r = ranges->list; r; r = r->next)
+            if (!check_index(trace, opnum, r->index))
+                ok = false;
+        return ok;
+    }
+
+    for (size_t c = 0; c < ranges->num_chunks; c++)
+    {
+        const range_chunk_t *chunk = ranges->chunks[c];
+        for (int j = 0; j < chunk->count; j++)
+            if (!check_index(trace, opnum, chunk->entries[j].index))
+                ok = false;
+    }
+    return ok;
+}
+
 /*
  * free_range_set - free all of the range records for a trace
  */
 static void free_range_set(range_set_t *ranges)
 {
-    tree_free(ranges->lo_tree, free);
+    if (ranges->lo_tree)
+        tree_free(ranges->lo_tree, free);
+    for (size_t c = 0; c < ranges->num_chunks; c++)
+        free(ranges->chunks[c]);
+    while (ranges->spares)
+    {
+        range_chunk_t *next = ranges->spares->next;
+        free(ranges->spares);
+        ranges->spares = next;
+    }
+    free(ranges->chunks);
+    free(ranges->chunk_lo);
     free(ranges);
 }
 
@@ -1006,30 +1760,20 @@ static bool check_index(const trace_t *trace, int opnum, int index)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * parse_trace - read the header and requests of the text trace named by
+ *     trace->filename into trace
  */
-static trace_t *read_trace(stats_t *stats, const char *tracedir,
-                           const char *filename)
+static void parse_trace(trace_t *trace)
 {
     FILE *tracefile;
-    trace_t *trace;
     char type[MAXLINE];
     int index;
-    size_t size;
-    int max_index = 0;
+    size_t size, align;
+    int max_index = -1;
     int op_index;
     int ignore = 0;
 
-    if (verbose > 1)
-        printf("Reading tracefile: %s\n", filename);
-
-    /* Allocate the trace record */
-    if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
-        unix_error("malloc 1 failed in read_trace");
-
     /* Read the trace file header */
-    strcpy(trace->filename, tracedir);
-    strcat(trace->filename, filename);
     if ((tracefile = fopen(trace->filename, "r")) == NULL)
     {
         unix_error("Could not open %s in read_trace", trace->filename);
@@ -1051,26 +1795,12 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
              (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
         unix_error("malloc 2 failed in read_trace");
 
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))) ==
-        NULL)
-        unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes =
-             (size_t *)calloc(trace->num_ids, sizeof(size_t))) == NULL)
-        unix_error("malloc 4 failed in read_trace");
-
-    /* and, if we're debugging, the offset into the random data */
-    if ((trace->block_rand_base =
-             calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
-        unix_error("malloc 5 failed in read_trace");
-
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
     while (fscanf(tracefile, "%s", type) != EOF)
     {
+        trace->ops[op_index].align_shift = 0;
         switch (type[0])
         {
         case 'a':
@@ -1091,6 +1821,36 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             ignore += fscanf(tracefile, "%u", &index);
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
+            trace->ops[op_index].size = 0;
+            break;
+        case 'm':
+            ignore += fscanf(tracefile, "%u %lu %lu", &index, &align, &size);
+            if (align == 0 || (align & (align - 1)) != 0)
+                app_error("Alignment %zu of request %d in tracefile %s is "
+                          "not a power of two\n",
+                          align, op_index, trace->filename);
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].align_shift =
+                (unsigned char)__builtin_ctzl(align);
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 's':
+            ignore += fscanf(tracefile, "%u %lu", &index, &size);
+            trace->ops[op_index].type = FREE_SIZED;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            break;
+        case 'b':
+            trace->ops[op_index].type = REGION_BEGIN;
+            trace->ops[op_index].index = 0;
+            trace->ops[op_index].size = 0;
+            break;
+        case 'e':
+            trace->ops[op_index].type = REGION_END;
+            trace->ops[op_index].index = 0;
+            trace->ops[op_index].size = 0;
             break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
@@ -1103,6 +1863,188 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
+}
+
+/*
+ * check_ops - Check what the requests of a trace, parsed or mapped, mean
+ *     together: regions do not nest, every block allocated in a region is
+ *     freed before it ends, and a sized free gives the size asked for its
+ *     block.  A single read-only pass over the requests.
+ */
+static void check_ops(const trace_t *trace)
+{
+    int region_op = -1; /* the "b" of the open region, if any */
+    int region_live = 0;
+    unsigned char *live;
+    size_t *sizes;
+
+    /*
+     * Whether each id is allocated, and if so whether in the open region,
+     * whose blocks must all be freed before it ends, and the size asked
+     */
+    if ((live = (unsigned char *)calloc(trace->num_ids, 1)) == NULL ||
+        (sizes = (size_t *)calloc(trace->num_ids, sizeof(size_t))) == NULL)
+        unix_error("malloc failed in check_ops");
+
+    for (int i = 0; i < trace->num_ops; i++)
+    {
+        const traceop_t *op = &trace->ops[i];
+        switch (op->type)
+        {
+        case REGION_BEGIN:
+            if (region_op >= 0)
+                app_error("Region of request %d in tracefile %s begins "
+                          "inside the region of request %d\n",
+                          i, trace->filename, region_op);
+            region_op = i;
+            continue;
+        case REGION_END:
+            if (region_op < 0)
+                app_error("Request %d in tracefile %s ends no region\n", i,
+                          trace->filename);
+            if (region_live > 0)
+                app_error("Region of request %d in tracefile %s ends with "
+                          "%d of its blocks still allocated\n",
+                          region_op, trace->filename, region_live);
+            region_op = -1;
+            continue;
+        case FREE_SIZED:
+            if (op->index >= 0 && op->index < trace->num_ids &&
+                op->size != sizes[op->index])
+                app_error("%s: request %d frees block %d as %zu bytes, but "
+                          "%zu were asked for it\n",
+                          trace->filename, i, op->index, op->size,
+                          sizes[op->index]);
+            break;
+        default:
+            break;
+        }
+
+        /* Follow the blocks allocated in the open region */
+        if (op->index >= 0 && op->index < trace->num_ids)
+        {
+            unsigned char *state = &live[op->index];
+            if (*state == 2)
+                region_live--;
+            if (op->type == FREE || op->type == FREE_SIZED)
+                *state = 0;
+            else if (*state == 0 || op->type != REALLOC)
+                *state = (region_op >= 0) ? 2 : 1;
+            if (*state == 2)
+                region_live++;
+            sizes[op->index] = (*state == 0) ? 0 : op->size;
+        }
+    }
+    free(live);
+    free(sizes);
+    if (region_op >= 0)
+        app_error("Region of request %d in tracefile %s never ends\n",
+                  region_op, trace->filename);
+}
+
+/*
+ * find_realloc_sizes - Fill in trace->realloc_from with the size each
+ *     realloc request resizes its block from, the size last asked for the
+ *     block, or 0 if it is not allocated; block_sizes is used as scratch
+ */
+static void find_realloc_sizes(trace_t *trace)
+{
+    if ((trace->realloc_from =
+             calloc(trace->num_ops, sizeof(size_t))) == NULL)
+        unix_error("malloc 6 failed in read_trace");
+    for (int i = 0; i < trace->num_ops; i++)
+    {
+        const traceop_t *op = &trace->ops[i];
+        switch (op->type)
+        {
+        case REALLOC:
+            trace->realloc_from[i] = trace->block_sizes[op->index];
+            /* fall through */
+        case ALLOC:
+        case MEMALIGN:
+            trace->block_sizes[op->index] = op->size;
+            break;
+        case FREE:
+        case FREE_SIZED:
+            if (op->index >= 0)
+                trace->block_sizes[op->index] = 0;
+            break;
+        default:
+            break;
+        }
+    }
+    memset(trace->block_sizes, 0, trace->num_ids * sizeof(size_t));
+}
+
+/*
+ * read_trace - read a trace file and store it in memory
+ */
+static trace_t *read_trace(stats_t *stats, const char *tracedir,
+                           const char *filename)
+{
+    trace_t *trace;
+
+    if (verbose > 1)
+        printf("Reading tracefile: %s\n", filename);
+
+    /* Allocate the trace record */
+    if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
+        unix_error("malloc 1 failed in read_trace");
+    trace->map = NULL;
+    trace->map_bytes = 0;
+
+    /*
+     * Map a binary trace, either the file itself or an up-to-date .bin
+     * copy of a text trace; only fall back to parsing the text otherwise
+     */
+    strcpy(trace->filename, tracedir);
+    strcat(trace->filename, filename);
+    size_t len = strlen(trace->filename);
+    char bin_path[MAXLINE];
+    struct stat rep_stat, bin_stat;
+    bool is_bin = len > 4 && strcmp(trace->filename + len - 4, ".bin") == 0;
+    bool have_bin = false;
+    if (is_bin)
+    {
+        if (!map_bin_trace(trace, trace->filename))
+            app_error("%s is not a binary trace for this driver",
+                      trace->filename);
+    }
+    else if (!convert_traces && len > 4 &&
+             strcmp(trace->filename + len - 4, ".rep") == 0)
+    {
+        strcpy(bin_path, trace->filename);
+        strcpy(bin_path + len - 4, ".bin");
+        /* Only trust a .bin written after the last edit of the .rep */
+        have_bin = stat(trace->filename, &rep_stat) == 0 &&
+                   stat(bin_path, &bin_stat) == 0 &&
+                   (bin_stat.st_mtim.tv_sec > rep_stat.st_mtim.tv_sec ||
+                    (bin_stat.st_mtim.tv_sec == rep_stat.st_mtim.tv_sec &&
+                     bin_stat.st_mtim.tv_nsec > rep_stat.st_mtim.tv_nsec));
+    }
+    if (!is_bin && (!have_bin || !map_bin_trace(trace, bin_path)))
+        parse_trace(trace);
+    check_ops(trace);
+
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))) ==
+        NULL)
+        unix_error("malloc 3 failed in read_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes =
+             (size_t *)calloc(trace->num_ids, sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in read_trace");
+
+    /* and, if we're debugging, the offset into the random data */
+    if ((trace->block_rand_base =
+             calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+        unix_error("malloc 5 failed in read_trace");
+
+    /* and, with -z, the size each realloc resizes its block from */
+    trace->realloc_from = NULL;
+    if (sized_realloc)
+        find_realloc_sizes(trace);
 
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
@@ -1112,6 +2054,104 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     return trace;
 }
 
+/*
+ * map_bin_trace - map the requests of a binary trace into memory and
+ *     fill in the header fields of trace from it.  Returns false, leaving
+ *     the trace untouched, if path does not hold a binary trace written
+ *     by a driver of the same BIN_VERSION and traceop_t size.
+ */
+static bool map_bin_trace(trace_t *trace, const char *path)
+{
+    bin_header_t hdr;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, BIN_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != BIN_VERSION || hdr.op_bytes != sizeof(traceop_t) ||
+        hdr.num_ops < 0 || hdr.num_ids < 0 ||
+        (size_t)st.st_size !=
+            sizeof(hdr) + (size_t)hdr.num_ops * sizeof(traceop_t))
+    {
+        close(fd);
+        return false;
+    }
+
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE; /* fault the ops in now rather than while timed */
+#endif
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        unix_error("mmap failed for %s in read_trace", path);
+
+    /* The records are used as they are, so check they are in range here,
+       and what they mean together in check_ops, as for a text trace */
+    traceop_t *ops = (traceop_t *)((char *)map + sizeof(hdr));
+    for (int i = 0; i < hdr.num_ops; i++)
+    {
+        if (ops[i].type > REGION_END || ops[i].index >= hdr.num_ids ||
+            (ops[i].index < 0 && ops[i].type != FREE) ||
+            ops[i].align_shift >= 8 * sizeof(size_t))
+        {
+            app_error("Bogus request %d in binary trace %s\n", i, path);
+        }
+    }
+
+    trace->weight = hdr.weight;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->data_bytes = hdr.data_bytes;
+    trace->ops = ops;
+    trace->map = map;
+    trace->map_bytes = (size_t)st.st_size;
+    if (trace->weight > 3)
+    {
+        app_error("%s: weight can only be in {0, 1, 2 3}", path);
+    }
+    return true;
+}
+
+/*
+ * write_bin_trace - write the requests of a trace as a binary trace,
+ *     named after the trace file with its .rep suffix replaced by .bin
+ */
+static void write_bin_trace(const trace_t *trace)
+{
+    char path[MAXLINE];
+    size_t len = strlen(trace->filename);
+    if (len < 4 || strcmp(trace->filename + len - 4, ".rep") != 0)
+        app_error("%s: only .rep traces can be converted", trace->filename);
+    strcpy(path, trace->filename);
+    strcpy(path + len - 4, ".bin");
+
+    bin_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BIN_MAGIC, sizeof(hdr.magic));
+    hdr.version = BIN_VERSION;
+    hdr.weight = trace->weight;
+    hdr.num_ids = trace->num_ids;
+    hdr.num_ops = trace->num_ops;
+    hdr.op_bytes = sizeof(traceop_t);
+    hdr.data_bytes = trace->data_bytes;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        unix_error("Could not open %s in write_bin_trace", path);
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, f) !=
+            (size_t)trace->num_ops ||
+        fclose(f) != 0)
+    {
+        unix_error("Could not write %s in write_bin_trace", path);
+    }
+    if (verbose > 0)
+        printf("%s -> %s\n", trace->filename, path);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -1128,10 +2168,14 @@ static void reinit_trace(trace_t *trace)
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops); /* free the three arrays... */
+    if (trace->map != NULL) /* a binary trace's ops are mapped... */
+        munmap(trace->map, trace->map_bytes);
+    else
+        free(trace->ops); /* free the three arrays... */
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->realloc_from);
     free(trace); /* and the trace record itself... */
 }
 
@@ -1140,6 +2184,64 @@ static void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * trace_memalign, trace_free_sized - The mm calls behind memalign and
+ *     sized free requests.  The reference allocator has neither, so
+ *     mdriver-ref gives up on a memalign and frees a sized free with
+ *     mm_free.
+ */
+static void *trace_memalign(const traceop_t *op __attribute__((unused)))
+{
+#if REF_ONLY
+    app_error("mdriver-ref cannot replay memalign requests");
+#else
+    return mm_memalign((size_t)1 << op->align_shift, op->size);
+#endif
+}
+
+static void trace_free_sized(void *p, size_t size __attribute__((unused)))
+{
+#if REF_ONLY
+    mm_free(p);
+#else
+    mm_free_sized(p, size);
+#endif
+}
+
+/*
+ * trace_realloc - The mm call behind realloc request i of a trace:
+ *     mm_realloc_sized with -z, and otherwise, or in mdriver-ref,
+ *     mm_realloc
+ */
+static void *trace_realloc(const trace_t *trace, int i, void *p)
+{
+#if !REF_ONLY
+    if (trace->realloc_from != NULL)
+        return mm_realloc_sized(p, trace->realloc_from[i],
+                                trace->ops[i].size);
+#endif
+    return mm_realloc(p, trace->ops[i].size);
+}
+
+/*
+ * trace_region - The mm call behind a region request, made only with -g;
+ *     otherwise, and in mdriver-ref, the blocks of a region are simply
+ *     freed one by one as the trace says.  Returns false if
+ *     mm_region_begin fails.
+ */
+static bool trace_region(const traceop_t *op __attribute__((unused)))
+{
+#if !REF_ONLY
+    if (region_mode)
+    {
+        if (op->type == REGION_BEGIN)
+            return mm_region_begin();
+        mm_region_release();
+    }
+#endif
+    return true;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -1172,8 +2274,6 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
         if (debug_mode == DBG_EXPENSIVE)
         {
-            range_t *r;
-
             /* Let the students check their own heap */
             if (!mm_checkheap(0))
             {
@@ -1182,17 +2282,23 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             };
 
             /* Now check that all our allocated blocks have the right data */
-            r = ranges->list;
-            while (r)
+            if (!check_ranges(trace, ranges, i))
             {
-                if (!check_index(trace, i, r->index))
-                {
-                    allCheck = false;
-                }
-                r = r->next;
+                allCheck = false;
             }
         }
 
+#if !REF_ONLY
+        int n = batch_run(trace, i);
+        if (n > 0)
+        {
+            if (!eval_mm_valid_batch(trace, ranges, i, n, &allCheck))
+                return false;
+            i += n - 1;
+            continue;
+        }
+#endif
+
         switch (trace->ops[i].type)
         {
 
@@ -1230,7 +2336,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             /* Call the student's realloc */
             oldp = trace->blocks[index];
             setUBCheck(false);
-            newp = mm_realloc(oldp, size);
+            newp = trace_realloc(trace, i, oldp);
             setUBCheck(true);
             if ((newp == NULL) && (size != 0))
             {
@@ -1294,6 +2400,50 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             mm_free(p);
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            if ((p = trace_memalign(&trace->ops[i])) == NULL)
+            {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return false;
+            }
+            if (((uintptr_t)p &
+                 (((size_t)1 << trace->ops[i].align_shift) - 1)) != 0)
+            {
+                malloc_error(trace, i,
+                             "mm_memalign returned %p, which is not "
+                             "aligned to %zu bytes.",
+                             p, (size_t)1 << trace->ops[i].align_shift);
+                return false;
+            }
+            if (add_range(ranges, p, size, trace, i, index) == 0)
+                return false;
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            break;
+
+        case FREE_SIZED: /* mm_free_sized */
+            if (!check_index(trace, i, index))
+            {
+                allCheck = false;
+            }
+            p = trace->blocks[index];
+            remove_range(ranges, p);
+            trace_free_sized(p, size);
+            break;
+
+        case REGION_BEGIN: /* mm_region_begin */
+            if (!trace_region(&trace->ops[i]))
+            {
+                malloc_error(trace, i, "mm_region_begin failed.");
+                return false;
+            }
+            break;
+
+        case REGION_END: /* mm_region_release */
+            trace_region(&trace->ops[i]);
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -1302,15 +2452,67 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     return allCheck;
 }
 
+#if !REF_ONLY
+/*
+ * eval_mm_valid_batch - Run the n requests from op i, found by batch_run,
+ *    through the batch calls, and check each block as eval_mm_valid does.
+ *    Returns false on an error that ends the trace; a block whose data
+ *    was clobbered only clears *allCheck.
+ */
+static bool eval_mm_valid_batch(trace_t *trace, range_set_t *ranges, int i,
+                                int n, bool *allCheck)
+{
+    void *batch[BATCH_MAX];
+    size_t size = trace->ops[i].size;
+    int k, index;
+
+    if (trace->ops[i].type == ALLOC)
+    {
+        if (mm_malloc_batch(size, n, batch) < (size_t)n)
+        {
+            malloc_error(trace, i, "mm_malloc_batch failed.");
+            return false;
+        }
+        for (k = 0; k < n; k++)
+        {
+            index = trace->ops[i + k].index;
+            if (add_range(ranges, batch[k], size, trace, i + k, index) == 0)
+                return false;
+            trace->blocks[index] = batch[k];
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+        }
+        return true;
+    }
+
+    for (k = 0; k < n; k++)
+    {
+        index = trace->ops[i + k].index;
+        if (!check_index(trace, i + k, index))
+            *allCheck = false;
+        if (index == -1)
+        {
+            batch[k] = NULL;
+        }
+        else
+        {
+            batch[k] = trace->blocks[index];
+            remove_range(ranges, batch[k]);
+        }
+    }
+    mm_free_batch(batch, n);
+    return true;
+}
+#endif /* !REF_ONLY */
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes while running the student's malloc
+ *   package on the trace. Since the heap can shrink, this is taken from
+ *   mem_peak_heapsize() rather than the size of the heap at the end.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -1323,90 +2525,408 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     size_t total_size = 0;
     char *p;
     char *newp, *oldp;
+#if !REF_ONLY
+    FILE *prof = NULL;
+#endif
 
     reinit_trace(trace);
 
-    /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
-    if (!mm_init())
-        app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+    /* initialize the heap and the mm malloc package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+#if !REF_ONLY
+    if (profile_ops > 0)
+        prof = profile_open(trace);
+#endif
+
+    for (i = 0; i < trace->num_ops; i++)
+    {
+#if !REF_ONLY
+        int n = batch_run(trace, i);
+        if (n > 0)
+        {
+            if (!replay_batch(trace, trace->blocks, i, n))
+                app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                          tracenum);
+
+            /* A run only grows or only shrinks the payload, so the
+               high-water mark is reached at one of its ends */
+            for (; n > 0; n--, i++)
+            {
+                index = trace->ops[i].index;
+                if (trace->ops[i].type == ALLOC)
+                {
+                    trace->block_sizes[index] = trace->ops[i].size;
+                    total_size += trace->ops[i].size;
+                }
+                else if (index >= 0)
+                {
+                    total_size -= trace->block_sizes[index];
+                }
+                max_total_size = (total_size > max_total_size)
+                                     ? total_size
+                                     : max_total_size;
+                if (prof != NULL &&
+                    ((i + 1) % profile_ops == 0 || i + 1 == trace->num_ops))
+                    profile_heap(prof, i + 1, total_size);
+            }
+            i--;
+            continue;
+        }
+#endif
+        switch (trace->ops[i].type)
+        {
+
+        case ALLOC: /* mm_alloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+
+            if ((p = mm_malloc(size)) == NULL)
+            {
+                app_error("trace %d: mm_malloc failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember region and size */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            index = trace->ops[i].index;
+            newsize = trace->ops[i].size;
+            oldsize = trace->block_sizes[index];
+
+            oldp = trace->blocks[index];
+            setUBCheck(false);
+            if ((newp = trace_realloc(trace, i, oldp)) == NULL &&
+                newsize != 0)
+            {
+                app_error("trace %d: mm_realloc failed in eval_mm_util",
+                          tracenum);
+            }
+            setUBCheck(true);
+
+            /* Remember region and size */
+            trace->blocks[index] = newp;
+            trace->block_sizes[index] = newsize;
+
+            total_size += (newsize - oldsize);
+            break;
+
+        case FREE: /* mm_free */
+            index = trace->ops[i].index;
+            if (index < 0)
+            {
+                size = 0;
+                p = 0;
+            }
+            else
+            {
+                size = trace->block_sizes[index];
+                p = trace->blocks[index];
+            }
+
+            mm_free(p);
+
+            total_size -= size;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+
+            if ((p = trace_memalign(&trace->ops[i])) == NULL)
+            {
+                app_error("trace %d: mm_memalign failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember region and size */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
+        case FREE_SIZED: /* mm_free_sized */
+            index = trace->ops[i].index;
+            size = trace->block_sizes[index];
+            trace_free_sized(trace->blocks[index], size);
+
+            total_size -= size;
+            break;
+
+        case REGION_BEGIN: /* mm_region_begin */
+        case REGION_END:   /* mm_region_release */
+            if (!trace_region(&trace->ops[i]))
+                app_error("mm_region_begin error in eval_mm_util");
+            break;
+
+        default:
+            app_error("trace %d: Nonexistent request type in eval_mm_util",
+                      tracenum);
+        }
+
+        /* update the high-water mark */
+        max_total_size =
+            (total_size > max_total_size) ? total_size : max_total_size;
+
+#if !REF_ONLY
+        if (prof != NULL &&
+            ((i + 1) % profile_ops == 0 || i + 1 == trace->num_ops))
+            profile_heap(prof, i + 1, total_size);
+#endif
+    }
+
+#if !REF_ONLY
+    if (prof != NULL)
+        fclose(prof);
+    printf(".");
+#endif
+
+    return ((double)max_total_size / (double)mem_peak_heapsize());
+}
+
+#if !REF_ONLY
+/*
+ * profile_open - Create the heap profile of a trace: <trace>.prof.csv in
+ *    the current directory, named after the trace without its extension
+ */
+static FILE *profile_open(const trace_t *trace)
+{
+    char path[MAXLINE];
+    const char *name = strrchr(trace->filename, '/');
+    const char *ext;
+    FILE *prof;
+    int k;
+
+    name = name ? name + 1 : trace->filename;
+    ext = strrchr(name, '.');
+    snprintf(path, sizeof(path), "%.*s.prof.csv",
+             ext ? (int)(ext - name) : (int)strlen(name), name);
+    if ((prof = fopen(path, "w")) == NULL)
+        unix_error("Could not open %s in profile_open", path);
+
+    fprintf(prof, "ops,heap,payload,free,free_blocks,largest,frag");
+    for (k = 0; k < PROFILE_CLASSES; k++)
+        fprintf(prof, ",free%zu", (size_t)16 << k);
+    fprintf(prof, ",map\n");
+    return prof;
+}
+
+/*
+ * profile_visit - Called by mm_heap_walk for each block. The first walk
+ *    totals the free blocks and finds where the heap ends, the second
+ *    spreads free bytes over the cells of the map.
+ */
+static void profile_visit(void *block, size_t size, bool alloc, void *arg)
+{
+    profile_t *p = (profile_t *)arg;
+    size_t off = (size_t)((char *)block - p->lo);
+    int k;
+
+    if (p->cell == 0)
+    {
+        p->end = off + size;
+        if (alloc)
+            return;
+        for (k = 0; k < PROFILE_CLASSES - 1 && size >= ((size_t)32 << k); k++)
+            ;
+        p->class_bytes[k] += size;
+        p->free_bytes += size;
+        p->free_blocks++;
+        if (size > p->largest)
+            p->largest = size;
+        return;
+    }
+
+    while (!alloc && size > 0)
+    {
+        size_t c = off / p->cell;
+        size_t n = (c + 1) * p->cell - off;
+        if (n > size)
+            n = size;
+        p->cell_free[c < PROFILE_CELLS ? c : PROFILE_CELLS - 1] += n;
+        off += n;
+        size -= n;
+    }
+}
+
+/*
+ * profile_heap - Add a row to a heap profile, for the heap after ops
+ *    requests with payload bytes in use: the heap size, the free bytes,
+ *    free block count and largest free block, external fragmentation
+ *    (1 - largest / free), the free bytes of each size class, and a map
+ *    of the heap from its start to the end of its last block, one digit
+ *    per cell from 0 (all free) to 9 (all in use).
+ */
+static void profile_heap(FILE *prof, int ops, size_t payload)
+{
+    profile_t p;
+    char map[PROFILE_CELLS + 1];
+    int k;
+
+    memset(&p, 0, sizeof(p));
+    p.lo = mem_heap_lo();
+    mm_heap_walk(profile_visit, &p);
+    p.cell = (p.end + PROFILE_CELLS - 1) / PROFILE_CELLS;
+    if (p.cell != 0)
+        mm_heap_walk(profile_visit, &p);
+
+    for (k = 0; k < PROFILE_CELLS; k++)
+    {
+        size_t lo = p.cell * k;
+        size_t hi = (lo + p.cell < p.end) ? lo + p.cell : p.end;
+        size_t used = (hi > lo + p.cell_free[k]) ? hi - lo - p.cell_free[k] : 0;
+        map[k] = (char)('0' + (hi > lo ? 9 * used / (hi - lo) : 0));
+    }
+    map[PROFILE_CELLS] = '\0';
+
+    fprintf(prof, "%d,%zu,%zu,%zu,%zu,%zu,%.4f", ops, mem_heapsize(),
+            payload, p.free_bytes, p.free_blocks, p.largest,
+            p.free_bytes ? 1.0 - (double)p.largest / p.free_bytes : 0.0);
+    for (k = 0; k < PROFILE_CLASSES; k++)
+        fprintf(prof, ",%zu", p.class_bytes[k]);
+    fprintf(prof, ",%s\n", map);
+}
+#endif /* !REF_ONLY */
+
+#if !REF_ONLY
+/*
+ * batch_run - Count the requests from op i on that -b hands to one batch
+ *    call: allocs of the same size, or frees, up to BATCH_MAX of them.
+ *    Returns 0 without -b, or if there are fewer than two.
+ */
+static int batch_run(const trace_t *trace, int i)
+{
+    const traceop_t *op = &trace->ops[i];
+    int n = 1;
+
+    if (!batch_mode || (op->type != ALLOC && op->type != FREE) ||
+        (op->type == ALLOC && op->size == 0))
+        return 0;
+    while (n < BATCH_MAX && i + n < trace->num_ops &&
+           trace->ops[i + n].type == op->type &&
+           (op->type == FREE || trace->ops[i + n].size == op->size))
+        n++;
+    return (n > 1) ? n : 0;
+}
+
+/*
+ * replay_batch - Run the n requests from op i, found by batch_run,
+ *    through mm_malloc_batch or mm_free_batch, keeping the returned
+ *    pointers in blocks.  Returns false if the allocs could not all be
+ *    served.
+ */
+static bool replay_batch(const trace_t *trace, char **blocks, int i, int n)
+{
+    void *batch[BATCH_MAX];
+    int k, index;
+
+    if (trace->ops[i].type == ALLOC)
+    {
+        if (mm_malloc_batch(trace->ops[i].size, n, batch) < (size_t)n)
+            return false;
+        for (k = 0; k < n; k++)
+            blocks[trace->ops[i + k].index] = batch[k];
+    }
+    else
+    {
+        for (k = 0; k < n; k++)
+        {
+            index = trace->ops[i + k].index;
+            batch[k] = (index < 0) ? NULL : blocks[index];
+        }
+        mm_free_batch(batch, n);
+    }
+    return true;
+}
+#endif /* !REF_ONLY */
+
+/*
+ * replay_mm_ops - Run every request of a trace through the mm package,
+ *    keeping the returned pointers in blocks.  Used for timing, so it
+ *    does no checking beyond failed requests.
+ */
+static void replay_mm_ops(const trace_t *trace, char **blocks)
+{
+    int i, index;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
 
+    /* Interpret each trace request */
     for (i = 0; i < trace->num_ops; i++)
     {
+#if !REF_ONLY
+        int n = batch_run(trace, i);
+        if (n > 0)
+        {
+            if (!replay_batch(trace, blocks, i, n))
+                app_error("mm_malloc_batch error in eval_mm_speed");
+            i += n - 1;
+            continue;
+        }
+#endif
         switch (trace->ops[i].type)
         {
 
-        case ALLOC: /* mm_alloc */
+        case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-
             if ((p = mm_malloc(size)) == NULL)
-            {
-                app_error("trace %d: mm_malloc failed in eval_mm_util",
-                          tracenum);
-            }
-
-            /* Remember region and size */
-            trace->blocks[index] = p;
-            trace->block_sizes[index] = size;
-
-            total_size += size;
+                app_error("mm_malloc error in eval_mm_speed");
+            blocks[index] = p;
             break;
 
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
-            oldsize = trace->block_sizes[index];
-
-            oldp = trace->blocks[index];
+            oldp = blocks[index];
             setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-            {
-                app_error("trace %d: mm_realloc failed in eval_mm_util",
-                          tracenum);
-            }
+            if ((newp = trace_realloc(trace, i, oldp)) == NULL &&
+                newsize != 0)
+                app_error("mm_realloc error in eval_mm_speed");
             setUBCheck(true);
-
-            /* Remember region and size */
-            trace->blocks[index] = newp;
-            trace->block_sizes[index] = newsize;
-
-            total_size += (newsize - oldsize);
+            blocks[index] = newp;
             break;
 
         case FREE: /* mm_free */
             index = trace->ops[i].index;
             if (index < 0)
             {
-                size = 0;
-                p = 0;
+                block = 0;
             }
             else
             {
-                size = trace->block_sizes[index];
-                p = trace->blocks[index];
+                block = blocks[index];
             }
+            mm_free(block);
+            break;
 
-            mm_free(p);
+        case MEMALIGN: /* mm_memalign */
+            if ((p = trace_memalign(&trace->ops[i])) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            blocks[trace->ops[i].index] = p;
+            break;
 
-            total_size -= size;
+        case FREE_SIZED: /* mm_free_sized */
+            trace_free_sized(blocks[trace->ops[i].index], trace->ops[i].size);
+            break;
+
+        case REGION_BEGIN: /* mm_region_begin */
+        case REGION_END:   /* mm_region_release */
+            if (!trace_region(&trace->ops[i]))
+                app_error("mm_region_begin error in eval_mm_speed");
             break;
 
         default:
-            app_error("trace %d: Nonexistent request type in eval_mm_util",
-                      tracenum);
+            app_error("Nonexistent request type in eval_mm_speed");
         }
-
-        /* update the high-water mark */
-        max_total_size =
-            (total_size > max_total_size) ? total_size : max_total_size;
     }
-
-#if !REF_ONLY
-    printf(".");
-#endif
-
-    return ((double)max_total_size / (double)mem_heapsize());
 }
 
 /*
@@ -1415,9 +2935,6 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
@@ -1426,46 +2943,218 @@ static void eval_mm_speed(void *ptr)
     if (!mm_init())
         app_error("mm_init failed in eval_mm_speed");
 
-    /* Interpret each trace request */
+    replay_mm_ops(trace, trace->blocks);
+}
+
+/* lat_bucket - the latency histogram bucket that holds t ticks */
+static int lat_bucket(uint64_t t)
+{
+    if (t < (1 << LAT_SUB_BITS))
+        return (int)t;
+    int shift = 63 - __builtin_clzll(t) - LAT_SUB_BITS;
+    int bucket = (shift << LAT_SUB_BITS) + (int)(t >> shift);
+    return bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1;
+}
+
+/* lat_bucket_top - the largest number of ticks in a bucket */
+static uint64_t lat_bucket_top(int bucket)
+{
+    if (bucket < (2 << LAT_SUB_BITS))
+        return (uint64_t)bucket;
+    int shift = (bucket >> LAT_SUB_BITS) - 1;
+    uint64_t first = (uint64_t)(bucket - (shift << LAT_SUB_BITS)) << shift;
+    return first + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * eval_mm_latency - Replay a trace once more, reading the time stamp
+ *    counter around every request and adding its ticks to the histogram
+ *    of its type in stats.  The requests are the same as in
+ *    replay_mm_ops; only the two counter reads and a bucket increment are
+ *    added to each, so the mix of requests stays that of the trace.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
+{
+    int i, index;
+    char *p;
+    uint64_t start;
+    char **blocks = trace->blocks;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_latency");
+
     for (i = 0; i < trace->num_ops; i++)
-        switch (trace->ops[i].type)
+    {
+        const traceop_t *op = &trace->ops[i];
+        index = op->index;
+        switch (op->type)
         {
-
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+            start = read_tsc();
+            p = mm_malloc(op->size);
+            stats->lat_hist[ALLOC][lat_bucket(read_tsc() - start)]++;
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            blocks[index] = p;
             break;
 
         case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
             setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
+            start = read_tsc();
+            p = trace_realloc(trace, i, blocks[index]);
+            stats->lat_hist[REALLOC][lat_bucket(read_tsc() - start)]++;
             setUBCheck(true);
-            trace->blocks[index] = newp;
+            if (p == NULL && op->size != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            blocks[index] = p;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            if (index < 0)
-            {
-                block = 0;
-            }
-            else
-            {
-                block = trace->blocks[index];
-            }
-            mm_free(block);
+            p = index < 0 ? NULL : blocks[index];
+            start = read_tsc();
+            mm_free(p);
+            stats->lat_hist[FREE][lat_bucket(read_tsc() - start)]++;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            start = read_tsc();
+            p = trace_memalign(op);
+            stats->lat_hist[MEMALIGN][lat_bucket(read_tsc() - start)]++;
+            if (p == NULL)
+                app_error("mm_memalign error in eval_mm_latency");
+            blocks[index] = p;
+            break;
+
+        case FREE_SIZED: /* mm_free_sized */
+            p = blocks[index];
+            start = read_tsc();
+            trace_free_sized(p, op->size);
+            stats->lat_hist[FREE_SIZED][lat_bucket(read_tsc() - start)]++;
+            break;
+
+        case REGION_BEGIN: /* mm_region_begin, not timed */
+        case REGION_END:   /* mm_region_release, not timed */
+            if (!trace_region(op))
+                app_error("mm_region_begin error in eval_mm_latency");
             break;
 
         default:
-            app_error("Nonexistent request type in eval_mm_speed");
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+    }
+}
+
+#if MM_THREADS
+/* Arguments for one replay thread in multi-threaded mode */
+typedef struct
+{
+    const trace_t *trace;
+    char **blocks;              /* this thread's copy of trace->blocks */
+    pthread_barrier_t *barrier; /* released once all threads are ready */
+    double start;               /* wall time when this thread started */
+    double end;                 /* wall time when this thread finished */
+} replay_args_t;
+
+static double wall_time(void);
+
+/* Body of a replay thread: wait for the others, then run the trace */
+static void *replay_thread(void *ptr)
+{
+    replay_args_t *args = (replay_args_t *)ptr;
+    pthread_barrier_wait(args->barrier);
+    args->start = wall_time();
+    replay_mm_ops(args->trace, args->blocks);
+    args->end = wall_time();
+    return NULL;
+}
+
+/* Wall-clock time in seconds */
+static double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/*
+ * eval_mm_speed_mt - Replay the trace concurrently on nthreads threads
+ *    sharing one mm heap, and return the wall-clock seconds of the fastest
+ *    of MT_REPS runs.  Thread CPU timers (as used by fsec) would not see
+ *    lock contention, so wall time is measured instead, from the first
+ *    thread starting to the last thread finishing.
+ */
+static double eval_mm_speed_mt(trace_t *trace, int nthreads)
+{
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    replay_args_t *args = calloc(nthreads, sizeof(replay_args_t));
+    pthread_barrier_t barrier;
+    double best = DBL_MAX;
+    int rep, t;
+
+    if (tids == NULL || args == NULL)
+        unix_error("calloc failed in eval_mm_speed_mt");
+    for (t = 0; t < nthreads; t++)
+    {
+        args[t].trace = trace;
+        args[t].barrier = &barrier;
+        args[t].blocks = calloc(trace->num_ids, sizeof(char *));
+        if (args[t].blocks == NULL)
+            unix_error("calloc failed in eval_mm_speed_mt");
+    }
+
+    for (rep = 0; rep < MT_REPS; rep++)
+    {
+        mem_reset_brk();
+        if (!mm_init())
+            app_error("mm_init failed in eval_mm_speed_mt");
+
+        /* Start all threads together, once every one has been created */
+        pthread_barrier_init(&barrier, NULL, nthreads);
+        for (t = 0; t < nthreads; t++)
+        {
+            if (pthread_create(&tids[t], NULL, replay_thread, &args[t]) != 0)
+                unix_error("pthread_create failed in eval_mm_speed_mt");
+        }
+        double start = DBL_MAX;
+        double end = 0.0;
+        for (t = 0; t < nthreads; t++)
+        {
+            pthread_join(tids[t], NULL);
+            start = (args[t].start < start) ? args[t].start : start;
+            end = (args[t].end > end) ? args[t].end : end;
         }
+        double secs = end - start;
+        pthread_barrier_destroy(&barrier);
+
+        if (secs < best)
+            best = secs;
+    }
+
+    for (t = 0; t < nthreads; t++)
+        free(args[t].blocks);
+    free(args);
+    free(tids);
+    return best;
+}
+#endif /* MM_THREADS */
+
+/*
+ * libc_memalign - Serve a memalign request with posix_memalign, which
+ *    takes no alignment smaller than a pointer
+ */
+static int libc_memalign(const traceop_t *op, char **p)
+{
+    size_t align = (size_t)1 << op->align_shift;
+    void *mem;
+    int err;
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    err = posix_memalign(&mem, align, op->size);
+    *p = mem;
+    return err;
 }
 
 /*
@@ -1518,6 +3207,23 @@ static bool eval_libc_valid(trace_t *trace)
             }
             break;
 
+        case MEMALIGN: /* posix_memalign */
+            if (libc_memalign(&trace->ops[i], &p) != 0)
+            {
+                malloc_error(trace, i, "libc posix_memalign failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
+        case FREE_SIZED: /* free */
+            free(trace->blocks[trace->ops[i].index]);
+            break;
+
+        case REGION_BEGIN: /* libc has no regions */
+        case REGION_END:
+            break;
+
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1575,6 +3281,16 @@ static void eval_libc_speed(void *ptr)
                 free(0);
             }
             break;
+
+        case MEMALIGN: /* posix_memalign */
+            if (libc_memalign(&trace->ops[i], &p) != 0)
+                unix_error("posix_memalign failed in eval_libc_speed");
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
+        case FREE_SIZED: /* free */
+            free(trace->blocks[trace->ops[i].index]);
+            break;
         }
     }
 }
@@ -1583,6 +3299,183 @@ static void eval_libc_speed(void *ptr)
  * Some miscellaneous helper routines
  ************************************/
 
+/*
+ * lat_percentile - the latency in ns below which fraction q of the
+ *     requests in a histogram fall, or -1 if it is empty
+ */
+static double lat_percentile(const unsigned int *hist, double q)
+{
+    uint64_t total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+        total += hist[b];
+    if (total == 0)
+        return -1.0;
+
+    uint64_t rank = (uint64_t)ceil(q * (double)total);
+    for (b = 0; b < LAT_BUCKETS - 1; b++)
+    {
+        seen += hist[b];
+        if (seen >= rank)
+            break;
+    }
+    return (double)lat_bucket_top(b) / tsc_ghz();
+}
+
+/* print_lat_row - prints the percentiles of one row of printlatency */
+static void print_lat_row(unsigned int hist[LAT_OPS][LAT_BUCKETS],
+                          const char *name)
+{
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    int op, k;
+
+    for (op = 0; op < LAT_OPS; op++)
+        for (k = 0; k < 3; k++)
+        {
+            double ns = lat_percentile(hist[op], quantiles[k]);
+            if (tab_mode && ns < 0)
+                printf("\t");
+            else if (tab_mode)
+                printf("%.0f\t", ns);
+            else if (ns < 0)
+                printf("%*s", k == 0 ? 8 : 7, "-");
+            else
+                printf("%*.0f", k == 0 ? 8 : 7, ns);
+        }
+    printf(tab_mode ? "%s\n" : "  %s\n", name);
+}
+
+/*
+ * printlatency - prints the p50, p99 and p99.9 latencies in ns of each
+ *     request type on each trace timed by -L, and over all of them
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    static unsigned int all[LAT_OPS][LAT_BUCKETS];
+    int i, op, b;
+
+    if (tab_mode)
+    {
+        printf("m50\tm99\tm999\tf50\tf99\tf999\tr50\tr99\tr999\t"
+               "a50\ta99\ta999\ts50\ts99\ts999\ttrace\n");
+    }
+    else
+    {
+        printf("Latency in ns:\n");
+        printf("%22s%22s%22s%22s%22s\n", "mm_malloc", "mm_free", "mm_realloc",
+               "mm_memalign", "mm_free_sized");
+        for (op = 0; op < LAT_OPS; op++)
+            printf("%8s%7s%7s", "p50", "p99", "p99.9");
+        printf("  %s\n", "trace");
+    }
+
+    memset(all, 0, sizeof(all));
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        print_lat_row(stats[i].lat_hist, stats[i].filename);
+        for (op = 0; op < LAT_OPS; op++)
+            for (b = 0; b < LAT_BUCKETS; b++)
+                all[op][b] += stats[i].lat_hist[op][b];
+    }
+    print_lat_row(all, "all");
+}
+
+/*
+ * printcounters - prints the counters mm.c kept while util was measured
+ *     on each trace (see mm_get_stats), and with -V the free blocks left
+ *     in each seglist bucket at the end
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    int i, b;
+    bool any = false;
+
+    for (i = 0; i < n; i++)
+        any |= stats[i].valid && stats[i].mm_counted;
+    if (!any)
+    {
+        printf("No allocator counters: build mm.c with -DMM_STATS=1.\n");
+        return;
+    }
+
+    if (tab_mode)
+        printf("fits\tprobes\tmisses\tsplits\tcoal1\tcoal2\tcoal3\t"
+               "coal4\textends\textKB\tcopies\tcopyKB\ttrace\n");
+    else
+    {
+        printf("Allocator counters:\n");
+        printf("%9s%7s%8s%8s%32s%8s%8s%7s%8s  %s\n", "fits", "probe",
+               "misses", "splits", "coalesce:none  next  prev  both",
+               "extends", "extKB", "copies", "copyKB", "trace");
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        const mm_stats_t *c = &stats[i].mm;
+        if (!stats[i].valid || !stats[i].mm_counted)
+            continue;
+        double probes = c->fits ? (double)c->fit_probes / c->fits : 0.0;
+        if (tab_mode)
+            printf("%zu\t%.2f\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t"
+                   "%zu\t%zu\t%s\n",
+                   c->fits, probes, c->fit_misses, c->splits,
+                   c->coalesces[0], c->coalesces[1], c->coalesces[2],
+                   c->coalesces[3], c->extends, c->extend_bytes / 1024,
+                   c->realloc_copies, c->realloc_copy_bytes / 1024,
+                   stats[i].filename);
+        else
+            printf("%9zu%7.2f%8zu%8zu%14zu%6zu%6zu%6zu%8zu%8zu%7zu%8zu  %s\n",
+                   c->fits, probes, c->fit_misses, c->splits,
+                   c->coalesces[0], c->coalesces[1], c->coalesces[2],
+                   c->coalesces[3], c->extends, c->extend_bytes / 1024,
+                   c->realloc_copies, c->realloc_copy_bytes / 1024,
+                   stats[i].filename);
+
+        /* Non-empty buckets, as bucket:blocks/KB */
+        if (verbose > 1 && !tab_mode)
+        {
+            printf("%9s", "free:");
+            for (b = 0; b < MM_STATS_BUCKETS; b++)
+                if (c->bucket_blocks[b] != 0)
+                    printf(" %d:%zu/%zu", b, c->bucket_blocks[b],
+                           c->bucket_bytes[b] / 1024);
+            printf("\n");
+        }
+    }
+}
+
+/* Column names of the hardware events of -E, in fcyc.h order */
+static const char *const event_names[FCYC_NUM_EVENTS] = {
+    [FCYC_INSTRUCTIONS] = "insn/op", [FCYC_L1D_MISSES] = "L1/op",
+    [FCYC_LLC_MISSES] = "LLC/op",    [FCYC_DTLB_MISSES] = "TLB/op",
+    [FCYC_BRANCH_MISSES] = "br/op",
+};
+
+/*
+ * print_event_cols - prints the hardware events counted while timing a
+ *     trace as counts per request, or -- for those not counted
+ */
+static void print_event_cols(const stats_t *stats)
+{
+    int e;
+    for (e = 0; e < FCYC_NUM_EVENTS; e++)
+    {
+        double count = stats->evented ? stats->events.count[e] : -1.0;
+        if (count < 0.0 || stats->ops == 0)
+            printf(tab_mode ? "\t" : "%7s", tab_mode ? "" : "--");
+        else if (tab_mode)
+            printf("%.3f\t", count / stats->ops);
+        else
+            printf(e == FCYC_INSTRUCTIONS ? "%7.0f" : "%7.2f",
+                   count / stats->ops);
+    }
+    if (!tab_mode)
+        printf(" ");
+}
+
 /*
  * printresults - prints a performance summary for some malloc package and
  * returns a summary of the stats to the caller.
@@ -1603,14 +3496,26 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     char *tabstr;
 
     /* Print the individual results for each trace */
+    int e;
     if (tab_mode)
     {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\t");
+        if (events_mode)
+            for (e = 0; e < FCYC_NUM_EVENTS; e++)
+                printf("%s\t", event_names[e]);
+        printf("trace\n");
     }
     else
     {
-        printf("  %5s  %6s %7s%8s%8s  %s\n", "valid", "util", "ops", "msecs",
-               "Kops/s", "trace");
+        printf("  %5s  %6s %7s%8s%8s ", "valid", "util", "ops", "msecs",
+               "Kops/s");
+        if (events_mode)
+            for (e = 0; e < FCYC_NUM_EVENTS; e++)
+                printf("%7s", event_names[e]);
+        printf(" ");
+        if (verbose > 1)
+            printf("%6s ", "sbrks");
+        printf("%s\n", "trace");
     }
     for (i = 0; i < n; i++)
     {
@@ -1672,6 +3577,8 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
             if (tab_mode)
             {
                 printf("%.0f\t%.3f\t%.0f\t", stats[i].ops, msecs, kops);
+                if (events_mode)
+                    print_event_cols(&stats[i]);
             }
             else
             {
@@ -1681,6 +3588,10 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf("%8.0f%10.3f%7.0f ", stats[i].ops, msecs, kops);
                 else
                     printf("%8s%10s%7s ", "--", "--", "--");
+                if (events_mode)
+                    print_event_cols(&stats[i]);
+                if (verbose > 1)
+                    printf("%6.0f ", stats[i].sbrks);
             }
 
             printf("%s\n", stats[i].filename);
@@ -1702,7 +3613,11 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
         {
             if (tab_mode)
             {
-                printf("no\t\t\t\t\t\t\t%s\n", stats[i].filename);
+                printf("no\t\t\t\t\t\t\t");
+                if (events_mode)
+                    for (e = 0; e < FCYC_NUM_EVENTS; e++)
+                        printf("\t");
+                printf("%s\n", stats[i].filename);
             }
             else
             {
@@ -1759,6 +3674,41 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
         sumstats->secs = 0;
         sumstats->tput = 0;
     }
+
+    /*
+     * Say how memlib backed the heap, unless it was the plain default,
+     * since times taken with huge pages or pre-faulting do not compare
+     * with those taken without
+     */
+    int first = -1;
+    bool mixed = false;
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].paged)
+            continue;
+        if (first < 0)
+            first = i;
+        else if (stats[i].pages != stats[first].pages ||
+                 stats[i].prefaulted != stats[first].prefaulted)
+            mixed = true;
+    }
+    if (first >= 0 && (mixed || heap_pages != MEM_PAGES_DEFAULT ||
+                       prefault_mb > 0 ||
+                       stats[first].pages != MEM_PAGES_DEFAULT))
+    {
+        const char *name = mixed ? "mixed" : page_names[stats[first].pages];
+        size_t mb = stats[first].prefaulted >> 20;
+        if (tab_mode)
+            printf("Pages\t%s\t%zu\n", name, mixed ? 0 : mb);
+        else if (mixed)
+            printf("Heap pages: mixed, as the mode fell back on some "
+                   "traces\n");
+        else if (mb > 0)
+            printf("Heap pages: %s, first %zu MB faulted in up front\n",
+                   name, mb);
+        else
+            printf("Heap pages: %s\n", name);
+    }
 }
 
 /*
@@ -2013,7 +3963,9 @@ static double measure_ref_throughput(bool checkpoint)
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlVbgzBCdDEILRS] [-f <file>] [-N <n>] "
+                    "[-j <n>] [-P <n>] [-H <mode>] [-F <mb>]\n",
+            prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -2023,9 +3975,37 @@ static void usage(char *prog)
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-B         Write a binary copy (.bin) of each .rep "
+                    "trace and exit.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-N <n>     Time each trace replayed on <n> threads "
+                    "(mdriver-threads only).\n");
+    fprintf(stderr, "\t-j <n>     Run <n> traces at a time, each in a "
+                    "process pinned to a CPU.\n");
+    fprintf(stderr, "\t-E         Count cache, TLB and branch misses "
+                    "while timing.\n");
+    fprintf(stderr, "\t-I         With -j, time one trace at a time while "
+                    "the others wait.\n");
+    fprintf(stderr, "\t-L         Also time every request, and report "
+                    "latency percentiles.\n");
+    fprintf(stderr, "\t-P <n>     Profile the heap every <n> ops, into "
+                    "<trace>.prof.csv.\n");
+    fprintf(stderr, "\t-S         Report the counters of mm.c built with "
+                    "-DMM_STATS=1.\n");
+    fprintf(stderr, "\t-R         Check for overlapping blocks with a "
+                    "splay tree.\n");
+    fprintf(stderr, "\t-b         Replay runs of same-size allocs, and of "
+                    "frees, in batches.\n");
+    fprintf(stderr, "\t-g         Replay the regions of a trace through "
+                    "the region calls.\n");
+    fprintf(stderr, "\t-z         Replay reallocs through "
+                    "mm_realloc_sized.\n");
+    fprintf(stderr, "\t-H <mode>  Back the heap with default, thp or "
+                    "hugetlb pages.\n");
+    fprintf(stderr, "\t-F <mb>    Fault in the first <mb> MB of the heap "
+                    "up front.\n");
 }
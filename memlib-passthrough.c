@@ -5,17 +5,37 @@
  * This file allows compiling student malloc implementations so that they can
  * be used as an interpositioning library, and thereby run actual programs.
  */
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "memlib.h"
 
+/* Maximum number of regions, including the main heap as region 0 */
+#define MAX_REGIONS 16
+
+/* A separately mapped region that grows independently of the heap */
+typedef struct {
+    unsigned char *base; /* First byte of the region */
+    unsigned char *brk;  /* Current break of the region */
+    unsigned char *max;  /* End of the mapping */
+    unsigned char *peak; /* Highest break of the region */
+} mem_region_t;
+
 /* private global variables */
 static bool init = false;
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static size_t peak_bytes = 0;       /* High-water mark of heap size */
+static size_t sbrk_calls = 0;       /* Calls that grew the heap */
+static unsigned char *zero_start;   /* Start of the zeros handed out last */
+static mem_region_t regions[MAX_REGIONS]; /* Regions; slot 0 is unused */
+static int num_regions = 1;               /* Number of regions, with heap */
 
 static void ensure_init(void) {
     if (!init) {
@@ -35,9 +55,102 @@ void *mem_sbrk(intptr_t incr) {
 
     assert(res == mem_brk);
     mem_brk += incr;
+    if (incr > 0) {
+        sbrk_calls++;
+        // the system hands out zeros above the highest break so far
+        zero_start = (res > heap + peak_bytes) ? res : heap + peak_bytes;
+    }
+    if ((size_t)(mem_brk - heap) > peak_bytes) {
+        peak_bytes = (size_t)(mem_brk - heap);
+    }
     return (void *) res;
 }
 
+int mem_map_region(size_t size) {
+    if (num_regions == MAX_REGIONS) {
+        return -1;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    mem_region_t *r = &regions[num_regions];
+    r->base = base;
+    r->brk = base;
+    r->max = r->base + size;
+    r->peak = base;
+    return num_regions++;
+}
+
+void *mem_region_sbrk(int region, intptr_t incr) {
+    if (region == 0) {
+        return mem_sbrk(incr);
+    }
+
+    assert(region > 0 && region < num_regions);
+    mem_region_t *r = &regions[region];
+    unsigned char *old_brk = r->brk;
+    if (incr < 0) {
+        if (-incr > r->brk - r->base) {
+            errno = EINVAL;
+            return (void *)-1;
+        }
+        r->brk += incr;
+        // hand the whole pages above the new break back to the system
+        size_t pagesize = mem_pagesize();
+        uintptr_t lo = ((uintptr_t)r->brk + pagesize - 1) & ~(pagesize - 1);
+        if (lo < (uintptr_t)old_brk) {
+            madvise((void *)lo, (uintptr_t)old_brk - lo, MADV_DONTNEED);
+        }
+        return (void *)old_brk;
+    }
+    if (incr > r->max - r->brk) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    r->brk += incr;
+    sbrk_calls += (incr > 0);
+    zero_start = (old_brk > r->peak) ? old_brk : r->peak;
+    if (r->brk > r->peak) {
+        r->peak = r->brk;
+    }
+    return (void *)old_brk;
+}
+
+void *mem_map(size_t size) {
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return (void *)-1;
+    }
+    zero_start = addr;
+    return addr;
+}
+
+int mem_unmap(void *addr, size_t size) {
+    return munmap(addr, size);
+}
+
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+    void *res = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+    if (res == MAP_FAILED) {
+        return (void *)-1;
+    }
+    if (new_size > old_size) {
+        // the pages added after the old ones are new
+        size_t pagesize = mem_pagesize();
+        size_t kept = (old_size + pagesize - 1) & ~(pagesize - 1);
+        zero_start = (unsigned char *)res + (kept < new_size ? kept : new_size);
+    }
+    return res;
+}
+
+void *mem_zero_start(void) {
+    return (void *)zero_start;
+}
+
 void *mem_heap_lo(void) {
     ensure_init();
     return (void *)heap;
@@ -53,6 +166,23 @@ size_t mem_heapsize(void) {
     return (size_t)(mem_brk - heap);
 }
 
+size_t mem_peak_heapsize(void) {
+    ensure_init();
+    return peak_bytes;
+}
+
+size_t mem_sbrk_calls(void) {
+    return sbrk_calls;
+}
+
 size_t mem_pagesize(void) {
     return (size_t)getpagesize();
 }
+
+void *mem_memcpy(void *dst, const void *src, size_t n) {
+    return memcpy(dst, src, n);
+}
+
+void *mem_memset(void *dst, int c, size_t n) {
+    return memset(dst, c, n);
+}
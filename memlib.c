@@ -14,6 +14,10 @@
  * map(emulated address / PAGE_SIZE) -> mem_block_t
  * map(mem_block_t, emulated address % PAGE_SIZE) -> byte(s)
  *
+ * The first map is a radix tree over the page ID, whose nodes take the
+ *  place of pages in the same pool, fronted by a small cache of the pages
+ *  used last.
+ *
  * This mapping is for a single address; however, accesses can span two blocks
  *  so the mapping sequence checks accounts for size and can perform two
  *  lookups if necessary.
@@ -58,29 +62,91 @@ void markGlobalsUninit(void);
 typedef struct MBLK
 {
     size_t id;         /* Page ID.  Counts number of pages from start of heap */
-    struct MBLK *next; /* Link for hash table */
+    struct MBLK *next; /* Link for lists of free or moving pages */
     unsigned char initSet[SPARSE_PAGE_SIZE / 8];
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/*
+ * The page table is a radix tree of RADIX_LEVELS levels, each indexing
+ *  RADIX_BITS bits of the page ID, which covers the IDs of MAX_SPARSE_HEAP
+ *  bytes of pages.  A node is taken from the pool of pages, so it must fit
+ *  in one.
+ */
+#define RADIX_BITS 7
+#define RADIX_FANOUT (1 << RADIX_BITS)
+#define RADIX_LEVELS 8
+
+typedef union RNODE
+{
+    union RNODE *child[RADIX_FANOUT]; /* Inner levels */
+    mem_block_t *page[RADIX_FANOUT];  /* Last level */
+} radix_node_t;
+
+_Static_assert(sizeof(radix_node_t) <= sizeof(mem_block_t),
+               "a radix node must fit in a page");
+
+/* Number of entries in the cache of pages, indexed by page ID */
+#define PAGE_CACHE_SIZE 64
+
+/* Maximum number of regions, including the main heap as region 0 */
+#define MAX_REGIONS 16
+
+/* A region of the heap area that grows independently of the main heap */
+typedef struct
+{
+    unsigned char *base; /* First byte of the region */
+    unsigned char *brk;  /* Current break of the region */
+    unsigned char *max;  /* End of the space reserved for the region */
+} mem_region_t;
+
+/* Maximum number of spans in the area handed out by mem_map */
+#define MAX_MAPS 1024
+
+/* A span of the mapping area, either mapped or a hole left by mem_unmap */
+typedef struct
+{
+    unsigned char *base; /* First byte of the span */
+    size_t size;         /* Length of the span */
+    bool live;           /* Is the span mapped? */
+} mem_map_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static unsigned char *mem_floor;    /* Lowest address reserved by a region */
+static mem_region_t regions[MAX_REGIONS]; /* Regions; slot 0 is unused */
+static int num_regions = 1;               /* Number of regions, with heap */
+static mem_map_t maps[MAX_MAPS];          /* Spans, in address order */
+static int num_maps = 0;                  /* Number of spans */
+static size_t mapped_bytes = 0;           /* Bytes in mapped spans */
+static size_t peak_bytes = 0;             /* High-water mark of heap size */
+static size_t sbrk_calls = 0;             /* Calls that grew the heap */
+static unsigned char *unused_lo;    /* Space not handed out since mem_init */
+static unsigned char *unused_hi;    /*   lies between these two */
+static unsigned char *zero_start;   /* Start of the zeros handed out last */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
+static mem_pages_t pages_wanted = MEM_PAGES_DEFAULT; /* Set by mem_set_pages */
+static size_t prefault_wanted = 0;                   /*   likewise */
+static mem_pages_t pages_used = MEM_PAGES_DEFAULT;   /* Mode of mem_init */
+static size_t prefault_done = 0;                     /* Bytes it faulted in */
 static bool show_stats =
     false; /* Should program print allocation information? */
 static bool stats_printed =
     false; /* Has information been printed about allocation */
 
 /* Sparse memory representation */
+static mem_block_t *page_pool = NULL;      /* Pages, and nodes of the table */
 static mem_block_t *next_free_page = NULL; /* Next free page */
+static mem_block_t *released_pages = NULL; /* Pages given back by unmaps */
 static size_t num_pages = 0;               /* Total number of pages */
 static size_t num_free_pages = 0;          /* Number of free pages */
-static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
-static size_t num_buckets = 0;             /* Number of buckets in page table */
+static size_t num_nodes = 0;               /* Pages used as table nodes */
+static radix_node_t *page_root = NULL;     /* Page table from ID to page */
+static mem_block_t *page_cache[PAGE_CACHE_SIZE]; /* Pages used last */
 
 #ifdef NO_CHECK_UB
 static const bool checkUB = false;
@@ -113,7 +179,15 @@ const char *__msan_default_options()
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static void flush_page_cache(void);
+static bool is_emulated(const void *addr, size_t len);
+static void release_pages(unsigned char *lo, size_t size);
+static void move_pages(unsigned char *from, unsigned char *to, size_t size);
+static void note_size(void);
+static void release_brk(unsigned char *brk, unsigned char *old_brk);
+static void note_handout(unsigned char *lo, unsigned char *hi, bool top);
 static void print_stats();
+static void *map_pages(void *start, size_t length);
 
 /*
  * mem_init - initialize the memory system model
@@ -124,16 +198,10 @@ void mem_init(bool do_sparse)
     if (sparse)
     {
         /* Want sparse total allocation to approximately match the dense heap
-         * size */
-        /* Account for both page itself and its amortized contribution to the
-         * page table */
-        double fbytes_per_page =
-            sizeof(mem_block_t) + sizeof(mem_block_t *) / HASH_LOAD;
-        num_pages = (size_t)(MAX_DENSE_HEAP / fbytes_per_page);
-        num_buckets = num_pages / HASH_LOAD;
-        mmap_length = num_buckets * sizeof(mem_block_t *) + // Page table
-                      num_pages * sizeof(mem_block_t) +     // Pages
-                      sizeof(uint64_t);                     // Padding
+         * size.  The nodes of the page table come out of the same pages */
+        num_pages = MAX_DENSE_HEAP / sizeof(mem_block_t);
+        mmap_length = num_pages * sizeof(mem_block_t) + // Pages
+                      sizeof(uint64_t);                 // Padding
         setUBCheck(true);
     }
     else
@@ -141,28 +209,32 @@ void mem_init(bool do_sparse)
         /* Dense allocation */
         next_free_page = NULL;
         num_pages = 0;
-        page_table = NULL;
-        num_buckets = 0;
+        page_pool = NULL;
+        page_root = NULL;
         mmap_length = MAX_DENSE_HEAP;
     }
 
-    int dev_zero = open("/dev/zero", O_RDWR);
     void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,                  /* suggested start*/
-                      mmap_length,            /* length */
-                      PROT_READ | PROT_WRITE, /* permissions */
-                      MAP_PRIVATE,            /* private or shared? */
-                      dev_zero,               /* fd */
-                      0);                     /* offset */
+    void *addr = map_pages(start, mmap_length);
     if (addr == MAP_FAILED)
     {
         fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
         exit(1);
     }
+
+    /* Fault in the start of the heap, storing the zeros it already holds */
+    prefault_done = prefault_wanted < mmap_length ? prefault_wanted
+                                                  : mmap_length;
+#ifdef USE_ASAN
+    /* The heap of an earlier mem_init may have left this range poisoned */
+    __asan_unpoison_memory_region(addr, prefault_done);
+#endif
+    for (size_t i = 0; i < prefault_done; i += mem_pagesize())
+        ((volatile unsigned char *)addr)[i] = 0;
     if (sparse)
     {
-        /* Use initial space for page table */
-        page_table = (mem_block_t **)addr;
+        /* The whole space is a pool of pages */
+        page_pool = (mem_block_t *)addr;
         heap = SPARSE_HEAP_START;
         mem_max_addr = heap + MAX_SPARSE_HEAP;
     }
@@ -173,6 +245,94 @@ void mem_init(bool do_sparse)
     }
     stats_printed = false;
     mem_brk = heap;
+    mem_floor = mem_max_addr;
+    unused_lo = heap;
+    unused_hi = mem_max_addr;
+    zero_start = heap;
+    num_regions = 1;
+    num_maps = 0;
+    mapped_bytes = 0;
+    peak_bytes = 0;
+    sbrk_calls = 0;
+}
+
+/*
+ * mem_set_pages - choose how the heaps of the following mem_init calls
+ *     are backed, and how many bytes of them are faulted in at once
+ */
+void mem_set_pages(mem_pages_t pages, size_t prefault)
+{
+    pages_wanted = pages;
+    prefault_wanted = prefault;
+}
+
+/*
+ * mem_pages - how the heap of the last mem_init is backed
+ */
+mem_pages_t mem_pages(void)
+{
+    return pages_used;
+}
+
+/*
+ * mem_prefaulted - how many bytes of the heap mem_init faulted in
+ */
+size_t mem_prefaulted(void)
+{
+    return prefault_done;
+}
+
+/*
+ * map_pages - map length bytes of zeros for the heap, at start if that is
+ *     free, in the mode of mem_set_pages or the closest one that works.
+ *     Sets pages_used, and warns once about every fallback.
+ */
+static void *map_pages(void *start, size_t length)
+{
+    static bool warned_hugetlb = false;
+    static bool warned_thp = false;
+    void *addr;
+
+    pages_used = pages_wanted;
+    if (pages_used == MEM_PAGES_HUGETLB)
+    {
+        /* Huge pages need a length that is a multiple of their size */
+        size_t huge = (size_t)2 << 20;
+        size_t huge_length = (length + huge - 1) & ~(huge - 1);
+        addr = mmap(start, huge_length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED)
+        {
+            mmap_length = huge_length;
+            return addr;
+        }
+        if (!warned_hugetlb)
+            fprintf(stderr, "mem_init: no huge pages reserved (%s), using "
+                            "transparent huge pages\n",
+                    strerror(errno));
+        warned_hugetlb = true;
+        pages_used = MEM_PAGES_THP;
+    }
+
+    int dev_zero = open("/dev/zero", O_RDWR);
+    addr = mmap(start,                  /* suggested start*/
+                length,                 /* length */
+                PROT_READ | PROT_WRITE, /* permissions */
+                MAP_PRIVATE,            /* private or shared? */
+                dev_zero,               /* fd */
+                0);                     /* offset */
+    close(dev_zero);
+    if (addr != MAP_FAILED && pages_used == MEM_PAGES_THP &&
+        madvise(addr, length, MADV_HUGEPAGE) != 0)
+    {
+        if (!warned_thp)
+            fprintf(stderr, "mem_init: no transparent huge pages (%s), using "
+                            "ordinary pages\n",
+                    strerror(errno));
+        warned_thp = true;
+        pages_used = MEM_PAGES_DEFAULT;
+    }
+    return addr;
 }
 
 /*
@@ -183,9 +343,12 @@ void mem_deinit(void)
     print_stats();
     munmap(heap, mmap_length);
     next_free_page = NULL;
+    released_pages = NULL;
     num_free_pages = 0;
-    page_table = NULL;
-    num_buckets = 0;
+    num_nodes = 0;
+    page_pool = NULL;
+    page_root = NULL;
+    flush_page_cache();
 }
 
 /*
@@ -196,12 +359,13 @@ void mem_reset_brk()
     print_stats();
     if (sparse)
     {
-        /* Clear page table */
-        size_t ptb = num_buckets * sizeof(mem_block_t *);
-        memset((void *)page_table, 0, ptb);
-        /* First page is just beyond page table */
-        next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
+        /* Clear page table, giving all of its nodes back to the pool */
+        page_root = NULL;
+        flush_page_cache();
+        next_free_page = page_pool;
+        released_pages = NULL;
         num_free_pages = num_pages;
+        num_nodes = 0;
     }
     else
     {
@@ -218,27 +382,33 @@ void mem_reset_brk()
 #endif
     }
     mem_brk = heap;
+    mem_floor = mem_max_addr;
+    num_regions = 1;
+    num_maps = 0;
+    mapped_bytes = 0;
+    peak_bytes = 0;
+    sbrk_calls = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap, releasing its top -incr bytes.
  */
 void *mem_sbrk(intptr_t incr)
 {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0)
+    if (incr < 0 && (size_t)-incr > (size_t)(mem_brk - heap))
     {
         ok = false;
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                "bytes, more than its size\n",
+                -(long)incr);
     }
-    else if (mem_brk + incr > mem_max_addr)
+    else if (incr > 0 && mem_brk + incr > mem_floor)
     {
         ok = false;
         size_t alloc = mem_brk - heap + incr;
@@ -247,7 +417,7 @@ void *mem_sbrk(intptr_t incr)
                 "heap size of %zd (0x%zx) bytes\n",
                 alloc, alloc);
     }
-    else if (!sparse && sbrk(incr) == (void *)-1)
+    else if (!sparse && incr > 0 && sbrk(incr) == (void *)-1)
     {
         ok = false;
         fprintf(
@@ -255,13 +425,22 @@ void *mem_sbrk(intptr_t incr)
             "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
     }
 
-    if (ok)
+    if (ok && incr < 0)
+    {
+        mem_brk += incr;
+        release_brk(mem_brk, old_brk);
+        return (void *)old_brk;
+    }
+    else if (ok)
     {
 #ifdef USE_ASAN
         /* Mark the extended section of the heap as addressable */
         __asan_unpoison_memory_region(mem_brk, incr);
 #endif
         mem_brk += incr;
+        sbrk_calls += (incr > 0);
+        note_size();
+        note_handout(old_brk, mem_brk, false);
         return (void *)old_brk;
     }
     else
@@ -271,6 +450,323 @@ void *mem_sbrk(intptr_t incr)
     }
 }
 
+/*
+ * mem_map_region - reserve size bytes at the top of the heap area for a
+ *    region that is grown with mem_region_sbrk.  Returns the region id,
+ *    or -1 if the space or the region table is exhausted.
+ */
+int mem_map_region(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size = (size + pagesize - 1) / pagesize * pagesize;
+    if (sparse || num_regions == MAX_REGIONS ||
+        size > (size_t)(mem_floor - mem_brk))
+    {
+        return -1;
+    }
+
+    mem_floor -= size;
+    note_handout(mem_floor, mem_floor + size, true);
+    mem_region_t *r = &regions[num_regions];
+    r->base = mem_floor;
+    r->brk = mem_floor;
+    r->max = mem_floor + size;
+    return num_regions++;
+}
+
+/*
+ * mem_region_sbrk - extend a region by incr bytes and return the start
+ *    address of the new area, or shrink it if incr is negative.  Region 0
+ *    is the main heap.
+ */
+void *mem_region_sbrk(int region, intptr_t incr)
+{
+    if (region == 0)
+        return mem_sbrk(incr);
+
+    assert(region > 0 && region < num_regions);
+    mem_region_t *r = &regions[region];
+    unsigned char *old_brk = r->brk;
+    if (incr < 0)
+    {
+        if (-incr > r->brk - r->base)
+        {
+            errno = EINVAL;
+            return (void *)-1;
+        }
+        r->brk += incr;
+        release_brk(r->brk, old_brk);
+        return (void *)old_brk;
+    }
+    if (incr > r->max - r->brk)
+    {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+#ifdef USE_ASAN
+    __asan_unpoison_memory_region(r->brk, incr);
+#endif
+    r->brk += incr;
+    sbrk_calls += (incr > 0);
+    note_size();
+    zero_start = r->brk;
+    return (void *)old_brk;
+}
+
+/*
+ * find_map - return the index of the mapped span starting at addr, or -1
+ */
+static int find_map(const void *addr)
+{
+    int lo = 0, hi = num_maps;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (maps[mid].base < (const unsigned char *)addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < num_maps && maps[lo].base == addr && maps[lo].live)
+        return lo;
+    return -1;
+}
+
+/*
+ * insert_map - make room for a span at index i of the span table
+ */
+static bool insert_map(int i)
+{
+    if (num_maps == MAX_MAPS)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+    memmove(&maps[i + 1], &maps[i], (num_maps - i) * sizeof(mem_map_t));
+    num_maps++;
+    return true;
+}
+
+/*
+ * remove_map - drop the span at index i of the span table
+ */
+static void remove_map(int i)
+{
+    num_maps--;
+    memmove(&maps[i], &maps[i + 1], (num_maps - i) * sizeof(mem_map_t));
+}
+
+/*
+ * map_span - hand out the first size bytes of span i as a live span
+ */
+static void *map_span(int i, size_t size)
+{
+    mem_map_t *m = &maps[i];
+    if (m->size > size)
+    {
+        if (!insert_map(i + 1))
+            return (void *)-1;
+        m = &maps[i];
+        m[1].base = m->base + size;
+        m[1].size = m->size - size;
+        m[1].live = false;
+        m->size = size;
+    }
+    m->live = true;
+    mapped_bytes += size;
+    note_handout(m->base, m->base + size, true);
+#ifdef USE_ASAN
+    __asan_unpoison_memory_region(m->base, size);
+#endif
+#ifdef USE_MSAN
+    __msan_unpoison(m->base, size);
+#endif
+    note_size();
+    return (void *)m->base;
+}
+
+/*
+ * unmap_span - turn span i into a hole, merging it with adjacent holes,
+ *    and give the holes at the bottom of the area back to the heap
+ */
+static void unmap_span(int i)
+{
+    mem_map_t *m = &maps[i];
+    m->live = false;
+    mapped_bytes -= m->size;
+    if (sparse)
+        release_pages(m->base, m->size);
+#ifdef USE_ASAN
+    __asan_poison_memory_region(m->base, m->size);
+#endif
+
+    if (i + 1 < num_maps && !maps[i + 1].live &&
+        m->base + m->size == maps[i + 1].base)
+    {
+        m->size += maps[i + 1].size;
+        remove_map(i + 1);
+    }
+    if (i > 0 && !maps[i - 1].live &&
+        maps[i - 1].base + maps[i - 1].size == m->base)
+    {
+        maps[i - 1].size += m->size;
+        remove_map(i);
+        i--;
+    }
+    if (i == 0 && maps[0].base == mem_floor)
+    {
+        mem_floor += maps[0].size;
+        remove_map(0);
+    }
+}
+
+/*
+ * mem_map - simple model of an anonymous mmap.  Returns the start of size
+ *    bytes of page-aligned memory that is independent of the heap.
+ *    Holes left by mem_unmap are reused first fit; otherwise the span is
+ *    carved from the top of the heap area.
+ */
+void *mem_map(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size = (size + pagesize - 1) / pagesize * pagesize;
+    if (size == 0)
+    {
+        errno = EINVAL;
+        return (void *)-1;
+    }
+
+    for (int i = 0; i < num_maps; i++)
+    {
+        if (!maps[i].live && maps[i].size >= size)
+            return map_span(i, size);
+    }
+
+    if (size > (size_t)(mem_floor - mem_brk) || !insert_map(0))
+    {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    mem_floor -= size;
+    maps[0].base = mem_floor;
+    maps[0].size = size;
+    maps[0].live = false;
+    return map_span(0, size);
+}
+
+/*
+ * mem_unmap - release a span returned by mem_map or mem_remap.  Returns 0
+ *    on success and -1 if addr and size do not describe a whole span.
+ */
+int mem_unmap(void *addr, size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size = (size + pagesize - 1) / pagesize * pagesize;
+    int i = find_map(addr);
+    if (i < 0 || maps[i].size != size)
+    {
+        fprintf(stderr,
+                "ERROR: mem_unmap failed.  %p does not start a mapping of "
+                "%zu bytes\n",
+                addr, size);
+        errno = EINVAL;
+        return -1;
+    }
+    unmap_span(i);
+    return 0;
+}
+
+/*
+ * mem_remap - simple model of mremap with MREMAP_MAYMOVE.  Shrinks or grows
+ *    a mapped span in place when the space after it allows, and otherwise
+ *    moves its contents to a new span.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size)
+{
+    size_t pagesize = mem_pagesize();
+    old_size = (old_size + pagesize - 1) / pagesize * pagesize;
+    new_size = (new_size + pagesize - 1) / pagesize * pagesize;
+    int i = find_map(addr);
+    if (i < 0 || maps[i].size != old_size || new_size == 0)
+    {
+        errno = EINVAL;
+        return (void *)-1;
+    }
+
+    mem_map_t *m = &maps[i];
+    size_t size = old_size;
+    if (new_size == size)
+        return addr;
+
+    /* Shrink by splitting the tail off as a span of its own */
+    if (new_size < size)
+    {
+        if (!insert_map(i + 1))
+            return (void *)-1;
+        m = &maps[i];
+        m[1].base = m->base + new_size;
+        m[1].size = size - new_size;
+        m[1].live = true;
+        m->size = new_size;
+        unmap_span(i + 1);
+        return addr;
+    }
+
+    /* Grow into the hole right after the span */
+    if (i + 1 < num_maps && !m[1].live && m->base + size == m[1].base &&
+        size + m[1].size >= new_size)
+    {
+        mapped_bytes -= size;
+        m->live = false;
+        m->size += m[1].size;
+        remove_map(i + 1);
+        return map_span(i, new_size);
+    }
+
+    /* Move the contents to a new span */
+    unsigned char *new_addr = mem_map(new_size);
+    if (new_addr == (void *)-1)
+        return (void *)-1;
+    if (sparse)
+        move_pages(addr, new_addr, size);
+    else
+        memcpy(new_addr, addr, size);
+    mem_unmap(addr, size);
+    zero_start = new_addr + new_size;
+    return (void *)new_addr;
+}
+
+/*
+ * note_handout - record which part of [lo, hi), just handed out from the
+ *    bottom (heap) or the top (regions and spans) of the heap area, is
+ *    known to hold zeros: what lies between the highest break and the
+ *    lowest region or span since mem_init, as long as it runs up to hi.
+ *    Sparse pages are taken from a pool and count as uninitialized, as
+ *    does everything under MemorySanitizer, so none of it is.
+ */
+static void note_handout(unsigned char *lo, unsigned char *hi, bool top)
+{
+    zero_start = hi;
+#ifndef USE_MSAN
+    if (!sparse && hi <= unused_hi)
+        zero_start = (lo > unused_lo) ? lo : unused_lo;
+#endif
+    if (top && lo < unused_hi)
+        unused_hi = lo;
+    else if (!top && hi > unused_lo)
+        unused_lo = hi;
+}
+
+/*
+ * mem_zero_start - return the address from which the memory handed out
+ *    by the last mem_sbrk, mem_region_sbrk, mem_map or mem_remap call
+ *    that handed any out is known to hold zeros, or its end if none is
+ */
+void *mem_zero_start()
+{
+    return (void *)zero_start;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -284,6 +780,8 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
+    if (mem_floor < mem_max_addr)
+        return (void *)(mem_max_addr - 1);
     return (void *)(mem_brk - 1);
 }
 
@@ -292,7 +790,28 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize()
 {
-    return (size_t)(mem_brk - heap);
+    size_t size = (size_t)(mem_brk - heap) + mapped_bytes;
+    for (int i = 1; i < num_regions; i++)
+        size += (size_t)(regions[i].brk - regions[i].base);
+    return size;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest size the heap has had since it
+ *    was last reset
+ */
+size_t mem_peak_heapsize()
+{
+    return peak_bytes;
+}
+
+/*
+ * mem_sbrk_calls() - returns the number of times mem_sbrk or
+ *    mem_region_sbrk has grown the heap since it was last reset
+ */
+size_t mem_sbrk_calls()
+{
+    return sbrk_calls;
 }
 
 /*
@@ -323,8 +842,7 @@ void mem_write128(void *addr, __int128 val)
 uint64_t mem_read(const void *addr, size_t len)
 {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (is_emulated(addr, len))
     {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
@@ -367,8 +885,7 @@ uint64_t mem_read(const void *addr, size_t len)
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len)
 {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (is_emulated(addr, len))
     {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
@@ -410,11 +927,42 @@ void mem_write(void *addr, uint64_t val, size_t len)
     }
 }
 
-/* Emulation of memcpy */
+/* Number of bytes from addr to the end of its emulated page */
+static size_t page_left(const void *addr)
+{
+    size_t offset = (const unsigned char *)addr - (unsigned char *)heap;
+    return SPARSE_PAGE_SIZE - offset % SPARSE_PAGE_SIZE;
+}
+
+/*
+ * Emulation of memcpy.  Dense memory is copied directly; emulated memory
+ *  a page at a time, so that both the bytes and their init bits are
+ *  handled in bulk.  Only a copy between emulated and real memory goes
+ *  through mem_read and mem_write a word at a time.
+ */
 void *mem_memcpy(void *dst, const void *src, size_t num_bytes)
 {
     void *savedst = dst;
     size_t word_size = sizeof(uint64_t);
+    if (!sparse)
+        return memcpy(dst, src, num_bytes);
+    if (is_emulated(dst, num_bytes) && is_emulated(src, num_bytes))
+    {
+        while (num_bytes > 0)
+        {
+            size_t len = page_left(dst);
+            if (len > page_left(src))
+                len = page_left(src);
+            if (len > num_bytes)
+                len = num_bytes;
+            const void *from = get_mem(src, len, false);
+            memcpy(get_mem(dst, len, true), from, len);
+            num_bytes -= len;
+            src = (const void *)((const unsigned char *)src + len);
+            dst = (void *)((unsigned char *)dst + len);
+        }
+        return savedst;
+    }
     while (num_bytes >= word_size)
     {
         uint64_t data = mem_read(src, word_size);
@@ -431,7 +979,7 @@ void *mem_memcpy(void *dst, const void *src, size_t num_bytes)
     return savedst;
 }
 
-/* Emulation of memset */
+/* Emulation of memset, in bulk as mem_memcpy */
 void *mem_memset(void *dst, int c, size_t num_bytes)
 {
     void *savedst = dst;
@@ -439,6 +987,21 @@ void *mem_memset(void *dst, int c, size_t num_bytes)
     uint64_t data = 0;
     size_t word_size = sizeof(uint64_t);
     size_t i;
+    if (!sparse)
+        return memset(dst, c, num_bytes);
+    if (is_emulated(dst, num_bytes))
+    {
+        while (num_bytes > 0)
+        {
+            size_t len = page_left(dst);
+            if (len > num_bytes)
+                len = num_bytes;
+            memset(get_mem(dst, len, true), c, len);
+            num_bytes -= len;
+            dst = (void *)((unsigned char *)dst + len);
+        }
+        return savedst;
+    }
     for (i = 0; i < word_size; i++)
     {
         data = data | (byte << (8 * i));
@@ -489,17 +1052,17 @@ void hprobe(void *ptr, int offset, size_t count)
 
 static void print_stats()
 {
-    size_t vbytes = mem_heapsize();
+    size_t vbytes = mem_peak_heapsize();
     if (!show_stats || vbytes == 0 || stats_printed)
         return;
     if (sparse)
     {
         size_t ppages = num_pages - num_free_pages;
         size_t pbytes = ppages * SPARSE_PAGE_SIZE;
-        printf("Allocated %zu/%zu pages (%zu bytes) to cover %zu heap bytes "
-               "(%.4f%% density).  Max address = %p\n",
-               ppages, num_pages, pbytes, vbytes, 100.0 * pbytes / vbytes,
-               mem_brk);
+        printf("Allocated %zu/%zu pages (%zu bytes, %zu for the page table) "
+               "to cover %zu heap bytes (%.4f%% density).  Max address = %p\n",
+               ppages, num_pages, pbytes, num_nodes * SPARSE_PAGE_SIZE,
+               vbytes, 100.0 * pbytes / vbytes, mem_brk);
     }
     else
     {
@@ -523,37 +1086,143 @@ static void *page_start(size_t id)
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
+/* Take a page out of the pool, for a page or a node of the page table */
+static void *take_page(void)
+{
+    mem_block_t *block;
+    if (num_free_pages == 0)
+    {
+        /*
+         * This will often fail due to student code that either accesses
+         *  too many memory locations, such as checking every byte in a
+         *  block.  Or more commonly due to poor utilization, such as
+         *  leaking or not finding the huge allocations.
+         */
+        fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
+        exit(1);
+    }
+    if (released_pages)
+    {
+        block = released_pages;
+        released_pages = block->next;
+    }
+    else
+        block = next_free_page++;
+    num_free_pages--;
+    return block;
+}
+
+/*
+ * Find the entry of the page table for a page ID.  Missing nodes on the
+ *  way are added if create is set; otherwise NULL is returned for them.
+ */
+static mem_block_t **page_slot(size_t id, bool create)
+{
+    radix_node_t **link = &page_root;
+    int shift = (RADIX_LEVELS - 1) * RADIX_BITS;
+    while (true)
+    {
+        if (*link == NULL)
+        {
+            if (!create)
+                return NULL;
+            *link = take_page();
+            memset(*link, 0, sizeof(radix_node_t));
+            num_nodes++;
+        }
+        size_t i = (id >> shift) & (RADIX_FANOUT - 1);
+        if (shift == 0)
+            return &(*link)->page[i];
+        link = &(*link)->child[i];
+        shift -= RADIX_BITS;
+    }
+}
+
+/* Forget the pages used last, after pages have been released or moved */
+static void flush_page_cache(void)
+{
+    memset(page_cache, 0, sizeof(page_cache));
+}
+
+#ifndef NO_CHECK_UB
+/*
+ * Mark n bytes of a page from offset lo as initialized in its bitmap, or
+ *  with check set, find the first of them that is not.  Returns the
+ *  number of bytes before that one, which is n if they all are.  Aligned
+ *  8- and 16-byte accesses cover whole bytes of the bitmap.
+ */
+static size_t init_bits(mem_block_t *block, size_t lo, size_t n, bool check)
+{
+    unsigned char *bits = &block->initSet[lo / 8];
+    if ((lo & 7) == 0 && (n == 8 || n == 16))
+    {
+        if (!check)
+        {
+            bits[0] = 0xFF;
+            bits[n / 16] = 0xFF;
+            return n;
+        }
+        if (bits[0] == 0xFF && bits[n / 16] == 0xFF)
+            return n;
+    }
+
+    size_t done = 0;
+    while (done < n)
+    {
+        size_t b = (lo + done) & 7;
+        size_t m = (n - done < 8 - b) ? n - done : 8 - b;
+
+        /* Runs of whole bitmap bytes, as in bulk copies */
+        if (b == 0 && n - done >= 16)
+        {
+            unsigned char *run = &block->initSet[(lo + done) / 8];
+            size_t k, whole = (n - done) / 8;
+            if (!check)
+            {
+                memset(run, 0xFF, whole);
+                done += 8 * whole;
+                continue;
+            }
+            for (k = 0; k < whole && run[k] == 0xFF; k++)
+                ;
+            done += 8 * k;
+            if (k < whole)
+                return done + __builtin_ctz(~run[k] & 0xFF);
+            continue;
+        }
+
+        unsigned mask = ((1u << m) - 1) << b;
+        unsigned char *byte = &block->initSet[(lo + done) / 8];
+        if (!check)
+            *byte |= (unsigned char)mask;
+        else if ((*byte & mask) != mask)
+            return done + __builtin_ctz(~*byte & mask) - b;
+        done += m;
+    }
+    return n;
+}
+#endif
+
 /* Get memory to store value.  Allocate page if necessary */
 static void *get_mem(const void *addr, size_t size, bool isWrite)
 {
     size_t id = page_id(addr);
-    size_t b = id % num_buckets; // A very simple hash function
-    unsigned int i;
+    mem_block_t **cached = &page_cache[id % PAGE_CACHE_SIZE];
+    mem_block_t *block = *cached;
 
-    mem_block_t *block = page_table[b];
-    while (block && block->id != id)
-        block = block->next;
-    if (!block)
+    if (!block || block->id != id)
     {
-        /* Need to allocate a new block */
-        if (num_free_pages == 0)
+        mem_block_t **slot = page_slot(id, true);
+        block = *slot;
+        if (!block)
         {
-            /*
-             * This will often fail due to student code that either accesses
-             *  too many memory locations, such as checking every byte in a
-             *  block.  Or more commonly due to poor utilization, such as
-             *  leaking or not finding the huge allocations.
-             */
-            fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
-            exit(1);
+            /* Need to allocate a new block */
+            block = take_page();
+            block->id = id;
+            memset(block->initSet, 0, sizeof(block->initSet));
+            *slot = block;
         }
-        block = next_free_page++;
-        num_free_pages--;
-        block->id = id;
-        block->next = page_table[b];
-        for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
-            block->initSet[i] = 0;
-        page_table[b] = block;
+        *cached = block;
     }
 
     // Convert an emulated address into an offset
@@ -561,20 +1230,16 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
     size_t offset = (unsigned char *)addr - (unsigned char *)saddr;
 
 #ifndef NO_CHECK_UB
-    // Compute the bit vector lookup for this 'offset'
-    size_t offsetIdx = offset / 8;
-    size_t offsetBit = offset & 0x7;
-
-    // For each byte in this access, update the bitvector that tracks
-    //  the use / initialization of emulated bytes.
-    for (i = 0; i < size; i++)
+    // Update the bit vector that tracks the use / initialization of the
+    //  emulated bytes of this access that lie in this page
+    if (size > SPARSE_PAGE_SIZE - offset)
+        size = SPARSE_PAGE_SIZE - offset;
+    if (isWrite)
+        init_bits(block, offset, size, false);
+    else if (checkUB)
     {
-        if (isWrite)
-        {
-            block->initSet[offsetIdx] |= (0x1 << offsetBit);
-        }
-        else if (checkUB &&
-                 (block->initSet[offsetIdx] & (0x1 << offsetBit)) == 0)
+        size_t i = init_bits(block, offset, size, true);
+        if (i < size)
         {
             // The student code has attempted to read an address that was
             //  never written to.  Students should set a breakpoint on this
@@ -586,16 +1251,125 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
                     (addr + i), __FILE__, __LINE__);
             abort();
         }
-        offsetBit++;
-        if (offsetBit == 8)
-        {
-            offsetBit = 0;
-            offsetIdx++;
-        }
-        if (offsetIdx == (SPARSE_PAGE_SIZE / 8))
-            break;
     }
 #endif
 
     return (void *)&block->bytes[offset];
 }
+
+/* Is an access to addr emulated, being in the main heap or the map area? */
+static bool is_emulated(const void *addr, size_t len)
+{
+    const unsigned char *lo = addr;
+    if (!sparse || lo < heap)
+        return false;
+    return lo + len <= mem_brk || (lo >= mem_floor && lo + len <= mem_max_addr);
+}
+
+/*
+ * Unlink from the subtree at node every page with an ID in [lo, hi) and
+ *  call fn on it.  The subtree holds the IDs from base, shift being the
+ *  shift of its level; subtrees outside the range are skipped.
+ */
+static void walk_pages(radix_node_t *node, size_t base, int shift, size_t lo,
+                       size_t hi, void (*fn)(mem_block_t *, void *),
+                       void *arg)
+{
+    size_t span = (size_t)1 << shift;
+    size_t first = (lo > base) ? (lo - base) >> shift : 0;
+    for (size_t i = first; i < RADIX_FANOUT && base + i * span < hi; i++)
+    {
+        if (shift == 0)
+        {
+            mem_block_t *block = node->page[i];
+            if (block)
+            {
+                node->page[i] = NULL;
+                fn(block, arg);
+            }
+        }
+        else if (node->child[i])
+            walk_pages(node->child[i], base + i * span, shift - RADIX_BITS,
+                       lo, hi, fn, arg);
+    }
+}
+
+/*
+ * Call fn on every page of the page table holding an address of
+ *  [lo, lo + size), after unlinking it from the table.  Only the parts of
+ *  the table that cover the range are visited, so huge ranges, which only
+ *  sparse mode can map, cost no more than the pages they hold.
+ */
+static void for_pages(unsigned char *lo, size_t size,
+                      void (*fn)(mem_block_t *, void *), void *arg)
+{
+    size_t first = page_id(lo);
+    size_t count = size / SPARSE_PAGE_SIZE;
+    flush_page_cache();
+    if (page_root && count > 0)
+        walk_pages(page_root, 0, (RADIX_LEVELS - 1) * RADIX_BITS, first,
+                   first + count, fn, arg);
+}
+
+/* Put a page unlinked from the page table on the released list */
+static void release_page(mem_block_t *block, void *arg)
+{
+    block->next = released_pages;
+    released_pages = block;
+    num_free_pages++;
+}
+
+/* Give the emulated pages of a released span back for reuse */
+static void release_pages(unsigned char *lo, size_t size)
+{
+    for_pages(lo, size, release_page, NULL);
+}
+
+/* Collect pages unlinked from the page table on a private list */
+static void collect_page(mem_block_t *block, void *arg)
+{
+    mem_block_t **list = (mem_block_t **)arg;
+    block->next = *list;
+    *list = block;
+}
+
+/* Move the emulated pages of a span to another span without copying */
+static void move_pages(unsigned char *from, unsigned char *to, size_t size)
+{
+    mem_block_t *list = NULL;
+    for_pages(from, size, collect_page, &list);
+    size_t delta = page_id(to) - page_id(from);
+    while (list)
+    {
+        mem_block_t *block = list;
+        list = block->next;
+        block->id += delta;
+        *page_slot(block->id, true) = block;
+    }
+}
+
+/* Update the high-water mark of the heap size */
+static void note_size(void)
+{
+    size_t size = mem_heapsize();
+    if (size > peak_bytes)
+        peak_bytes = size;
+}
+
+/*
+ * Release the space between a break that has moved down and its old
+ *  position.  Sparse mode gives back the pages that no longer hold any
+ *  heap byte.
+ */
+static void release_brk(unsigned char *brk, unsigned char *old_brk)
+{
+#ifdef USE_ASAN
+    __asan_poison_memory_region(brk, old_brk - brk);
+#endif
+    if (sparse)
+    {
+        unsigned char *lo = page_start(page_id(brk + SPARSE_PAGE_SIZE - 1));
+        if (lo < old_brk)
+            release_pages(lo, old_brk - lo + SPARSE_PAGE_SIZE - 1);
+    }
+}
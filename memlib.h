@@ -10,6 +10,41 @@
 #include <stdint.h>
 #include <unistd.h>
 
+/** @brief How the pages of the heap are backed */
+typedef enum
+{
+    MEM_PAGES_DEFAULT, /**< whatever an ordinary private mapping gets */
+    MEM_PAGES_THP,     /**< transparent huge pages, asked for by madvise */
+    MEM_PAGES_HUGETLB  /**< huge pages reserved by the system (MAP_HUGETLB) */
+} mem_pages_t;
+
+/**
+ * @brief Chooses how the heap is mapped by the calls to mem_init() that
+ *        follow.
+ *
+ * Huge pages keep first-touch faults and TLB misses of large heaps out of
+ * the time measured, and so does faulting in the start of the heap before
+ * it is used. A mode the system cannot provide falls back to the next one
+ * down, with a warning; mem_pages() tells which mode was used.
+ *
+ * @param[in] pages How to back the heap
+ * @param[in] prefault Bytes at the start of the heap to fault in at once
+ */
+void mem_set_pages(mem_pages_t pages, size_t prefault);
+
+/**
+ * @brief Tells how the heap of the last mem_init() is backed.
+ * @return The mode in effect, after any fallback
+ */
+mem_pages_t mem_pages(void);
+
+/**
+ * @brief Tells how much of the heap of the last mem_init() was faulted in
+ *        by it.
+ * @return The bytes faulted in
+ */
+size_t mem_prefaulted(void);
+
 /**
  * @brief
  * @param[in] sparse
@@ -24,13 +59,13 @@ void mem_deinit(void);
 /**
  * @brief Extends the heap by incr bytes.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. A negative incr
+ * shrinks the heap, releasing its top -incr bytes.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `-incr` is at most the size of the main heap
  */
 void *mem_sbrk(intptr_t incr);
 
@@ -39,6 +74,94 @@ void *mem_sbrk(intptr_t incr);
  */
 void mem_reset_brk(void);
 
+/**
+ * @brief Reserves address space for a region that grows independently of
+ *        the main heap.
+ *
+ * Regions are carved downwards from the top of the heap area, so they lie
+ * between mem_heap_lo() and mem_heap_hi() but never overlap the main heap.
+ * A region starts empty and is grown with mem_region_sbrk(). Region 0 is
+ * the main heap itself. Regions are not available in sparse mode.
+ *
+ * Calls must not race with mem_sbrk(), which grows into the same space.
+ *
+ * @param[in] size The most bytes the region can ever grow to
+ * @return The id of the new region, or -1 if there is no room for it
+ */
+int mem_map_region(size_t size);
+
+/**
+ * @brief Extends a region by incr bytes.
+ *
+ * Works like mem_sbrk() on the given region, including shrinking it with a
+ * negative incr; region 0 is exactly mem_sbrk(). Different regions may be
+ * grown concurrently. Running out of
+ * the space reserved for a region is not reported as an error, since the
+ * caller is expected to fall back to another region.
+ *
+ * @param[in] region A region id returned by mem_map_region(), or 0
+ * @param[in] incr The amount of bytes by which to extend the region
+ * @return The previous break of the region, or (void *)-1 on failure
+ */
+void *mem_region_sbrk(int region, intptr_t incr);
+
+/**
+ * @brief Maps memory that is independent of the heap.
+ *
+ * This is a simple model of an anonymous mmap(). The mapping is taken from
+ * the top of the heap area, reusing space released by mem_unmap() first, so
+ * it lies between mem_heap_lo() and mem_heap_hi() but never overlaps the
+ * main heap or a region. As with mem_sbrk(), its contents are unspecified;
+ * in sparse mode they count as uninitialized.
+ *
+ * Calls must not race with mem_sbrk(), which grows into the same space.
+ *
+ * @param[in] size The size of the mapping, rounded up to mem_pagesize()
+ * @return The page-aligned start of the mapping, or (void *)-1 on failure
+ */
+void *mem_map(size_t size);
+
+/**
+ * @brief Releases a mapping made by mem_map() or mem_remap().
+ *
+ * Unlike munmap(), only a whole mapping can be released.
+ *
+ * @param[in] addr The start of the mapping
+ * @param[in] size The size the mapping was made with
+ * @return 0 on success, or -1 if addr and size describe no mapping
+ */
+int mem_unmap(void *addr, size_t size);
+
+/**
+ * @brief Resizes a mapping made by mem_map() or mem_remap().
+ *
+ * This is a simple model of mremap() with MREMAP_MAYMOVE: the mapping is
+ * resized in place if the space after it allows, and otherwise its contents
+ * are moved to a new mapping.
+ *
+ * @param[in] addr The start of the mapping
+ * @param[in] old_size The size the mapping was made with
+ * @param[in] new_size The new size, rounded up to mem_pagesize()
+ * @return The start of the resized mapping, or (void *)-1 on failure, in
+ *         which case the old mapping is left untouched
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
+
+/**
+ * @brief Finds the part of the memory handed out last that holds zeros.
+ *
+ * The contents of new memory are unspecified in general, but memory that
+ * has not been handed out since mem_init() holds zeros, even across
+ * mem_reset_brk(). This looks at the memory handed out by the last call to
+ * mem_sbrk(), mem_region_sbrk(), mem_map() or mem_remap() that handed any
+ * out, and only means anything before that memory is written. Nothing is
+ * known to hold zeros in sparse mode.
+ *
+ * @return The address from which that memory holds zeros, or its end if
+ *         none of it is known to
+ */
+void *mem_zero_start(void);
+
 /**
  * @brief Finds the low address of the heap.
  * @return The address of the first valid byte in the heap.
@@ -50,6 +173,8 @@ void *mem_heap_lo(void);
  *
  * Note that this address may not be aligned: if the heap is 8 bytes large,
  * then the value returned will be 7 bytes from the start of the heap.
+ * Once a region or mapping has been made, this is the last byte of the heap
+ * area.
  *
  * @return The address of the last valid byte in the heap.
  */
@@ -57,10 +182,31 @@ void *mem_heap_hi(void);
 
 /**
  * @brief Returns the number of bytes being used by the heap.
+ *
+ * This counts the main heap, the used part of every region and every
+ * mapping, as they are now.
+ *
  * @return The size of the heap, in bytes
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the largest size the heap has had since it was reset.
+ *
+ * Since the heap can shrink and mappings can be released, this rather than
+ * mem_heapsize() is the space a trace needed.
+ *
+ * @return The peak size of the heap, in bytes
+ */
+size_t mem_peak_heapsize(void);
+
+/**
+ * @brief Returns the number of calls to mem_sbrk() or mem_region_sbrk()
+ *        that grew the heap since it was last reset.
+ * @return The number of calls that grew the heap
+ */
+size_t mem_sbrk_calls(void);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
@@ -0,0 +1,658 @@
+/**
+ * @file mm-preload.c
+ * @brief The malloc family of libc on top of mm.c, for preloading.
+ *
+ * Linked with mm.c, in its thread-safe build with the driver names, and
+ * memlib-passthrough.c into mm-preload.so, this file provides the entry
+ * points a program expects from libc, so that
+ *
+ *     LD_PRELOAD=./mm-preload.so program
+ *
+ * runs the program on the allocator.
+ *
+ * With MM_CAPTURE=file in the environment, the requests of the program are
+ * also written to file as a trace in the format of traces/ *.rep, which
+ * mdriver replays like any other. A %p in the name is replaced by the
+ * process id, so that every process the program starts writes a trace of
+ * its own; without one, only the first process is traced: it leaves its
+ * id in MM_CAPTURE_PID, and a process started with another id there writes
+ * no trace. A program the process execs keeps the id, and takes the trace
+ * over, so that a shell script or env that execs the program hands the
+ * capture on to it. A forked child that does not exec is never traced.
+ * A request is recorded by putting it in a ring buffer, where a thread
+ * takes a slot with one atomic add and takes no lock; whichever thread
+ * fills a quarter of the ring turns the requests that are complete into
+ * trace lines. Blocks of the program get trace ids in the order they are
+ * allocated. Requests for blocks allocated before the capture started are
+ * left out, while blocks still allocated at exit stay allocated in the
+ * trace. The header of the trace is written when the file is opened, and
+ * again each time lines are written out, so that the file is a trace even
+ * if the process never gets to exit, by exec or by a signal.
+ *
+ * Threads only agree with each other on the order of requests through the
+ * allocator: a free is recorded before it is made and an allocation after
+ * it is made, so a block is always freed in the trace before its address
+ * is handed out again. A realloc that moves a block is recorded before it
+ * is made, and if another thread frees the new address meanwhile, that
+ * free comes after the realloc in the trace; it is then recorded as freed
+ * just before the realloc instead, where it was.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The allocator is built with the driver names, mm_malloc and so on */
+#ifndef DRIVER
+#define DRIVER
+#endif
+#include "mm.h"
+
+/*
+ * The library is built with -fvisibility=hidden, so that the helpers of
+ * mm.c cannot take the place of functions of the program; only the entry
+ * points below are exported
+ */
+#define EXPORT __attribute__((visibility("default")))
+
+/* Number of slots in the capture ring; a power of two */
+#define RING_SLOTS (1 << 16)
+
+/* Size of the buffer trace lines are written out from */
+#define LINE_BUFFER (1 << 16)
+
+/* Width of each of the four header fields of a trace */
+#define HEADER_FIELD 20
+
+/* A request in the capture ring */
+typedef struct {
+    uint64_t seq; /* Position plus one once the request is complete */
+    void *ptr;    /* Block allocated, freed or resized to */
+    void *old;    /* Block a realloc resized */
+    size_t size;  /* Size asked for, or given to a sized free */
+    size_t align; /* Alignment a memalign asked for */
+    char op;      /* 'a', 'f', 'm', 'r' or 's', or 0 for a realloc that
+                     failed */
+} event_t;
+
+/* A block of the trace, found by its address */
+typedef struct {
+    uintptr_t addr; /* Address of the block, 0 for an empty entry */
+    int id;         /* Trace id, or -1 once the block is freed */
+    unsigned stale; /* Frees of the address still due for earlier blocks */
+    size_t size;    /* Size the block was asked for */
+} entry_t;
+
+/* private global variables */
+static bool capturing = false;   /* Are requests being recorded? */
+static int capture_fd = -1;      /* File the trace is written to */
+static event_t *ring;            /* The capture ring */
+static uint64_t ring_head = 0;   /* Next position to be reserved */
+static uint64_t ring_tail = 0;   /* Next position to be turned into lines */
+static int drain_busy = 0;       /* Is a thread turning requests into lines? */
+static entry_t *blocks;          /* Open-addressed table of blocks */
+static size_t blocks_cap = 0;    /* Number of entries in the table */
+static size_t blocks_used = 0;   /* Entries in use */
+static int num_ids = 0;          /* Ids handed out */
+static size_t num_ops = 0;       /* Lines written */
+static size_t live_bytes = 0;    /* Bytes asked for by allocated blocks */
+static size_t peak_bytes = 0;    /* High-water mark of live_bytes */
+static char lines[LINE_BUFFER];  /* Trace lines not written yet */
+static size_t lines_len = 0;     /* Bytes in lines */
+
+/*
+ * Trace output
+ */
+
+/* write_header - write the header of the trace at the start of the file */
+static void write_header(void) {
+    char header[4 * HEADER_FIELD];
+    size_t fields[4] = {1, (size_t)num_ids, num_ops, peak_bytes};
+    memset(header, ' ', sizeof(header));
+    for (int i = 0; i < 4; i++) {
+        char *end = header + (i + 1) * HEADER_FIELD - 1;
+        size_t x = fields[i];
+        *end-- = '\n';
+        do {
+            *end-- = (char)('0' + x % 10);
+            x /= 10;
+        } while (x != 0);
+    }
+    if (pwrite(capture_fd, header, sizeof(header), 0) < 0) {
+        capturing = false;
+    }
+}
+
+/*
+ * flush_lines - write the buffered trace lines to the file, and the header
+ *    that counts them
+ */
+static void flush_lines(void) {
+    size_t done = 0;
+    while (done < lines_len) {
+        ssize_t n = write(capture_fd, lines + done, lines_len - done);
+        if (n <= 0 && errno != EINTR) {
+            capturing = false;
+            break;
+        }
+        done += (n > 0) ? (size_t)n : 0;
+    }
+    lines_len = 0;
+    write_header();
+}
+
+/* put_number - append a decimal number to the buffered lines */
+static void put_number(size_t x) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + x % 10);
+        x /= 10;
+    } while (x != 0);
+    while (n > 0) {
+        lines[lines_len++] = digits[--n];
+    }
+}
+
+/*
+ * put_line - append a trace line; an alignment of 0 and a size of
+ *    (size_t)-1 are left out
+ */
+static void put_line(char op, int id, size_t align, size_t size) {
+    if (lines_len + 64 > LINE_BUFFER) {
+        flush_lines();
+    }
+    lines[lines_len++] = op;
+    lines[lines_len++] = ' ';
+    put_number((size_t)id);
+    if (align != 0) {
+        lines[lines_len++] = ' ';
+        put_number(align);
+    }
+    if (size != (size_t)-1) {
+        lines[lines_len++] = ' ';
+        put_number(size);
+    }
+    lines[lines_len++] = '\n';
+    num_ops++;
+}
+
+/*
+ * Table of blocks, kept by the thread turning requests into lines
+ */
+
+/* hash - slot of the table an address starts looking at */
+static size_t hash(uintptr_t addr) {
+    return (size_t)((addr >> 4) * 0x9e3779b97f4a7c15ULL) & (blocks_cap - 1);
+}
+
+/* grow_blocks - double the table, or make it; false if mmap fails */
+static bool grow_blocks(void) {
+    size_t old_cap = blocks_cap;
+    entry_t *old = blocks;
+    size_t cap = old_cap ? 2 * old_cap : 4096;
+    void *mem = mmap(NULL, cap * sizeof(entry_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+    blocks = mem;
+    blocks_cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].addr != 0) {
+            size_t j = hash(old[i].addr);
+            while (blocks[j].addr != 0) {
+                j = (j + 1) & (cap - 1);
+            }
+            blocks[j] = old[i];
+        }
+    }
+    if (old != NULL) {
+        munmap(old, old_cap * sizeof(entry_t));
+    }
+    return true;
+}
+
+/* find_block - entry of an address, or NULL if the table has none */
+static entry_t *find_block(void *ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    if (blocks_cap == 0) {
+        return NULL;
+    }
+    for (size_t i = hash(addr); blocks[i].addr != 0;
+         i = (i + 1) & (blocks_cap - 1)) {
+        if (blocks[i].addr == addr) {
+            return &blocks[i];
+        }
+    }
+    return NULL;
+}
+
+/* add_block - entry of an address, made empty if there was none */
+static entry_t *add_block(void *ptr) {
+    entry_t *e = find_block(ptr);
+    if (e != NULL) {
+        return e;
+    }
+    if (2 * (blocks_used + 1) > blocks_cap && !grow_blocks()) {
+        return NULL;
+    }
+    size_t i = hash((uintptr_t)ptr);
+    while (blocks[i].addr != 0) {
+        i = (i + 1) & (blocks_cap - 1);
+    }
+    blocks[i] = (entry_t){.addr = (uintptr_t)ptr, .id = -1};
+    blocks_used++;
+    return &blocks[i];
+}
+
+/* drop_block - remove an entry, moving back the ones probing past it */
+static void drop_block(entry_t *e) {
+    size_t i = (size_t)(e - blocks);
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & (blocks_cap - 1);
+        if (blocks[j].addr == 0) {
+            break;
+        }
+        size_t home = hash(blocks[j].addr);
+        if (((j - home) & (blocks_cap - 1)) >= ((j - i) & (blocks_cap - 1))) {
+            blocks[i] = blocks[j];
+            i = j;
+        }
+    }
+    blocks[i].addr = 0;
+    blocks_used--;
+}
+
+/* end_block - the block of an entry is no longer allocated */
+static void end_block(entry_t *e) {
+    live_bytes -= e->size;
+    e->id = -1;
+    if (e->stale == 0) {
+        drop_block(e);
+    }
+}
+
+/*
+ * start_block - give an entry a block of the given id and size, first
+ *    freeing the block still there, whose free is then due later
+ */
+static void start_block(entry_t *e, int id, size_t size) {
+    if (e->id >= 0) {
+        put_line('f', e->id, 0, (size_t)-1);
+        live_bytes -= e->size;
+        e->stale++;
+    }
+    e->id = id;
+    e->size = size;
+    live_bytes += size;
+    if (live_bytes > peak_bytes) {
+        peak_bytes = live_bytes;
+    }
+}
+
+/* record - turn one complete request into a trace line */
+static void record(const event_t *ev) {
+    entry_t *e;
+    switch (ev->op) {
+    case 'a':
+    case 'm':
+        if ((e = add_block(ev->ptr)) != NULL) {
+            start_block(e, num_ids, ev->size);
+            put_line(ev->op, num_ids++, ev->align, ev->size);
+        }
+        break;
+    case 'f':
+    case 's':
+        e = find_block(ev->ptr);
+        if (e == NULL) {
+            break;
+        }
+        if (e->stale > 0) {
+            e->stale--;
+            if (e->id < 0 && e->stale == 0) {
+                drop_block(e);
+            }
+        } else if (e->id >= 0) {
+            // a sized free only replays as one if it gave the size asked
+            if (ev->op == 's' && ev->size == e->size) {
+                put_line('s', e->id, 0, e->size);
+            } else {
+                put_line('f', e->id, 0, (size_t)-1);
+            }
+            end_block(e);
+        }
+        break;
+    case 'r':
+        e = find_block(ev->old);
+        if (e == NULL || e->id < 0) {
+            event_t alloc = *ev;
+            alloc.op = 'a';
+            record(&alloc);
+            break;
+        }
+        int id = e->id;
+        if (ev->ptr != ev->old) {
+            end_block(e);
+            if ((e = add_block(ev->ptr)) == NULL) {
+                break;
+            }
+            start_block(e, id, ev->size);
+        } else {
+            live_bytes += ev->size - e->size;
+            e->size = ev->size;
+            if (live_bytes > peak_bytes) {
+                peak_bytes = live_bytes;
+            }
+        }
+        put_line('r', id, 0, ev->size);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * The capture ring
+ */
+
+/*
+ * drain_held - turn the complete requests at the front of the ring into
+ *    trace lines; the requests after one not complete yet wait for the
+ *    next drain
+ */
+static void drain_held(void) {
+    for (;;) {
+        event_t *ev = &ring[ring_tail & (RING_SLOTS - 1)];
+        if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != ring_tail + 1) {
+            break;
+        }
+        record(ev);
+        __atomic_store_n(&ev->seq, ring_tail + RING_SLOTS, __ATOMIC_RELEASE);
+        ring_tail++;
+    }
+}
+
+/* drain - drain the ring, unless another thread is already at it */
+static void drain(void) {
+    if (!__atomic_exchange_n(&drain_busy, 1, __ATOMIC_ACQUIRE)) {
+        drain_held();
+        __atomic_store_n(&drain_busy, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * reserve - take the next slot of the ring, draining while it is still in
+ *    use; NULL when the capture is off
+ */
+static event_t *reserve(void) {
+    if (!__atomic_load_n(&capturing, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    uint64_t pos = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+    event_t *ev = &ring[pos & (RING_SLOTS - 1)];
+    while (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != pos) {
+        if (!__atomic_load_n(&capturing, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+        drain();
+        sched_yield();
+    }
+    ev->old = NULL;
+    ev->align = 0;
+    ev->op = 0;
+    return ev;
+}
+
+/* publish - complete a reserved request */
+static void publish(event_t *ev, char op, void *ptr, size_t size) {
+    if (ev == NULL) {
+        return;
+    }
+    uint64_t pos = ev->seq;
+    ev->op = op;
+    ev->ptr = ptr;
+    ev->size = size;
+    __atomic_store_n(&ev->seq, pos + 1, __ATOMIC_RELEASE);
+    if ((pos & (RING_SLOTS / 4 - 1)) == 0) {
+        drain();
+    }
+}
+
+/* capture - record a request right away */
+static void capture(char op, void *ptr, size_t size) {
+    if (capturing) {
+        publish(reserve(), op, ptr, size);
+    }
+}
+
+/* capture_aligned - record a memalign right away */
+static void capture_aligned(void *ptr, size_t align, size_t size) {
+    if (capturing) {
+        event_t *ev = reserve();
+        if (ev != NULL) {
+            ev->align = align;
+        }
+        publish(ev, 'm', ptr, size);
+    }
+}
+
+/* capture_child - keep the child of a fork from writing to the trace */
+static void capture_child(void) {
+    capturing = false;
+    close(capture_fd);
+    capture_fd = -1;
+}
+
+/* capture_start - start a capture if MM_CAPTURE names a file */
+__attribute__((constructor)) static void capture_start(void) {
+    const char *pattern = getenv("MM_CAPTURE");
+    if (pattern == NULL || *pattern == '\0') {
+        return;
+    }
+
+    // each process can write a trace of its own
+    char path[PATH_MAX];
+    size_t len = 0;
+    bool per_process = false;
+    for (const char *c = pattern; *c != '\0' && len + 24 < PATH_MAX; c++) {
+        if (c[0] == '%' && c[1] == 'p') {
+            char *start = path + len;
+            for (pid_t pid = getpid(); pid > 0; pid /= 10) {
+                path[len++] = (char)('0' + pid % 10);
+            }
+            for (char *end = path + len - 1; start < end; start++, end--) {
+                char t = *start;
+                *start = *end;
+                *end = t;
+            }
+            per_process = true;
+            c++;
+        } else {
+            path[len++] = *c;
+        }
+    }
+    path[len] = '\0';
+
+    // without %p, the trace is left to the first process and what it execs
+    if (!per_process) {
+        char pid[24];
+        const char *owner = getenv("MM_CAPTURE_PID");
+        snprintf(pid, sizeof(pid), "%d", (int)getpid());
+        if (owner != NULL && strcmp(owner, pid) != 0) {
+            return;
+        }
+        setenv("MM_CAPTURE_PID", pid, 1);
+    }
+
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture_fd < 0) {
+        return;
+    }
+    write_header();
+    if (lseek(capture_fd, 4 * HEADER_FIELD, SEEK_SET) < 0) {
+        close(capture_fd);
+        capture_fd = -1;
+        return;
+    }
+    ring = mmap(NULL, RING_SLOTS * sizeof(event_t), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        close(capture_fd);
+        capture_fd = -1;
+        return;
+    }
+    for (uint64_t i = 0; i < RING_SLOTS; i++) {
+        ring[i].seq = i;
+    }
+    pthread_atfork(NULL, NULL, capture_child);
+    __atomic_store_n(&capturing, true, __ATOMIC_RELEASE);
+}
+
+/* capture_finish - write out what is left and the header of the trace */
+__attribute__((destructor)) static void capture_finish(void) {
+    if (!__atomic_exchange_n(&capturing, false, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    while (__atomic_exchange_n(&drain_busy, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    drain_held();
+    flush_lines();
+    close(capture_fd);
+    capture_fd = -1;
+}
+
+/*
+ * Entry points of libc. Unlike mm_malloc, these give every request of 0
+ * bytes a block of its own, as programs expect.
+ */
+
+EXPORT void *malloc(size_t size) {
+    size = size ? size : 1;
+    void *p = mm_malloc(size);
+    if (p != NULL) {
+        capture('a', p, size);
+    } else {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+EXPORT void free(void *ptr) {
+    if (ptr != NULL) {
+        capture('f', ptr, 0);
+    }
+    mm_free(ptr);
+}
+
+EXPORT void free_sized(void *ptr, size_t size) {
+    if (ptr != NULL) {
+        capture('s', ptr, size);
+    }
+    mm_free_sized(ptr, size);
+}
+
+EXPORT void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+    (void)alignment;
+    free_sized(ptr, size);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    if (nmemb == 0 || size == 0) {
+        nmemb = size = 1;
+    }
+    void *p = mm_calloc(nmemb, size);
+    if (p != NULL) {
+        capture('a', p, nmemb * size);
+    } else {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    event_t *ev = capturing ? reserve() : NULL;
+    void *p = mm_realloc(ptr, size);
+    if (ev != NULL) {
+        ev->old = ptr;
+    }
+    if (p == NULL) {
+        publish(ev, 0, NULL, 0);
+        errno = ENOMEM;
+        return NULL;
+    }
+    publish(ev, 'r', p, size);
+    return p;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    size = size ? size : 1;
+    void *p = mm_memalign(alignment, size);
+    if (p == NULL) {
+        return ENOMEM;
+    }
+    capture_aligned(p, alignment, size);
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size = size ? size : 1;
+    void *p = mm_memalign(alignment, size);
+    if (p != NULL) {
+        capture_aligned(p, alignment, size);
+    } else {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return memalign((size_t)getpagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t pagesize = (size_t)getpagesize();
+    return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
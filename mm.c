@@ -27,20 +27,74 @@
  * next block, and 8 bytes for footer.
  * If the memory content of a block is less than 8 bytes, a free block will
  * have a uniformed block size of 16 bytes: 8 bytes for header and 8 bytes
- * for a pointer to the next free block.
+ * for a pointer to the next free block. Its size is implied by a tag bit,
+ * so the header instead holds a link to the previous free mini block.
  *
  * Organization of free list:
- * Segmentation list is used to implementation of free list. There are 15
- * buckets and each of the bucket contain blocks of different sizes. The
- * buckets are divided with threshold of powers of 2. The first bucket
- * is used to store mini blocks of size 16 bytes, and it is implemented using
- * singly linked list. The rest of the buckets are used to store regular
- * blocks, and it is implemented using doubly linked list.
+ * Segmentation list is used to implementation of free list. Each bucket
+ * contains blocks of a range of sizes. The buckets are divided at powers
+ * of 2, and each power of 2 is further split into 2^SEG_SUBCLASS_BITS
+ * subclasses (4 by default), so that a bucket lookup is a constant-time
+ * count-leading-zeros. The bucket heads live at the start of the heap
+ * rather than in global data. The first bucket is used to store mini blocks
+ * of size 16 bytes; it is doubly linked through the next pointer and the
+ * back link in the header, so a mini block is unlinked in constant time.
+ * The rest of the buckets are used to store regular blocks, and it is
+ * implemented using doubly linked list. Built with MM_LINK32, the links
+ * are 32-bit offsets from the first block instead of pointers, which fit
+ * both in a mini block, so bucket 0 is an ordinary doubly linked list.
+ * Free blocks of 4 KiB and more are kept in a splay tree instead, ordered
+ * by size and then by address, whose links live in their payloads. This
+ * gives them logarithmic best fit, with the lowest of equally sized blocks
+ * chosen first.
+ *
+ * Small objects:
+ * Requests of up to 128 bytes are served from slabs: allocated blocks that
+ * cover one aligned 2 KiB page each, holding a descriptor and header-free
+ * objects of one size class. Allocating and freeing an object pops or
+ * pushes it on the intrusive free list of its slab; a bitmap of heap pages
+ * tells free which pointers are slab objects. Empty slabs go back to the
+ * heap as ordinary free blocks. A class only gets a slab once the heap
+ * holds a slab's worth of live blocks of its size; until then it is
+ * served from ordinary blocks, so a size that is asked for a few times
+ * does not tie up a mostly empty 2 KiB slab.
  *
  * Allocater Manipulation:
  * When allocating a block, the allocater takes free blocks of suitable size
  * from the free list. When freeing a block, it puts the block back to the
- * its corresponding bucket.
+ * its corresponding bucket. When no free block fits, the heap grows by a
+ * step that doubles on runs of extends close together and shrinks back
+ * to 4 KiB once requests are served without growing.
+ *
+ * Deferred coalescing:
+ * When built with MM_DEFER, freed blocks of up to 512 bytes are not
+ * coalesced right away: they wait, still marked as allocated, in a quick
+ * bin of their exact size, and a request of that size takes one back
+ * untouched. The bins are coalesced into the seglist only when no free
+ * block fits a request.
+ *
+ * Large objects:
+ * Requests of at least 128 KiB that no free block can hold get a mapping of
+ * their own from memlib instead of growing the heap, so that freeing them
+ * gives the space back at once. The header of such a block holds the size
+ * of the mapping and a tag no heap block can have; realloc resizes the
+ * mapping, which moves it only if it cannot grow in place.
+ *
+ * Trimming:
+ * A free block of at least 512 KiB at the end of the heap is given back to
+ * memlib by shrinking the heap, keeping 128 KiB of it for the requests that
+ * follow. mm_trim gives back the free end of the heap on demand.
+ *
+ * Thread safety:
+ * When built with MM_THREADS, the allocator runs up to MM_ARENAS arenas.
+ * Each arena is a complete heap of its own (seglist table, prologue, blocks
+ * and epilogue) in its own memlib region, guarded by its own lock. Threads
+ * pick an arena round-robin on their first request. A block freed by a
+ * thread of another arena is pushed onto the owning arena's lock-free
+ * remote-free stack, which the owner drains the next time it takes its
+ * lock. Each thread keeps a small cache of blocks for each small size in
+ * front of its arena, and moves blocks between its cache and the arena in
+ * batches.
  *
  *************************************************************************
  *
@@ -59,6 +113,29 @@
 #include "memlib.h"
 #include "mm.h"
 
+/*
+ * Build with -DMM_THREADS=1 to get the thread-safe allocator: a small
+ * per-thread cache of blocks for each small size in front of per-thread
+ * arenas. -DMM_ARENAS=n picks the number of arenas; 1 shares a single
+ * heap between all threads.
+ */
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+
+#if MM_THREADS
+#include <pthread.h>
+
+#ifndef MM_ARENAS
+#define MM_ARENAS 4
+#endif
+
+/* The heap being worked on is per thread: the one of the arena it holds */
+#define MM_THREAD_LOCAL _Thread_local
+#else
+#define MM_THREAD_LOCAL
+#endif
+
 /* Do not change the following! */
 
 #ifdef DRIVER
@@ -116,6 +193,25 @@ static const size_t min_block_size = dsize;
 /** @brief Minimum size for extending heap (bytes) */
 static const size_t chunksize = (1 << 12);
 
+/*
+ * Largest step the heap grows by, given as a shift. The step doubles from
+ * chunksize on every extend that closely follows the last one, and halves
+ * back for every grow_window requests served without one. Pick another
+ * value with -DMM_GROW_SHIFT=n; 12 keeps the step at chunksize.
+ */
+#ifndef MM_GROW_SHIFT
+#define MM_GROW_SHIFT 16
+#endif
+
+/** @brief Largest step the heap grows by (bytes) */
+static const size_t grow_max = (size_t)1 << MM_GROW_SHIFT;
+
+/** @brief Number of requests without an extend that halves the step */
+static const size_t grow_window = 256;
+
+/** @brief The step never exceeds 1/grow_div of the heap's current size */
+static const size_t grow_div = 64;
+
 /** @brief Bit mask for extracting alloc bit */
 static const word_t alloc_mask = 0x1;
 
@@ -125,9 +221,193 @@ static const word_t last_alloc_mask = 0x2;
 /** @brief Bit mask for extracting mini bit */
 static const word_t mini_mask = 0x4;
 
+/**
+ * @brief Bit mask tagging a free mini block whose header holds the link to
+ *        the previous block in the mini list instead of a size
+ */
+static const word_t mini_link_mask = 0x8;
+
+/**
+ * @brief Header tag of a block with a mapping of its own. No block on the
+ *        heap is both allocated and tagged with mini_link_mask
+ */
+static const word_t map_mask = alloc_mask | mini_link_mask;
+
+/**
+ * @brief Header tag of an object bumped out of a region chunk, which is
+ *        also set apart from a mapped block by mini_mask
+ */
+static const word_t region_mask = alloc_mask | mini_mask | mini_link_mask;
+
 /** @brief Bit mask for extracting block size */
 static const word_t size_mask = ~(word_t)0xF;
 
+/** @brief Smallest request given a mapping of its own instead of a block */
+static const size_t map_threshold = (1 << 17);
+
+/** @brief Smallest free block at the end of the heap that gets trimmed */
+static const size_t trim_threshold = (1 << 19);
+
+/** @brief Bytes of a trimmed block kept at the end of the heap */
+static const size_t trim_pad = (1 << 17);
+
+/** @brief Most bytes of blocks mm_malloc_batch carves out of one free block */
+static const size_t batch_bytes = (1 << 12);
+
+/** @brief Size of the block each chunk of a region takes from the heap */
+static const size_t region_chunk = (1 << 14);
+
+/** @brief Largest request bumped out of a region rather than malloc'd */
+static const size_t region_max = (1 << 10);
+
+/*
+ * Number of second-level subclasses per power of two, given as a shift.
+ * 0 gives one bucket per power of two; 2 splits every power of two into
+ * 4 TLSF-style subclasses. Pick another value with -DSEG_SUBCLASS_BITS=n.
+ */
+#ifndef SEG_SUBCLASS_BITS
+#define SEG_SUBCLASS_BITS 2
+#endif
+
+/** @brief log2 of the number of subclasses per power of two */
+static const int seg_sl_bits = SEG_SUBCLASS_BITS;
+
+/*
+ * Number of seglist buckets. Buckets cover block sizes up to 2^13 units of
+ * dsize (128 KiB); one final bucket collects everything larger.
+ */
+#define SEG_CLASSES ((14 - SEG_SUBCLASS_BITS) << SEG_SUBCLASS_BITS)
+
+/** @brief Number of seglist buckets */
+static const int seg_classes = SEG_CLASSES;
+
+/** @brief Number of bits in one word of the non-empty bucket bitmap */
+static const int bitmap_bits = 8 * sizeof(word_t);
+
+/** @brief Number of words in the non-empty bucket bitmap */
+static const int bitmap_words = (SEG_CLASSES + 63) / 64;
+
+/*
+ * Free blocks of at least 2^TREE_SHIFT bytes are kept in one tree ordered
+ * by size and then by address, instead of in the buckets for their sizes.
+ * Pick another value with -DTREE_SHIFT=n, between 8 and 17.
+ */
+#ifndef TREE_SHIFT
+#define TREE_SHIFT 12
+#endif
+
+/** @brief Smallest free block kept in the tree */
+static const size_t tree_min = (size_t)1 << TREE_SHIFT;
+
+/**
+ * @brief Bucket whose head is the root of the tree, find_class(tree_min);
+ *        the buckets after it stay empty
+ */
+static const int tree_class =
+    ((TREE_SHIFT - 4 - SEG_SUBCLASS_BITS) << SEG_SUBCLASS_BITS) +
+    (1 << SEG_SUBCLASS_BITS) - 1;
+
+/*
+ * Slabs are only used in the single-threaded build: the thread caches of
+ * the threaded build read the header of every block they are handed.
+ */
+static const bool use_slabs = !MM_THREADS;
+
+/*
+ * calloc only clears what the heap has used before in the single-threaded
+ * build; the arenas of the threaded build grow concurrently, which
+ * mem_zero_start cannot follow.
+ */
+static const bool use_fresh = !MM_THREADS;
+
+/** @brief log2 of slab_size */
+static const int slab_shift = 11;
+
+/** @brief Size of one slab; slab payloads start on a multiple of it */
+static const size_t slab_size = (1 << 11);
+
+/** @brief Largest request served from a slab */
+static const size_t slab_max = 128;
+
+/* Number of slab size classes; class i holds objects of (i + 1) * dsize */
+#define SLAB_CLASSES 8
+
+/* Number of heap block sizes, up to that of a slab_max request, counted */
+#define SLAB_KEYS (SLAB_CLASSES + 1)
+
+/** @brief Initial number of words in the map of slab pages */
+static const size_t slab_map_min = 32;
+
+/*
+ * Build with -DMM_DEFER=1 to defer coalescing: freed blocks small enough
+ * for a quick bin are kept there as they are, and are only coalesced into
+ * the seglist when no free block fits a request.
+ */
+#ifndef MM_DEFER
+#define MM_DEFER 0
+#endif
+
+/** @brief Whether frees go to the quick bins first */
+static const bool use_quick = MM_DEFER;
+
+/* Number of quick bins; bin i holds blocks of (i + 1) * dsize bytes */
+#define QUICK_BINS 32
+
+/*
+ * Build with -DMM_STATS=1 to count what the allocator does, for
+ * mm_get_stats; debug builds count by default. Without it every counter
+ * update is dead code and compiles away.
+ */
+#ifndef MM_STATS
+#ifdef DEBUG
+#define MM_STATS 1
+#else
+#define MM_STATS 0
+#endif
+#endif
+
+/** @brief Whether the counters of mm_get_stats are kept */
+static const bool use_stats = MM_STATS;
+
+/*
+ * Build with -DMM_LINK32=1 to store the links of the seglist buckets as
+ * 32-bit offsets from heap_start, counted in dsize units, instead of as
+ * pointers. Both links of a free block then fit in the payload of a mini
+ * block, so mini blocks are doubly linked like the others rather than
+ * keeping their back link in the header. A heap can span up to 64 GiB.
+ */
+#ifndef MM_LINK32
+#define MM_LINK32 0
+#endif
+
+/** @brief Whether bucket links are offsets rather than pointers */
+static const bool use_link32 = MM_LINK32;
+
+/*
+ * mm_checkheap walks the whole heap once every MM_CHECK_SWEEP calls. The
+ * calls in between only check the blocks written since the call before,
+ * which are logged as they are written, and fall back to a full walk when
+ * more were written than the log holds. Debug builds check incrementally
+ * by default; -DMM_CHECK_SWEEP=1 walks the heap on every call again, and
+ * also scans the whole seglist on every insert and delete.
+ */
+#ifndef MM_CHECK_SWEEP
+#ifdef DEBUG
+#define MM_CHECK_SWEEP 1024
+#else
+#define MM_CHECK_SWEEP 1
+#endif
+#endif
+
+/** @brief Calls of mm_checkheap per full walk of the heap */
+static const unsigned long check_sweep = MM_CHECK_SWEEP;
+
+/** @brief Whether the blocks written are logged for mm_checkheap */
+static const bool use_check_log = MM_CHECK_SWEEP > 1;
+
+/* Number of blocks the log of mm_checkheap holds between two calls */
+#define CHECK_LOG 32
+
 /** @brief Represents the header and payload of one block in the heap */
 typedef struct block_t {
     /** @brief Header contains size + allocation flag */
@@ -137,18 +417,173 @@ typedef struct block_t {
             struct block_t *next;
             struct block_t *prev;
         };
+        /** @brief Bucket links of a free block built with MM_LINK32 */
+        struct {
+            uint32_t next_off;
+            uint32_t prev_off;
+        };
+        /** @brief Children and parent of a free block in the tree */
+        struct {
+            struct block_t *left;
+            struct block_t *right;
+            struct block_t *parent;
+        };
         /** @brief A pointer to the block payload */
         char payload[0];
     };
 } block_t;
 
+/**
+ * @brief Descriptor at the start of every slab. The objects after it have
+ *        no header; a free object holds the address of the next free one.
+ */
+typedef struct slab_t {
+    /** @brief Neighbours in the partial list of the class */
+    struct slab_t *next;
+    struct slab_t *prev;
+    /** @brief First free object */
+    void **free;
+    /** @brief Size of every object in the slab */
+    uint32_t size;
+    /** @brief Number of objects handed out */
+    uint32_t used;
+} slab_t;
+
+/** @brief Slab state, stored in the heap after the seglist bucket bitmap */
+typedef struct {
+    /** @brief Slabs of each class with at least one free object */
+    slab_t *partial[SLAB_CLASSES];
+    /** @brief Allocated heap blocks of each size, by size / dsize - 1 */
+    uint32_t live[SLAB_KEYS];
+    /** @brief One bit per slab-aligned page of the heap, set for slabs */
+    word_t *map;
+    /** @brief Number of words in the map */
+    size_t map_words;
+    /** @brief Address of the page the map starts at */
+    char *map_base;
+} slab_pool_t;
+
+/** @brief Heap growth state, stored in the heap after the slab state */
+typedef struct {
+    /** @brief Bytes the heap last grew by when no free block fit */
+    size_t step;
+    /** @brief Requests that reached the seglist since then */
+    size_t reqs;
+    /**
+     * @brief Start of the untouched end of the heap: the bytes from here up
+     *        to the footer of the last block hold zeros
+     */
+    char *untouched;
+} heap_grow_t;
+
+/** @brief Quick bin state, stored in the heap after the growth state */
+typedef struct {
+    /** @brief Freed blocks of each size, linked through their payload */
+    block_t *head[QUICK_BINS];
+    /** @brief Number of blocks in all the bins */
+    size_t count;
+} quick_bins_t;
+
+/** @brief Blocks written since the last mm_checkheap, kept outside the
+ *         heap so that checking does not change its layout */
+typedef struct {
+    /** @brief The blocks, none of which lies inside another */
+    struct block_t *block[CHECK_LOG];
+    /** @brief Number of blocks logged */
+    size_t count;
+    /** @brief Set when more blocks were written than fit */
+    bool overflow;
+    /** @brief mm_checkheap calls since the last full walk */
+    unsigned long calls;
+} check_log_t;
+
 /* Global variables */
 
 /** @brief Pointer to first block in the heap */
-static block_t *heap_start = NULL;
+static MM_THREAD_LOCAL block_t *heap_start = NULL;
+
+/** @brief Seglist bucket heads, stored at the very start of the heap */
+static MM_THREAD_LOCAL block_t **seglist = NULL;
+
+/** @brief Bitmap of non-empty seglist buckets, stored after the heads */
+static MM_THREAD_LOCAL word_t *seg_bitmap = NULL;
+
+/** @brief Counters of mm_get_stats, shared by all threads and arenas */
+static mm_stats_t stats;
+
+/**
+ * @brief A region opened by mm_region_begin, per thread in the thread-safe
+ *        build
+ */
+typedef struct {
+    /** @brief Set between mm_region_begin and mm_region_release */
+    bool open;
+    /** @brief Chunks, newest first, linked through their first word */
+    block_t *chunks;
+    /** @brief Where the header of the next object goes */
+    char *cursor;
+    /** @brief End of the newest chunk */
+    char *limit;
+} region_t;
+
+/** @brief The calling thread's region */
+static MM_THREAD_LOCAL region_t bump_region;
+
+#if MM_THREADS
+/** @brief memlib region holding the heap, 0 for the main heap */
+static _Thread_local int heap_region = 0;
+
+/**
+ * @brief Bumped by mm_init, so thread caches from an older heap are
+ *        dropped; it starts at 1 so that without any mm_init, as in a
+ *        preloaded library, a cache that was never filled is not current
+ */
+static word_t heap_gen = 1;
+
+/**
+ * @brief An independent heap. Arena 0 is the main heap; the others live in
+ *        regions mapped from memlib the first time a thread picks them.
+ */
+typedef struct {
+    /** @brief Guards the heap and its seglist */
+    pthread_mutex_t lock;
+    /** @brief memlib region the heap grows in */
+    int region;
+    /** @brief Set once the heap below has been laid out */
+    bool ready;
+    block_t *heap_start;
+    block_t **seglist;
+    word_t *seg_bitmap;
+    /** @brief Bounds of the region, used to find the owner of a block */
+    char *lo;
+    char *hi;
+    /** @brief Blocks freed by other threads, linked through next */
+    block_t *remote;
+    /** @brief Log of mm_checkheap for the heap */
+    check_log_t check_log;
+} arena_t;
+
+/** @brief The arenas; only arena 0 exists until other threads show up */
+static arena_t arenas[MM_ARENAS] = {
+    [0 ... MM_ARENAS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+
+/** @brief Log of mm_checkheap of the arena being worked on */
+static _Thread_local check_log_t *check_log = &arenas[0].check_log;
 
-/** @brief Seglist bucket on the stack */
-block_t *seglist[15];
+/** @brief Counter handing out arenas to threads round-robin */
+static unsigned arena_next = 0;
+
+/**
+ * @brief Address space reserved for each arena other than arena 0: an even
+ *        share of most of the 100 MB heap the driver provides, so that the
+ *        main heap keeps a share of the same size
+ */
+static const size_t arena_reserve = ((size_t)96 << 20) / MM_ARENAS;
+#else
+/** @brief Log of mm_checkheap for the heap */
+static check_log_t heap_log;
+static check_log_t *const check_log = &heap_log;
+#endif
 
 /*
  *****************************************************************************
@@ -190,6 +625,55 @@ static size_t round_up(size_t size, size_t n) {
     return n * ((size + (n - 1)) / n);
 }
 
+/**
+ * @brief Extends the heap being worked on by incr bytes
+ *
+ * In the thread-safe build this grows the memlib region of the arena the
+ * calling thread holds, otherwise the main heap.
+ *
+ * @param[in] incr The amount of bytes by which to extend the heap, or 0
+ * @return The previous break of the heap, or (void *)-1 on failure
+ */
+static void *heap_sbrk(intptr_t incr) {
+#if MM_THREADS
+    return mem_region_sbrk(heap_region, incr);
+#else
+    return mem_sbrk(incr);
+#endif
+}
+
+/**
+ * @brief Adds to one of the counters of mm_get_stats, if they are kept
+ * @param[in] counter A field of stats
+ * @param[in] n The amount to add
+ */
+static void stat_add(size_t *counter, size_t n) {
+    if (!use_stats) {
+        return;
+    }
+#if MM_THREADS
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+#else
+    *counter += n;
+#endif
+}
+
+/**
+ * @brief Converts a requested payload size into a block size.
+ *
+ * Requests of at most 8 bytes fit in a mini block; everything else gets a
+ * header and is rounded up to keep the payload 16-byte aligned.
+ *
+ * @param[in] size The number of payload bytes requested
+ * @return The adjusted block size
+ */
+static size_t adjust_size(size_t size) {
+    if (size <= wsize) {
+        return min_block_size;
+    }
+    return round_up(size + wsize, dsize);
+}
+
 /**
  * @brief Packs the `size` and `alloc` of a block into a word suitable for
  *        use as a packed value.
@@ -220,12 +704,16 @@ static word_t pack(size_t size, bool alloc, bool last, bool mini) {
  * @brief Extracts the size represented in a packed word.
  *
  * This function simply clears the lowest 4 bits of the word, as the heap
- * is 16-byte aligned.
+ * is 16-byte aligned. A header tagged with mini_link_mask alone belongs to a
+ * free mini block, whose size is implicitly 16 bytes.
  *
  * @param[in] word
  * @return The size of the block represented by the word
  */
 static size_t extract_size(word_t word) {
+    if ((word & map_mask) == mini_link_mask) {
+        return min_block_size;
+    }
     return (word & size_mask);
 }
 
@@ -318,6 +806,10 @@ static bool get_alloc(block_t *block) {
  */
 static size_t get_payload_size(block_t *block) {
     size_t asize = get_size(block);
+    if ((block->header & region_mask) == map_mask) {
+        // the size of a mapped block includes the word before its header
+        return asize - dsize;
+    }
     return asize - wsize;
 }
 
@@ -380,7 +872,10 @@ static bool get_last_mini(block_t *block) {
 static void write_hf(block_t *block, bool last, bool mini) {
     size_t size = get_size(block);
     bool alloc = get_alloc(block);
-    block->header = pack(size, alloc, last, mini);
+    // only touch the flag bits, so a free mini block keeps its list link
+    word_t flags = pack(0, false, last, mini);
+    block->header &= ~(last_alloc_mask | mini_mask);
+    block->header |= flags;
     if (alloc == false && size > 16) {
         word_t *footerp = header_to_footer(block);
         *footerp = pack(size, alloc, last, mini);
@@ -396,7 +891,7 @@ static void write_hf(block_t *block, bool last, bool mini) {
  */
 static void write_epilogue(block_t *block) {
     dbg_requires(block != NULL);
-    dbg_requires((char *)block == mem_heap_hi() - 7);
+    dbg_requires((char *)block == (char *)heap_sbrk(0) - wsize);
     block->header = pack(0, true, false, false);
 }
 
@@ -417,6 +912,44 @@ static block_t *find_next(block_t *block) {
     return (block_t *)((char *)block + get_size(block));
 }
 
+/**
+ * @brief Finds the log of blocks written for mm_checkheap.
+ * @return the log of the heap being worked on, which lives outside it
+ */
+static check_log_t *heap_check_log(void) {
+    return check_log;
+}
+
+/**
+ * @brief Logs a block that was written, for the next mm_checkheap.
+ *
+ * Blocks logged before that now lie inside the block are dropped, since
+ * they were merged into it and no longer start a block.
+ *
+ * @param[in] block A block with a valid header
+ */
+static void check_note(block_t *block) {
+    if (!use_check_log) {
+        return;
+    }
+    check_log_t *log = heap_check_log();
+    char *lo = (char *)block;
+    char *hi = lo + get_size(block);
+    size_t n = 0;
+    for (size_t i = 0; i < log->count; i++) {
+        char *logged = (char *)log->block[i];
+        if (logged < lo || logged >= hi) {
+            log->block[n++] = log->block[i];
+        }
+    }
+    if (n < CHECK_LOG) {
+        log->block[n++] = block;
+    } else {
+        log->overflow = true;
+    }
+    log->count = n;
+}
+
 /**
  * @brief Writes a block starting at the given address.
  *
@@ -447,6 +980,7 @@ static void write_block(block_t *block, size_t size, bool alloc, bool last,
     }
     block_t *next = find_next(block);
     write_hf(next, alloc, cur_mini);
+    check_note(block);
 }
 
 /**
@@ -488,6 +1022,123 @@ static block_t *find_prev(block_t *block) {
     return footer_to_header(footerp);
 }
 
+/**
+ * @brief Returns the previous block in the mini list of a free mini block.
+ *
+ * A free mini block has no room for a prev pointer in its payload, so the
+ * link is kept in its header. Block addresses are 8 mod 16, so the low four
+ * bits of the link are implied and can hold the flags.
+ *
+ * @param[in] block A free mini block in the mini list
+ * @return The previous block in the mini list, or NULL for the list head
+ */
+static block_t *get_mini_prev(block_t *block) {
+    dbg_requires(block->header & mini_link_mask);
+    word_t link = block->header & size_mask;
+    if (link == 0) {
+        return NULL;
+    }
+    return (block_t *)(link | wsize);
+}
+
+/**
+ * @brief Stores the mini list back link in the header of a free mini block
+ *
+ * The last alloc and last mini bits of the header are preserved.
+ *
+ * @param[out] block A free mini block
+ * @param[in] prev The previous block in the mini list, or NULL
+ */
+static void set_mini_prev(block_t *block, block_t *prev) {
+    dbg_requires(prev == NULL || ((word_t)prev & 0xF) == wsize);
+    word_t flags = block->header & (last_alloc_mask | mini_mask);
+    word_t link = (prev == NULL) ? 0 : ((word_t)prev & size_mask);
+    block->header = link | mini_link_mask | flags;
+}
+
+/**
+ * @brief Decodes a bucket link stored as an offset: 0 is NULL, and n is
+ *        the block n - 1 units of dsize after heap_start.
+ * @param[in] off
+ * @return The block linked to, or NULL
+ */
+static block_t *link_decode(uint32_t off) {
+    if (off == 0) {
+        return NULL;
+    }
+    return (block_t *)((char *)heap_start + (size_t)(off - 1) * dsize);
+}
+
+/**
+ * @brief Encodes a block, or NULL, as the offset of link_decode.
+ * @param[in] block A block of the heap, or NULL
+ * @return The offset of the block
+ */
+static uint32_t link_encode(block_t *block) {
+    if (block == NULL) {
+        return 0;
+    }
+    size_t units = (size_t)((char *)block - (char *)heap_start) / dsize;
+    dbg_requires(units < UINT32_MAX);
+    return (uint32_t)(units + 1);
+}
+
+/**
+ * @brief Returns the next block in the bucket of a free block.
+ * @param[in] block A free block in a seglist bucket
+ * @return The next block, or NULL for the last one
+ */
+static block_t *get_next(block_t *block) {
+    return use_link32 ? link_decode(block->next_off) : block->next;
+}
+
+/**
+ * @brief Returns the previous block in the bucket of a free block that is
+ *        not a mini block of the pointer encoding.
+ * @param[in] block A free block in a seglist bucket
+ * @return The previous block, or NULL for the first one
+ */
+static block_t *get_prev(block_t *block) {
+    return use_link32 ? link_decode(block->prev_off) : block->prev;
+}
+
+/**
+ * @brief Sets the next block in the bucket of a free block.
+ * @param[out] block A free block
+ * @param[in] next The next block, or NULL
+ */
+static void set_next(block_t *block, block_t *next) {
+    if (use_link32) {
+        block->next_off = link_encode(next);
+    } else {
+        block->next = next;
+    }
+}
+
+/**
+ * @brief Sets the previous block in the bucket of a free block that is not
+ *        a mini block of the pointer encoding.
+ * @param[out] block A free block
+ * @param[in] prev The previous block, or NULL
+ */
+static void set_prev(block_t *block, block_t *prev) {
+    if (use_link32) {
+        block->prev_off = link_encode(prev);
+    } else {
+        block->prev = prev;
+    }
+}
+
+/**
+ * @brief Tells whether a free block of the given size is on the mini list,
+ *        with its back link in the header. With MM_LINK32 there is none.
+ * @param[in] size
+ * @return if blocks of the size use the header back link
+ */
+static bool is_mini_listed(size_t size) {
+    return !use_link32 && size == min_block_size;
+}
+
 /*
  * ---------------------------------------------------------------------------
  *                        END SHORT HELPER FUNCTIONS
@@ -499,7 +1150,7 @@ static block_t *find_prev(block_t *block) {
 /** @brief print the blocks in the seglists */
 void print_free() {
     int i = 0;
-    while (i < 15) {
+    while (i < tree_class) {
         dbg_printf("~~~start of seglist[%d]~~~\n", i);
         block_t *temp = seglist[i];
         bool flag = true;
@@ -508,10 +1159,12 @@ void print_free() {
             dbg_printf("Size : %lu, Allocated : %d, Mini : %d \n",
                        get_size(temp), get_alloc(temp), get_last_mini(temp));
             dbg_printf("block address: %lu\n", (size_t)temp);
-            dbg_printf("block prev: %lu\n", (size_t)temp->prev);
-            dbg_printf("block next: %lu\n", (size_t)temp->next);
-            temp = temp->next;
-            if (temp != NULL && temp == temp->next) {
+            if (!is_mini_listed(get_size(temp))) {
+                dbg_printf("block prev: %lu\n", (size_t)get_prev(temp));
+            }
+            dbg_printf("block next: %lu\n", (size_t)get_next(temp));
+            temp = get_next(temp);
+            if (temp != NULL && temp == get_next(temp)) {
                 dbg_printf("cycle: temp == temp->next\n");
                 flag = false;
             }
@@ -525,7 +1178,7 @@ void print_free() {
 /** @brief prints the blocks on heap */
 void print_heap() {
     block_t *temp = heap_start;
-    while (temp != payload_to_header(mem_sbrk(0))) {
+    while (temp != payload_to_header(heap_sbrk(0))) {
         block_t *temp_prev = find_prev(temp);
         block_t *temp_next = find_next(temp);
         dbg_printf("Size : %lu, Allocated : %d, Mini : %d \n", get_size(temp),
@@ -540,94 +1193,301 @@ void print_heap() {
 
 /**
  * @brief find the index to the correct bucket in seglist
+ *
+ * The size is measured in units of dsize. With fl = floor(log2(units)),
+ * the top seg_sl_bits bits below the leading one select the subclass, so
+ * every power of two is split into 2^seg_sl_bits buckets. Sizes below
+ * 2^seg_sl_bits units get one bucket each; mini blocks land in bucket 0.
+ * The lookup is a single count-leading-zeros plus shifts, with no branches.
+ *
  * @param[in] block size
  * @return index to the correct bucket
  * @pre size must be greater than 0
  */
 int find_class(size_t size) {
     dbg_requires(size > 0);
-    if (size <= 16) {
-        return 0;
-    } else if (size > 16 && size <= 32) {
-        return 1;
-    } else if (size > 32 && size <= 64) {
-        return 2;
-    } else if (size > 64 && size <= 128) {
-        return 3;
-    } else if (size > 128 && size <= 256) {
-        return 4;
-    } else if (size > 256 && size <= 512) {
-        return 5;
-    } else if (size > 512 && size <= 1024) {
-        return 6;
-    } else if (size > 1024 && size <= 2048) {
-        return 7;
-    } else if (size > 2048 && size <= 4096) {
-        return 8;
-    } else if (size > 4096 && size <= 8192) {
-        return 9;
-    } else if (size > 8192 && size <= 16384) {
-        return 10;
-    } else if (size > 16384 && size <= 32768) {
-        return 11;
-    } else if (size > 32768 && size <= 65536) {
-        return 12;
-    } else if (size > 65536 && size <= 131072) {
-        return 13;
+    word_t units = size / dsize;
+    // or-ing in the subclass bit keeps fl >= seg_sl_bits for small sizes
+    int fl = 63 - __builtin_clzl(units | ((word_t)1 << seg_sl_bits));
+    int shift = fl - seg_sl_bits;
+    int i = (int)((shift << seg_sl_bits) + (units >> shift)) - 1;
+    return (i < seg_classes) ? i : seg_classes - 1;
+}
+
+/**
+ * @brief records whether seglist bucket i holds any blocks
+ * @param[in] i index of the bucket
+ * @param[in] nonempty true if the bucket now holds at least one block
+ */
+static void set_bucket_bit(int i, bool nonempty) {
+    word_t bit = (word_t)1 << (i % bitmap_bits);
+    if (nonempty) {
+        seg_bitmap[i / bitmap_bits] |= bit;
     } else {
-        return 14;
+        seg_bitmap[i / bitmap_bits] &= ~bit;
     }
 }
 
 /**
- * @brief check if a block is in the seglist
- * @param[in] pointer to the start of a seglist
- * @param[in] block
- * @return if a block is in the seglist
+ * @brief find the first non-empty seglist bucket at or after index i
+ *
+ * Masks off the buckets below i and counts trailing zeros, so a lookup
+ * costs one ctz per bitmap word instead of one probe per bucket.
+ *
+ * @param[in] i index of the first bucket to consider
+ * @return index of a non-empty bucket, or -1 if there is none
  */
-bool is_in(block_t *list_start, block_t *block) {
-    dbg_requires(block != NULL);
-    if (list_start == NULL) {
-        return false;
+static int find_nonempty(int i) {
+    int w = i / bitmap_bits;
+    if (w >= bitmap_words) {
+        return -1;
     }
-    block_t *temp = list_start;
-    while (temp != NULL) {
-        if (temp == block) {
-            return true;
+    word_t bits = seg_bitmap[w] & (~(word_t)0 << (i % bitmap_bits));
+    while (bits == 0) {
+        w++;
+        if (w >= bitmap_words) {
+            return -1;
         }
-        temp = temp->next;
+        bits = seg_bitmap[w];
     }
-    return false;
+    return w * bitmap_bits + __builtin_ctzl(bits);
 }
 
+/*
+ * Tree of large free blocks: free blocks of at least tree_min bytes form a
+ * splay tree rooted at seglist[tree_class], ordered by size and then by
+ * address. The children and parent links live in the payload of each free
+ * block, so the tree needs no memory of its own. The smallest block that
+ * fits a request is found in logarithmic time, with lower addresses
+ * winning ties; inserting and deleting a block splay it to the root.
+ */
+
 /**
- * @brief insert a free block to the seglist
- * @param[in] block
- * @pre block must not be NULL
+ * @brief compare two free blocks in tree order
+ * @param[in] a
+ * @param[in] b
+ * @return true if a comes before b: it is smaller, or as large and lower
  */
-void insert(block_t *block) {
-    dbg_requires(block != NULL);
-    int i = find_class(get_size(block));
-    dbg_requires(!is_in(seglist[i], block));
-    if (get_size(block) > 16) {
-        if (seglist[i] == NULL) {
-            seglist[i] = block;
-            block->prev = NULL;
-            block->next = NULL;
+static bool tree_less(block_t *a, block_t *b) {
+    size_t a_size = get_size(a);
+    size_t b_size = get_size(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+/**
+ * @brief rotate a block of the tree above its parent
+ * @param[in] x a block of the tree that is not the root
+ */
+static void tree_rotate(block_t *x) {
+    block_t *p = x->parent;
+    block_t *g = p->parent;
+    if (x == p->left) {
+        p->left = x->right;
+        if (x->right != NULL) {
+            x->right->parent = p;
+        }
+        x->right = p;
+    } else {
+        p->right = x->left;
+        if (x->left != NULL) {
+            x->left->parent = p;
+        }
+        x->left = p;
+    }
+    p->parent = x;
+    x->parent = g;
+    if (g == NULL) {
+        seglist[tree_class] = x;
+    } else if (g->left == p) {
+        g->left = x;
+    } else {
+        g->right = x;
+    }
+}
+
+/**
+ * @brief move a block of the tree up to the root
+ * @param[in] x a block of the tree
+ */
+static void tree_splay(block_t *x) {
+    while (x->parent != NULL) {
+        block_t *p = x->parent;
+        block_t *g = p->parent;
+        if (g == NULL) {
+            // zig
+            tree_rotate(x);
+        } else if ((x == p->left) == (p == g->left)) {
+            // zig-zig
+            tree_rotate(p);
+            tree_rotate(x);
         } else {
-            seglist[i]->prev = block;
-            block->next = seglist[i];
-            block->prev = NULL;
-            seglist[i] = block;
+            // zig-zag
+            tree_rotate(x);
+            tree_rotate(x);
+        }
+    }
+}
+
+/**
+ * @brief check if a block is in the tree, searching for it by its key
+ * @param[in] block
+ * @return if the block is in the tree
+ */
+static bool tree_has(block_t *block) {
+    block_t *node = seglist[tree_class];
+    while (node != NULL && node != block) {
+        node = tree_less(block, node) ? node->left : node->right;
+    }
+    return node != NULL;
+}
+
+/**
+ * @brief insert a large free block into the tree
+ * @param[in] block a free block of at least tree_min bytes
+ */
+static void tree_insert(block_t *block) {
+    dbg_requires(get_size(block) >= tree_min);
+    dbg_requires(!tree_has(block));
+    block_t *parent = NULL;
+    block_t *node = seglist[tree_class];
+    while (node != NULL) {
+        parent = node;
+        node = tree_less(block, node) ? node->left : node->right;
+    }
+    block->left = NULL;
+    block->right = NULL;
+    block->parent = parent;
+    if (parent == NULL) {
+        seglist[tree_class] = block;
+        set_bucket_bit(tree_class, true);
+        return;
+    }
+    if (tree_less(block, parent)) {
+        parent->left = block;
+    } else {
+        parent->right = block;
+    }
+    tree_splay(block);
+}
+
+/**
+ * @brief delete a block from the tree
+ *
+ * The block is splayed to the root and replaced by the smallest block of
+ * its right subtree, which takes over its left subtree.
+ *
+ * @param[in] block a block of the tree
+ */
+static void tree_delete(block_t *block) {
+    dbg_requires(tree_has(block));
+    tree_splay(block);
+    block_t *left = block->left;
+    block_t *root = block->right;
+    if (root == NULL) {
+        root = left;
+    } else if (left != NULL) {
+        while (root->left != NULL) {
+            root = root->left;
+        }
+        if (root != block->right) {
+            root->parent->left = root->right;
+            if (root->right != NULL) {
+                root->right->parent = root->parent;
+            }
+            root->right = block->right;
+            root->right->parent = root;
         }
+        root->left = left;
+        left->parent = root;
+    }
+    if (root != NULL) {
+        root->parent = NULL;
     } else {
+        set_bucket_bit(tree_class, false);
+    }
+    seglist[tree_class] = root;
+    block->left = NULL;
+    block->right = NULL;
+    block->parent = NULL;
+}
+
+/**
+ * @brief find the best fit for a request in the tree
+ * @param[in] asize the adjusted block size
+ * @return the smallest block of at least asize bytes, the lowest one of
+ *         those as large, or NULL if no block is large enough
+ */
+static block_t *tree_fit(size_t asize) {
+    block_t *best = NULL;
+    block_t *node = seglist[tree_class];
+    while (node != NULL) {
+        stat_add(&stats.fit_probes, 1);
+        if (get_size(node) >= asize) {
+            best = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief check if a block is in the seglist
+ * @param[in] pointer to the start of a seglist
+ * @param[in] block
+ * @return if a block is in the seglist
+ */
+bool is_in(block_t *list_start, block_t *block) {
+    dbg_requires(block != NULL);
+    if (list_start == NULL) {
+        return false;
+    }
+    block_t *temp = list_start;
+    while (temp != NULL) {
+        if (temp == block) {
+            return true;
+        }
+        temp = get_next(temp);
+    }
+    return false;
+}
+
+/**
+ * @brief insert a free block to the seglist
+ * @param[in] block
+ * @pre block must not be NULL
+ */
+void insert(block_t *block) {
+    dbg_requires(block != NULL);
+    check_note(block);
+    int i = find_class(get_size(block));
+    if (i >= tree_class) {
+        tree_insert(block);
+        return;
+    }
+    dbg_requires(use_check_log || !is_in(seglist[i], block));
+    if (seglist[i] == NULL) {
+        set_bucket_bit(i, true);
+    }
+    if (!is_mini_listed(get_size(block))) {
         if (seglist[i] == NULL) {
             seglist[i] = block;
-            block->next = NULL;
+            set_prev(block, NULL);
+            set_next(block, NULL);
         } else {
-            block->next = seglist[i];
+            set_prev(seglist[i], block);
+            set_next(block, seglist[i]);
+            set_prev(block, NULL);
             seglist[i] = block;
         }
+    } else {
+        block->next = seglist[i];
+        set_mini_prev(block, NULL);
+        if (seglist[i] != NULL) {
+            set_mini_prev(seglist[i], block);
+        }
+        seglist[i] = block;
     }
 }
 
@@ -638,55 +1498,61 @@ void insert(block_t *block) {
  */
 void delete (block_t *block) {
     dbg_requires(block != NULL);
+    check_note(block);
     int i = find_class(get_size(block));
+    if (i >= tree_class) {
+        tree_delete(block);
+        return;
+    }
     dbg_requires(seglist[i] != NULL);
-    dbg_requires(is_in(seglist[i], block));
+    dbg_requires(use_check_log || is_in(seglist[i], block));
     // delete first block
-    if (get_size(block) > 16) {
+    if (!is_mini_listed(get_size(block))) {
+        block_t *prev = get_prev(block);
+        block_t *next = get_next(block);
         if (block == seglist[i]) {
             // only block
-            if (block->next == NULL) {
+            if (next == NULL) {
                 seglist[i] = NULL;
+                set_bucket_bit(i, false);
             } else {
-                seglist[i] = block->next;
-                block->next->prev = NULL;
-                block->prev = NULL;
-                block->next = NULL;
+                seglist[i] = next;
+                set_prev(next, NULL);
+                set_prev(block, NULL);
+                set_next(block, NULL);
             }
         }
         // delete last block
-        else if (block->next == NULL) {
-            block->prev->next = NULL;
-            block->prev = NULL;
+        else if (next == NULL) {
+            set_next(prev, NULL);
+            set_prev(block, NULL);
         }
         // delete middle block
         else {
-            block->prev->next = block->next;
-            block->next->prev = block->prev;
-            block->next = NULL;
-            block->prev = NULL;
+            set_next(prev, next);
+            set_prev(next, prev);
+            set_next(block, NULL);
+            set_prev(block, NULL);
         }
     }
-    // deleting mini blocks
+    // deleting mini blocks, using the back link kept in the header
     else {
-        block_t *temp = seglist[i];
-        if (temp == block) {
-            // only block
-            if (temp->next == NULL) {
-                block->next = NULL;
-                seglist[i] = NULL;
-            }
-            // first block
-            else {
-                seglist[i] = block->next;
-                block->next = NULL;
+        block_t *prev = get_mini_prev(block);
+        block_t *next = block->next;
+        if (prev == NULL) {
+            seglist[i] = next;
+            if (next == NULL) {
+                set_bucket_bit(i, false);
             }
-            return;
+        } else {
+            prev->next = next;
         }
-        while (temp->next != block) {
-            temp = temp->next;
+        if (next != NULL) {
+            set_mini_prev(next, prev);
         }
-        temp->next = block->next;
+        // restore a plain header now that the block is off the list
+        block->header = pack(min_block_size, false, get_last_alloc(block),
+                             get_last_mini(block));
         block->next = NULL;
     }
 }
@@ -718,6 +1584,7 @@ static block_t *coalesce_block(block_t *block) {
     if (last_alloc == 0 && get_alloc(next_block) == 0) {
         prev_last_alloc = get_last_alloc(prev_block);
         prev_last_mini = get_last_mini(prev_block);
+        stat_add(&stats.coalesces[3], 1);
         delete (prev_block);
         delete (next_block);
         size_t size = prev_size + block_size + next_size;
@@ -726,6 +1593,7 @@ static block_t *coalesce_block(block_t *block) {
     }
     // only next is free (case 2)
     else if (last_alloc == 1 && get_alloc(next_block) == 0) {
+        stat_add(&stats.coalesces[1], 1);
         delete (next_block);
         size_t size = block_size + next_size;
         write_block(block, size, false, last_alloc, last_mini);
@@ -735,6 +1603,7 @@ static block_t *coalesce_block(block_t *block) {
     else if (last_alloc == 0 && get_alloc(next_block) == 1) {
         prev_last_alloc = get_last_alloc(prev_block);
         prev_last_mini = get_last_mini(prev_block);
+        stat_add(&stats.coalesces[2], 1);
         delete (prev_block);
         size_t size = block_size + prev_size;
         write_block(prev_block, size, false, prev_last_alloc, prev_last_mini);
@@ -742,11 +1611,21 @@ static block_t *coalesce_block(block_t *block) {
     }
     // both not free (case 1)
     else {
+        stat_add(&stats.coalesces[0], 1);
         write_block(block, block_size, false, last_alloc, last_mini);
         return block;
     }
 }
 
+/**
+ * @brief find the growth state of the heap
+ * @return the growth state, which lives right after the slab state
+ */
+static heap_grow_t *heap_grow(void) {
+    return (heap_grow_t *)((char *)&seg_bitmap[bitmap_words] +
+                           sizeof(slab_pool_t));
+}
+
 /**
  * @brief request more space on heap
  *
@@ -758,13 +1637,27 @@ static block_t *coalesce_block(block_t *block) {
  */
 static block_t *extend_heap(size_t size) {
     void *bp;
-    bool last = get_last_alloc(payload_to_header(mem_sbrk(0)));
-    bool mini = get_last_mini(payload_to_header(mem_sbrk(0)));
+    bool last = get_last_alloc(payload_to_header(heap_sbrk(0)));
+    bool mini = get_last_mini(payload_to_header(heap_sbrk(0)));
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1) {
+    if ((bp = heap_sbrk(size)) == (void *)-1) {
         return NULL;
     }
+    stat_add(&stats.extends, 1);
+    stat_add(&stats.extend_bytes, size);
+
+    // The new space is untouched past the links of the free block it
+    // starts, if memlib handed it out as zeros
+    heap_grow_t *grow = heap_grow();
+    char *end = (char *)bp + size;
+    char *zero = use_fresh ? (char *)mem_zero_start() : end;
+    if (zero < end) {
+        char *links = (char *)bp + sizeof(block_t);
+        grow->untouched = (zero > links) ? zero : links;
+    } else {
+        grow->untouched = end;
+    }
 
     // find address to the new space and epilogue
     block_t *block = payload_to_header(bp);
@@ -782,6 +1675,24 @@ static block_t *extend_heap(size_t size) {
     return block;
 }
 
+/**
+ * @brief note that the free block at the end of the heap was cut up
+ *
+ * What was cut off may be written from now on, so the untouched end of the
+ * heap starts no lower than past the header and links of what is left.
+ *
+ * @param[in] rest the free block left at the end of the heap, or NULL if
+ *                 none is
+ */
+static void cut_tail(block_t *rest) {
+    heap_grow_t *grow = heap_grow();
+    char *used = (rest == NULL) ? (char *)heap_sbrk(0)
+                                : (char *)rest + sizeof(block_t);
+    if (used > grow->untouched) {
+        grow->untouched = used;
+    }
+}
+
 /**
  * @brief split a large block into an allocated block and a free block
  *
@@ -810,6 +1721,7 @@ static block_t *split_block(block_t *block, size_t asize) {
 
     // split the block into two if it is large enough
     if ((block_size - asize) >= min_block_size) {
+        stat_add(&stats.splits, 1);
         block_t *block_next = (block_t *)((char *)block + asize);
         write_block(block_next, block_size - asize, false, true, cur_mini);
         write_block(block, asize, true, last, last_mini);
@@ -828,28 +1740,40 @@ static block_t *split_block(block_t *block, size_t asize) {
  * @brief
  * Find a block that is large enough to contain a given size
  * and small enough to reduce fragmentation. Search will find
- * the best fit within a controlled number of loops
+ * the best fit within a controlled number of loops in the buckets, and
+ * the true best fit among the large blocks of the tree
  * @param[in] asize
  * @return block
  */
 static block_t *find_fit(size_t asize) {
+    stat_add(&stats.fits, 1);
     int i = find_class(asize);
     if (i == 0 && seglist[i] != NULL) {
+        stat_add(&stats.fit_probes, 1);
         return seglist[i];
     }
-    while (i < 15) {
+    if (i > tree_class) {
+        i = tree_class;
+    }
+    // jump straight to the next bucket that has any blocks
+    while ((i = find_nonempty(i)) >= 0) {
+        // large blocks are looked up in the tree
+        if (i == tree_class) {
+            return tree_fit(asize);
+        }
         block_t *block = seglist[i];
         block_t *best = NULL;
         int limit = 3;
         // control the loop times
         while (block != NULL && limit > 0) {
+            stat_add(&stats.fit_probes, 1);
             if ((asize <= get_size(block))) {
                 if (best == NULL || get_size(best) > get_size(block)) {
                     best = block;
                 }
                 limit--;
             }
-            block = block->next;
+            block = get_next(block);
         }
         if (best == NULL) {
             i++;
@@ -858,380 +1782,2640 @@ static block_t *find_fit(size_t asize) {
         }
     }
     // no fit found
+    stat_add(&stats.fit_misses, 1);
     return NULL;
 }
 
 /**
- * @brief check if the seglist is valid
+ * @brief pick how far to grow the heap when no free block fits
  *
- * looping though the buckets of the seglists by blocks and check for
- * the boundry, doubly linked list / node number consistency
+ * An extend within grow_window requests of the last one is part of a run
+ * and doubles the step, up to grow_max; every full window without one
+ * halves it, down to chunksize. The step is also capped at 1/grow_div of
+ * the heap so a small heap never over-commits.
  *
- * @param[in] line number
- * @return if the seglist is valid
+ * @return the number of bytes to grow the heap by, at least chunksize
  */
-bool checkFree(int line) {
-    block_t *cur = seglist[0];
-    int i = 1;
+static size_t grow_step(void) {
+    heap_grow_t *grow = heap_grow();
+    size_t windows = grow->reqs / grow_window;
+    size_t limit = (size_t)((char *)heap_sbrk(0) - (char *)seglist) / grow_div;
+    limit = max(chunksize, limit < grow_max ? limit : grow_max);
+    if (windows == 0) {
+        grow->step = (2 * grow->step < limit) ? 2 * grow->step : limit;
+    } else if (windows < (size_t)bitmap_bits) {
+        grow->step = max(grow->step >> windows, chunksize);
+    } else {
+        grow->step = chunksize;
+    }
+    grow->reqs = 0;
+    return grow->step;
+}
 
-    // checking seglist for mini blocks
-    while (cur != NULL) {
-        if ((size_t)cur > ((size_t)mem_heap_hi()) ||
-            (size_t)cur < ((size_t)mem_heap_lo())) {
-            dbg_printf("boundry failed\n");
-            return false;
-        }
-        cur = cur->next;
+/*
+ * Quick bins: with use_quick, a freed block of up to QUICK_BINS * dsize
+ * bytes is pushed onto the bin of its size without touching its header,
+ * its footer or the flags of its neighbours, so the heap still sees it as
+ * allocated. A request of that exact size pops it straight back. The bins
+ * are only emptied into the seglist, coalescing every block on the way,
+ * when find_fit misses and before the heap is extended.
+ */
+
+/**
+ * @brief find the quick bins of the heap
+ * @return the quick bin state, which lives right after the growth state
+ */
+static quick_bins_t *heap_quick(void) {
+    return (quick_bins_t *)((char *)heap_grow() + sizeof(heap_grow_t));
+}
+
+/**
+ * @brief put a block that is being freed in the quick bin of its size
+ * @param[in] block an allocated block
+ * @return false if the block is too large for a quick bin
+ */
+static bool quick_push(block_t *block) {
+    size_t bin = get_size(block) / dsize - 1;
+    if (bin >= QUICK_BINS) {
+        return false;
     }
+    quick_bins_t *quick = heap_quick();
+    block->next = quick->head[bin];
+    quick->head[bin] = block;
+    quick->count++;
+    return true;
+}
 
-    // checking seglist for regular blocks
-    while (i < 15) {
-        block_t *temp = seglist[i];
-        block_t *end = NULL;
-        size_t count = 0;
-        if (seglist[i] == NULL) {
-        }
-        while (temp != NULL) {
-            block_t *next = temp->next;
-            // consistency
-            if (next != NULL && temp != next->prev) {
-                dbg_printf("consistency failed\n");
-                return false;
-            }
-            // boundry
-            if ((size_t)temp > ((size_t)mem_heap_hi()) ||
-                (size_t)temp < ((size_t)mem_heap_lo())) {
-                dbg_printf("boundry failed\n");
-                return false;
-            }
-            if (next == NULL) {
-                end = temp;
-            }
-            count++;
-            temp = temp->next;
-        }
-        // looping backwards to check if # of blocks match
-        while (end != NULL) {
-            count--;
-            end = end->prev;
-        }
-        if (count != 0) {
-            dbg_printf("# of nodes failed\n");
-            return false;
+/**
+ * @brief take a block of exactly a given size out of its quick bin
+ * @param[in] asize the adjusted block size
+ * @return an allocated block of asize bytes, or NULL if the bin is empty
+ */
+static block_t *quick_pop(size_t asize) {
+    size_t bin = asize / dsize - 1;
+    quick_bins_t *quick = heap_quick();
+    if (bin >= QUICK_BINS || quick->head[bin] == NULL) {
+        return NULL;
+    }
+    block_t *block = quick->head[bin];
+    quick->head[bin] = block->next;
+    quick->count--;
+    return block;
+}
+
+/**
+ * @brief empty the quick bins, coalescing every block and putting it in
+ *        the seglist
+ * @return false if the bins were already empty
+ */
+static bool quick_flush(void) {
+    quick_bins_t *quick = heap_quick();
+    if (quick->count == 0) {
+        return false;
+    }
+    for (int i = 0; i < QUICK_BINS; i++) {
+        block_t *block = quick->head[i];
+        quick->head[i] = NULL;
+        while (block != NULL) {
+            block_t *next = block->next;
+            write_block(block, get_size(block), false, get_last_alloc(block),
+                        get_last_mini(block));
+            insert(coalesce_block(block));
+            block = next;
         }
-        i++;
     }
+    quick->count = 0;
     return true;
 }
 
 /**
- * @brief check if a heap is valid
+ * @brief take a free block off the free list and allocate asize bytes of it
  *
- * looping though the blocks on a heap and check for prologue/epilogue,
- * boundry, allignment, last alloc/mini bit/header/footer consistency, size,
- * coalesce and seglist
+ * The block is split if too large, and the extra space goes back into the
+ * seglist.
  *
- * @param[in] line
- * @return if a heap is valid
+ * @param[in] block a free block of at least asize bytes
+ * @param[in] asize the adjusted block size
+ * @param[out] zero if not NULL, set to the address from which the payload
+ *                  is known to hold zeros, which is its end if none of it is
+ * @return the allocated block
  */
-bool mm_checkheap(int line) {
-    block_t *prologue = (block_t *)((word_t *)heap_start - 1);
-    block_t *epilogue = payload_to_header(mem_sbrk(0));
-    block_t *temp = heap_start;
+static block_t *place_block(block_t *block, size_t asize, char **zero) {
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
 
-    // check prologue
-    if ((size_t)prologue < (size_t)mem_heap_lo() || get_size(prologue) != 0 ||
-        get_alloc(prologue) == false) {
-        dbg_printf("prologue returns false\n");
-        return false;
-    }
+    // Mark block as allocated
+    size_t block_size = get_size(block);
+    bool last = get_last_alloc(block);
+    bool mini = get_last_mini(block);
+    bool tail = get_size(find_next(block)) == 0;
 
-    // check epilogue
-    if ((size_t)epilogue < (size_t)mem_heap_hi() - 7 ||
-        get_size(epilogue) != 0 || get_alloc(epilogue) == false) {
-        dbg_printf("epilogue returns false\n");
-        return false;
-    }
+    // Take the block off the free list while its header still holds the
+    // free-list link of a mini block, then mark it as allocated
+    delete (block);
+    write_block(block, block_size, true, last, mini);
 
-    // looping through the heap block by block
-    while (get_size(temp) != 0) {
-        word_t *temp_payload = header_to_payload(temp);
-        word_t *temp_footer = header_to_footer(temp);
-        block_t *temp_prev;
-        block_t *temp_next = find_next(temp);
-        bool next_alloc = get_alloc(temp);
-        if (temp == heap_start) {
-            temp_prev = prologue;
-        } else {
-            temp_prev = find_prev(temp);
-        }
+    // Try to split the block if too large, upload the free list
+    block_t *excess = split_block(block, asize);
+    dbg_assert(get_alloc(block));
 
-        // last alloc bit consistency
-        if (get_last_alloc(temp_next) != next_alloc) {
-            dbg_printf("last alloc consistency failed\n");
-            return false;
-        }
-        // mini check
-        if ((get_last_mini(temp_next) == true && get_size(temp) != 16) ||
-            (get_last_mini(temp_next) == false && get_size(temp) == 16)) {
-            dbg_printf("mini check returns false\n");
-            return false;
-        }
-        // boundry
-        if ((size_t)temp > ((size_t)mem_heap_hi() - 7 - min_block_size) ||
-            (size_t)temp < (size_t)heap_start) {
-            dbg_printf("boundry returns false\n");
-            return false;
-        }
-        // alignment
-        if (((size_t)temp & 0x7) != 0 || ((size_t)temp_payload & 0xF) != 0) {
-            dbg_printf("alignment returns false\n");
-            return false;
-        }
-        // header/footer check
-        if (get_alloc(temp) == 0 && get_size(temp) != 16) {
-            if (get_size(temp) != extract_size(*temp_footer) ||
-                get_alloc(temp) != extract_alloc(*temp_footer)) {
-                dbg_printf("header/footer returns false\n");
-                return false;
-            }
-        }
-        // check coalescing
-        if (get_alloc(temp) == 0) {
-            // first block / only block case
-            if (temp_prev == NULL) {
-                if (get_alloc(temp_next) == 0) {
-                    dbg_printf("coalesce first returns false\n");
-                    return false;
-                }
-            }
-            // last block case
-            if (temp_next == epilogue) {
-                if (get_last_alloc(temp) == 0) {
-                    dbg_printf("coalesce last returns false\n");
-                    return false;
-                }
-            }
-            // middle block case
-            else if (get_last_alloc(temp) == 0 || get_alloc(temp_next) == 0) {
-                dbg_printf("coalesce middle returns false\n");
-                return false;
+    // add the extra free space to its correponding seglist bucket
+    if (excess != NULL) {
+        dbg_assert(!get_alloc(excess));
+        insert(excess);
+    }
+
+    // Only the end of the heap is untouched. A whole tail block also holds
+    // its old footer, which is cleared for the caller who needs zeros
+    if (zero != NULL) {
+        char *bp = header_to_payload(block);
+        char *end = (char *)block + get_size(block);
+        char *untouched = heap_grow()->untouched;
+        *zero = end;
+        if (tail && untouched < end) {
+            *zero = (untouched > bp) ? untouched : bp;
+            if (excess == NULL) {
+                *(word_t *)(end - wsize) = 0;
             }
         }
-
-        temp = temp_next;
     }
-    // check seglists
-    if (!checkFree(line)) {
-        dbg_printf("checkFree returns false\n");
-
-        return false;
+    if (tail) {
+        cut_tail(excess);
     }
-    return true;
+    return block;
 }
 
 /**
- * @brief initialize the heap
+ * @brief take a block of a given size off the free list, given what
+ *        find_fit found for it
  *
- * request space on an empty heap, add the block containing the space
- * requested into the corresponding seglist, write the prologue and epilogue,
- * and initialize the seglist buckets.
+ * For callers that have already searched the free list, so that it is not
+ * searched twice; otherwise as alloc_block. Only sizes no quick bin holds
+ * may skip alloc_block.
  *
- * @return if init was successful
+ * @param[in] block the block find_fit returned for asize, or NULL
+ * @param[in] asize the adjusted block size
+ * @param[out] zero if not NULL, set to the address from which the payload
+ *                  is known to hold zeros, which is its end if none of it is
+ * @return an allocated block of at least asize bytes, or NULL if the heap
+ *         is out of memory
  */
-bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+static block_t *alloc_fit(block_t *block, size_t asize, char **zero) {
+    heap_grow()->reqs++;
 
-    if (start == (void *)-1) {
-        return false;
+    // Coalesce the deferred frees before giving up on the free list
+    if (block == NULL && use_quick && quick_flush()) {
+        block = find_fit(asize);
     }
 
-    start[0] = pack(0, true, false, false); // Heap prologue (block footer)
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        // Always request at least the current growth step
+        block = extend_heap(max(asize, grow_step()));
+
+        // extend_heap returns an error
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+    return place_block(block, asize, zero);
+}
+
+/**
+ * @brief take a block of a given size off the free list
+ *
+ * Search the free list for a block of good fit; if none is found, request
+ * more space. The block found is split if too large, and the extra space
+ * goes back into the seglist.
+ *
+ * @param[in] asize the adjusted block size
+ * @param[out] zero if not NULL, set to the address from which the payload
+ *                  is known to hold zeros, which is its end if none of it is
+ * @return an allocated block of at least asize bytes, or NULL if the heap
+ *         is out of memory
+ */
+static block_t *alloc_block(size_t asize, char **zero) {
+    // A deferred free of the same size is handed back as it is
+    block_t *block;
+    if (use_quick && (block = quick_pop(asize)) != NULL) {
+        if (zero != NULL) {
+            *zero = (char *)block + get_size(block);
+        }
+        return block;
+    }
+
+    // Search the free list for a fit
+    return alloc_fit(find_fit(asize), asize, zero);
+}
+
+/**
+ * @brief give the end of the last block of the heap back to memlib
+ *
+ * The heap is shrunk so that only pad bytes of the block are left, and the
+ * epilogue is written at the new end of the heap.
+ *
+ * @param[in] block the last block of the heap, free and not in the seglist
+ * @param[in] pad number of bytes of the block to keep
+ * @return what is left of the block, or NULL if nothing is
+ */
+static block_t *trim_block(block_t *block, size_t pad) {
+    dbg_requires(!get_alloc(block));
+    dbg_requires(get_size(find_next(block)) == 0);
+    size_t size = get_size(block);
+    size_t keep = round_up(pad, dsize);
+    if (keep >= size) {
+        return block;
+    }
+
+    bool last = get_last_alloc(block);
+    bool mini = get_last_mini(block);
+    if (heap_sbrk(-(intptr_t)(size - keep)) == (void *)-1) {
+        return block;
+    }
+
+    block_t *epilogue = (block_t *)((char *)block + keep);
+    write_epilogue(epilogue);
+    if (keep == 0) {
+        write_hf(epilogue, last, mini);
+        return NULL;
+    }
+    write_block(block, keep, false, last, mini);
+    return block;
+}
+
+/**
+ * @brief put a coalesced free block in the seglist, trimming it first if
+ *        it is a large block at the end of the heap
+ * @param[in] block a free block that is not in the seglist
+ */
+static void insert_or_trim(block_t *block) {
+    if (get_size(block) >= trim_threshold &&
+        get_size(find_next(block)) == 0) {
+        block = trim_block(block, trim_pad);
+        if (block == NULL) {
+            return;
+        }
+    }
+    insert(block);
+}
+
+/**
+ * @brief mark an allocated block as free, coalesce it with its free
+ *        neighbours and put it in the seglist
+ * @param[in] block an allocated block
+ */
+static void free_block(block_t *block) {
+    size_t size = get_size(block);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // Small blocks wait in a quick bin, still marked as allocated
+    if (use_quick && quick_push(block)) {
+        return;
+    }
+
+    // Mark the block as free
+    bool last = get_last_alloc(block);
+    bool mini = get_last_mini(block);
+    write_block(block, size, false, last, mini);
+
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(block);
+    insert_or_trim(block);
+}
+
+/*
+ * Slabs: requests of up to slab_max bytes are served from slabs. A slab is
+ * an allocated block whose payload starts on a slab_size boundary; that
+ * aligned page holds a slab_t descriptor followed by header-free objects of
+ * one size class. A bitmap of the pages of the heap, kept in a block of
+ * its own, tells which pages are slabs, so free can tell a slab object
+ * from the payload of a block. The allocated heap blocks of each size a
+ * slab request would get are counted, and a class without a partial slab
+ * only gets a new one when there are enough of them to fill it. A slab
+ * whose last object is freed goes back to the heap as an ordinary free
+ * block.
+ */
+
+/**
+ * @brief Size of the block holding a slab. Its payload starts on a page and
+ *        ends where the header of the next block sits, so slabs carved one
+ *        after the other stay aligned
+ */
+static const size_t slab_block_size = slab_size;
+
+/**
+ * @brief find the slab state of the heap
+ * @return the slab state, which lives right after the bucket bitmap
+ */
+static slab_pool_t *slab_pool(void) {
+    return (slab_pool_t *)&seg_bitmap[bitmap_words];
+}
+
+/**
+ * @brief find the slab holding a payload pointer
+ * @param[in] bp a payload pointer into the heap
+ * @return the descriptor of the slab holding bp, or NULL if bp is the
+ *         payload of a block
+ */
+static slab_t *slab_find(void *bp) {
+    slab_pool_t *pool = slab_pool();
+    size_t page = (size_t)((char *)bp - pool->map_base) >> slab_shift;
+    if (page / bitmap_bits >= pool->map_words ||
+        ((pool->map[page / bitmap_bits] >> (page % bitmap_bits)) & 1) == 0) {
+        return NULL;
+    }
+    return (slab_t *)(pool->map_base + (page << slab_shift));
+}
+
+/**
+ * @brief mark the page of a slab in the page map
+ * @param[in] slab
+ * @param[in] is_slab whether the page is now a slab
+ */
+static void slab_mark(slab_t *slab, bool is_slab) {
+    slab_pool_t *pool = slab_pool();
+    size_t page = (size_t)((char *)slab - pool->map_base) >> slab_shift;
+    word_t bit = (word_t)1 << (page % bitmap_bits);
+    if (is_slab) {
+        pool->map[page / bitmap_bits] |= bit;
+    } else {
+        pool->map[page / bitmap_bits] &= ~bit;
+    }
+}
+
+/**
+ * @brief grow the page map so it covers a page, copying the old map
+ * @param[in] page index of the page
+ * @return false if the heap has no room for the larger map
+ */
+static bool slab_map_grow(size_t page) {
+    slab_pool_t *pool = slab_pool();
+    size_t words = max(slab_map_min, pool->map_words);
+    while (page / bitmap_bits >= words) {
+        words *= 2;
+    }
+    block_t *block = alloc_block(adjust_size(words * sizeof(word_t)), NULL);
+    if (block == NULL) {
+        return false;
+    }
+
+    word_t *map = (word_t *)header_to_payload(block);
+    for (size_t i = 0; i < words; i++) {
+        map[i] = (i < pool->map_words) ? pool->map[i] : 0;
+    }
+    if (pool->map != NULL) {
+        free_block(payload_to_header(pool->map));
+    }
+    pool->map = map;
+    pool->map_words = words;
+    return true;
+}
+
+/**
+ * @brief find how far into a block a slab would have to start
+ * @param[in] block
+ * @return the offset of the slab block inside block, a multiple of dsize
+ */
+static size_t slab_lead(block_t *block) {
+    char *page = (char *)round_up((size_t)block + wsize, slab_size);
+    return (size_t)(page - wsize - (char *)block);
+}
+
+/**
+ * @brief find a free block with room for a slab on a slab_size boundary,
+ *        extending the heap by just enough if there is none
+ * @return a free block in the seglist, or NULL if the heap is out of memory
+ */
+static block_t *slab_find_fit(void) {
+    int i = find_class(slab_block_size);
+    while ((i = find_nonempty(i)) >= 0) {
+        // in the tree, try the smallest block that might hold a slab, then
+        // one twice the size of a slab, which holds one at any alignment
+        if (i == tree_class) {
+            block_t *block = tree_fit(slab_block_size);
+            if (block != NULL &&
+                slab_lead(block) + slab_block_size > get_size(block)) {
+                block = tree_fit(2 * slab_block_size);
+            }
+            if (block != NULL) {
+                return block;
+            }
+            break;
+        }
+        for (block_t *block = seglist[i]; block != NULL;
+             block = get_next(block)) {
+            if (slab_lead(block) + slab_block_size <= get_size(block)) {
+                return block;
+            }
+        }
+        i++;
+    }
+
+    // grow the free block at the end of the heap, or start a new one
+    block_t *end = payload_to_header(heap_sbrk(0));
+    block_t *start = get_last_alloc(end) ? end : find_prev(end);
+    size_t have = (size_t)((char *)end - (char *)start);
+    size_t need = slab_lead(start) + slab_block_size;
+    if (have >= need) {
+        return start;
+    }
+    return extend_heap(need - have);
+}
+
+/**
+ * @brief find how many objects of a class one slab holds
+ * @param[in] size the object size of the class
+ * @return the number of objects after the descriptor
+ */
+static size_t slab_objects(size_t size) {
+    return (slab_size - wsize - round_up(sizeof(slab_t), dsize)) / size;
+}
+
+/**
+ * @brief count a heap block in or out of the live blocks of its size
+ *
+ * Only blocks no larger than those slab requests get are counted; slabs
+ * themselves, mappings and region objects are not heap blocks of that
+ * size, and are never counted.
+ *
+ * @param[in] block a block just allocated, or about to be freed
+ * @param[in] alloc whether the block was allocated rather than freed
+ */
+static void slab_count(block_t *block, bool alloc) {
+    size_t k = get_size(block) / dsize - 1;
+    if (!use_slabs || k >= SLAB_KEYS) {
+        return;
+    }
+    uint32_t *live = &slab_pool()->live[k];
+    if (alloc) {
+        (*live)++;
+    } else {
+        dbg_assert(*live > 0);
+        (*live)--;
+    }
+}
+
+/**
+ * @brief carve a new slab for a class out of the heap, and thread all of
+ *        its objects onto its free list
+ * @param[in] size the object size of the class
+ * @return the new slab, or NULL if the heap is out of memory
+ */
+static slab_t *slab_new(size_t size) {
+    block_t *block = slab_find_fit();
+    if (block == NULL) {
+        return NULL;
+    }
+
+    // cut the free block into lead, slab block and tail, writing them back
+    // to front so each write_block finds a valid header after it
+    size_t block_size = get_size(block);
+    size_t lead = slab_lead(block);
+    size_t tail = block_size - lead - slab_block_size;
+    bool last = get_last_alloc(block);
+    bool mini = get_last_mini(block);
+    bool at_tail = get_size(find_next(block)) == 0;
+    block_t *slab_block = (block_t *)((char *)block + lead);
+    block_t *rest = (block_t *)((char *)slab_block + slab_block_size);
+    delete (block);
+    if (tail > 0) {
+        write_block(rest, tail, false, true, false);
+    }
+    if (lead > 0) {
+        write_block(slab_block, slab_block_size, true, false,
+                    lead == min_block_size);
+        write_block(block, lead, false, last, mini);
+        insert(block);
+    } else {
+        write_block(slab_block, slab_block_size, true, last, mini);
+    }
+    if (tail > 0) {
+        insert(rest);
+    }
+    if (at_tail) {
+        cut_tail(tail > 0 ? rest : NULL);
+    }
+
+    slab_t *slab = (slab_t *)header_to_payload(slab_block);
+    slab_pool_t *pool = slab_pool();
+    size_t page = (size_t)((char *)slab - pool->map_base) >> slab_shift;
+    if (page / bitmap_bits >= pool->map_words && !slab_map_grow(page)) {
+        free_block(slab_block);
+        return NULL;
+    }
+    slab_mark(slab, true);
+
+    // objects start after the descriptor and keep payload alignment
+    size_t first = round_up(sizeof(slab_t), dsize);
+    size_t count = slab_objects(size);
+    char *obj = (char *)slab + first;
+    slab->free = (void **)obj;
+    for (size_t k = 1; k < count; k++, obj += size) {
+        *(void **)obj = obj + size;
+    }
+    *(void **)obj = NULL;
+    slab->size = (uint32_t)size;
+    slab->used = 0;
+    return slab;
+}
+
+/**
+ * @brief unlink a slab from the partial list of its class
+ * @param[in] slab
+ */
+static void slab_unlink(slab_t *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        slab_pool()->partial[slab->size / dsize - 1] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * @brief push a slab onto the partial list of its class
+ * @param[in] slab
+ */
+static void slab_push(slab_t *slab) {
+    slab_t **head = &slab_pool()->partial[slab->size / dsize - 1];
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+/**
+ * @brief allocate a small object from the slab of its class
+ *
+ * The object is popped off the free list of the first partial slab of its
+ * class, so no header, split or seglist walk is involved. A request whose
+ * heap block would be no larger than the object, such as one of 8 bytes
+ * in a mini block, is left to the heap, where it costs no more. A class
+ * with no partial slab only gets a new one once the heap holds enough
+ * live blocks of the request's size to fill it.
+ *
+ * @param[in] size a request of at most slab_max bytes
+ * @return pointer to the object, or NULL if the request is left to the
+ *         heap or no slab could be had
+ */
+static void *slab_malloc(size_t size) {
+    size_t i = (size - 1) / dsize;
+    size_t asize = adjust_size(size);
+    if (asize == (i + 1) * dsize) {
+        return NULL;
+    }
+    slab_pool_t *pool = slab_pool();
+    slab_t *slab = pool->partial[i];
+    if (slab == NULL) {
+        if (pool->live[asize / dsize - 1] < slab_objects((i + 1) * dsize)) {
+            return NULL;
+        }
+        if ((slab = slab_new((i + 1) * dsize)) == NULL) {
+            return NULL;
+        }
+        slab_push(slab);
+    }
+
+    void **obj = slab->free;
+    slab->free = (void **)*obj;
+    slab->used++;
+    // a full slab leaves the partial list until an object comes back
+    if (slab->free == NULL) {
+        slab_unlink(slab);
+    }
+    return obj;
+}
+
+/**
+ * @brief return an object to its slab
+ *
+ * A slab that gets its first object back rejoins the partial list of its
+ * class; one with no objects left handed out goes back to the heap.
+ *
+ * @param[in] slab the slab holding the object
+ * @param[in] bp an object in the slab
+ */
+static void slab_free(slab_t *slab, void *bp) {
+    if (slab->free == NULL) {
+        slab_push(slab);
+    }
+    *(void **)bp = slab->free;
+    slab->free = (void **)bp;
+    slab->used--;
+    if (slab->used == 0) {
+        slab_unlink(slab);
+        slab_mark(slab, false);
+        free_block(payload_to_header(slab));
+    }
+}
+
+/**
+ * @brief check if the slabs are valid
+ *
+ * looping through the partial lists and checking that every slab is marked
+ * in the page map, sits in an allocated block of its own, holds objects of
+ * its class, and that its free and used objects add up to what fits in it
+ *
+ * @return if the slabs are valid
+ */
+static bool check_slabs(void) {
+    slab_pool_t *pool = slab_pool();
+    size_t first = round_up(sizeof(slab_t), dsize);
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        for (slab_t *slab = pool->partial[i]; slab != NULL;
+             slab = slab->next) {
+            block_t *block = payload_to_header(slab);
+            if (slab_find(slab) != slab || !get_alloc(block) ||
+                get_size(block) != slab_block_size ||
+                slab->size != (i + 1) * dsize || slab->free == NULL) {
+                dbg_printf("slab descriptor failed\n");
+                return false;
+            }
+            size_t n = 0;
+            for (void **obj = slab->free; obj != NULL; obj = (void **)*obj) {
+                if (slab_find(obj) != slab ||
+                    ((char *)obj - (char *)slab - first) % slab->size != 0) {
+                    dbg_printf("slab free list failed\n");
+                    return false;
+                }
+                n++;
+            }
+            if (n + slab->used != (slab_size - wsize - first) / slab->size) {
+                dbg_printf("slab count failed\n");
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief check if the quick bins are valid
+ *
+ * looping through the bins and checking that every block is on the heap,
+ * still marked as allocated and of the size of its bin, and that the bins
+ * hold as many blocks as they count
+ *
+ * @return if the quick bins are valid
+ */
+static bool check_quick(void) {
+    if (!use_quick) {
+        return true;
+    }
+    quick_bins_t *quick = heap_quick();
+    size_t n = 0;
+    for (size_t i = 0; i < QUICK_BINS; i++) {
+        for (block_t *block = quick->head[i]; block != NULL;
+             block = block->next) {
+            if ((char *)block < (char *)heap_start ||
+                (char *)block >= (char *)heap_sbrk(0) ||
+                !get_alloc(block) || get_size(block) != (i + 1) * dsize) {
+                dbg_printf("quick bin block failed\n");
+                return false;
+            }
+            // a cycle would otherwise loop forever
+            if (++n > quick->count) {
+                dbg_printf("quick bin count failed\n");
+                return false;
+            }
+        }
+    }
+    if (n != quick->count) {
+        dbg_printf("quick bin count failed\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Mapped blocks: a request of at least map_threshold bytes gets a memlib
+ * mapping of its own. The block header sits one word into the mapping so
+ * that the payload is 16-byte aligned, and holds the size of the whole
+ * mapping tagged with map_mask.
+ */
+
+/**
+ * @brief check whether a block has a mapping of its own
+ * @param[in] block
+ * @return true if the block is mapped rather than on the heap
+ */
+static bool is_mapped(block_t *block) {
+    return (block->header & region_mask) == map_mask;
+}
+
+/**
+ * @brief take the lock guarding mappings
+ *
+ * Mappings are carved out of the space the main heap grows into, so in the
+ * thread-safe build they are made under the lock of arena 0.
+ */
+static void map_lock(void) {
+#if MM_THREADS
+    pthread_mutex_lock(&arenas[0].lock);
+#endif
+}
+
+/** @brief release the lock guarding mappings */
+static void map_unlock(void) {
+#if MM_THREADS
+    pthread_mutex_unlock(&arenas[0].lock);
+#endif
+}
+
+/**
+ * @brief size of the mapping that holds a payload of a given size
+ * @param[in] size
+ * @return the mapping size, whole pages covering the word before the
+ *         header, the header and the payload
+ */
+static size_t map_size(size_t size) {
+    return round_up(size + dsize, mem_pagesize());
+}
+
+/**
+ * @brief allocate a block with a mapping of its own
+ * @param[in] size
+ * @param[out] zero if not NULL, set to the address from which the payload
+ *                  is known to hold zeros, which is its end if none of it is
+ * @return pointer to the payload of the block, or NULL if no mapping could
+ *         be made
+ */
+static void *map_malloc(size_t size, char **zero) {
+    size_t msize = map_size(size);
+    map_lock();
+    char *base = mem_map(msize);
+    char *zero_start = (base == (void *)-1) ? NULL : mem_zero_start();
+    map_unlock();
+    if (base == (void *)-1) {
+        return NULL;
+    }
+
+    block_t *block = (block_t *)(base + wsize);
+    block->header = msize | map_mask;
+    char *bp = header_to_payload(block);
+    if (zero != NULL) {
+        *zero = (zero_start > bp) ? zero_start : bp;
+    }
+    return bp;
+}
+
+/**
+ * @brief free a block with a mapping of its own, releasing the mapping
+ * @param[in] block a mapped block
+ */
+static void map_free(block_t *block) {
+    dbg_requires(is_mapped(block));
+    map_lock();
+    mem_unmap((char *)block - wsize, get_size(block));
+    map_unlock();
+}
+
+/**
+ * @brief resize a mapped block by resizing its mapping
+ *
+ * The mapping grows in place if the space after it is free, and is moved
+ * otherwise. A block that has shrunk below map_threshold is left to the
+ * caller to move to the heap.
+ *
+ * @param[in] block a mapped block
+ * @param[in] size the new payload size
+ * @return pointer to the payload of the resized block, or NULL if the
+ *         caller has to fall back to malloc + memcpy + free
+ */
+static void *map_realloc(block_t *block, size_t size) {
+    dbg_requires(is_mapped(block));
+    if (size < map_threshold) {
+        return NULL;
+    }
+
+    size_t msize = map_size(size);
+    map_lock();
+    char *base = mem_remap((char *)block - wsize, get_size(block), msize);
+    map_unlock();
+    if (base == (void *)-1) {
+        return NULL;
+    }
+
+    block = (block_t *)(base + wsize);
+    block->header = msize | map_mask;
+    return header_to_payload(block);
+}
+
+/*
+ * Regions: between mm_region_begin and mm_region_release, requests of up to
+ * region_max bytes are bumped out of chunks of region_chunk bytes, which
+ * are ordinary allocated blocks taken with alloc_block. Each object has a
+ * header of its own tagged with region_mask, so free, realloc and
+ * mm_usable_size tell it apart; freeing it does nothing, and the whole
+ * chunk goes back to the seglist when the region is released. Chunks are
+ * linked through the first word of their payload.
+ */
+
+/**
+ * @brief check whether a block was bumped out of a region
+ * @param[in] block
+ * @return true if the block is an object in a region chunk
+ */
+static bool is_region(block_t *block) {
+    return (block->header & region_mask) == region_mask;
+}
+
+/**
+ * @brief bump an object out of the newest chunk of the open region
+ * @param[in] size a request of at most region_max bytes
+ * @return pointer to the payload of the object, or NULL if the chunk is
+ *         full
+ */
+static void *region_bump(size_t size) {
+    region_t *r = &bump_region;
+    size_t asize = adjust_size(size);
+    if ((size_t)(r->limit - r->cursor) < asize) {
+        return NULL;
+    }
+    block_t *obj = (block_t *)r->cursor;
+    obj->header = asize | region_mask;
+    r->cursor += asize;
+    return header_to_payload(obj);
+}
+
+/**
+ * @brief start a new chunk for the open region
+ * @return false if the heap is out of memory
+ * @pre the heap must be initialized
+ */
+static bool region_grow(void) {
+    region_t *r = &bump_region;
+    block_t *chunk = alloc_block(region_chunk, NULL);
+    if (chunk == NULL) {
+        return false;
+    }
+
+    // payloads are dsize-aligned, so the first header follows the link
+    block_t **link = (block_t **)header_to_payload(chunk);
+    *link = r->chunks;
+    r->chunks = chunk;
+    r->cursor = (char *)link + wsize;
+    r->limit = (char *)chunk + get_size(chunk);
+    return true;
+}
+
+/**
+ * @brief allocate an object in the open region, starting a new chunk if
+ *        the newest one is full
+ * @param[in] size a request of at most region_max bytes
+ * @return pointer to the payload of the object, or NULL if the heap is out
+ *         of memory
+ */
+static void *region_malloc(size_t size) {
+    void *bp = region_bump(size);
+    if (bp == NULL && region_grow()) {
+        bp = region_bump(size);
+    }
+    return bp;
+}
+
+/**
+ * @brief close the open region and give all of its chunks back to the heap
+ *
+ * This takes one free_block per chunk, however many objects were bumped
+ * out of them.
+ */
+static void region_release(void) {
+    region_t *r = &bump_region;
+    block_t *chunk = r->chunks;
+    while (chunk != NULL) {
+        block_t *next = *(block_t **)header_to_payload(chunk);
+        free_block(chunk);
+        chunk = next;
+    }
+    *r = (region_t){0};
+}
+
+/**
+ * @brief check if the region of the calling thread is valid
+ *
+ * every chunk has to be an allocated block on the heap of at least
+ * region_chunk bytes, and the bump pointer has to lie in the newest one
+ *
+ * @return if the region is valid
+ */
+static bool check_region(void) {
+    region_t *r = &bump_region;
+    if (!r->open || r->chunks == NULL) {
+        return true;
+    }
+    for (block_t *chunk = r->chunks; chunk != NULL;
+         chunk = *(block_t **)header_to_payload(chunk)) {
+        if (!get_alloc(chunk) || is_mapped(chunk) || is_region(chunk) ||
+            get_size(chunk) < region_chunk) {
+            dbg_printf("region chunk %p failed\n", (void *)chunk);
+            return false;
+        }
+    }
+    char *first = (char *)header_to_payload(r->chunks) + wsize;
+    if (r->cursor < first || r->cursor > r->limit ||
+        r->limit != (char *)r->chunks + get_size(r->chunks)) {
+        dbg_printf("region bump pointer failed\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief check if the tree of large free blocks is valid
+ *
+ * walking the tree in order through the parent links and checking the
+ * boundry, the parent/child consistency, the order of the blocks and that
+ * every block is free and large enough for the tree
+ *
+ * @return if the tree is valid
+ */
+static bool check_tree(void) {
+    block_t *node = seglist[tree_class];
+    if (node != NULL && node->parent != NULL) {
+        dbg_printf("tree root failed\n");
+        return false;
+    }
+    while (node != NULL && node->left != NULL) {
+        node = node->left;
+    }
+    block_t *last = NULL;
+    while (node != NULL) {
+        if ((size_t)node >= ((size_t)heap_sbrk(0)) ||
+            (size_t)node < ((size_t)heap_start) || get_alloc(node) ||
+            get_size(node) < tree_min) {
+            dbg_printf("tree block failed\n");
+            return false;
+        }
+        if ((node->left != NULL && node->left->parent != node) ||
+            (node->right != NULL && node->right->parent != node)) {
+            dbg_printf("tree consistency failed\n");
+            return false;
+        }
+        if (last != NULL && !tree_less(last, node)) {
+            dbg_printf("tree order failed\n");
+            return false;
+        }
+        last = node;
+        // in-order successor
+        if (node->right != NULL) {
+            node = node->right;
+            while (node->left != NULL) {
+                node = node->left;
+            }
+        } else {
+            while (node->parent != NULL && node == node->parent->right) {
+                node = node->parent;
+            }
+            node = node->parent;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief check if the seglist is valid
+ *
+ * looping though the buckets of the seglists by blocks and check for
+ * the boundry, doubly linked list / node number consistency
+ *
+ * @param[in] line number
+ * @return if the seglist is valid
+ */
+bool checkFree(int line) {
+    // with offset links, mini blocks are checked like the rest
+    block_t *cur = use_link32 ? NULL : seglist[0];
+    int i = use_link32 ? 0 : 1;
+
+    // checking seglist for mini blocks
+    block_t *cur_prev = NULL;
+    while (cur != NULL) {
+        if ((size_t)cur >= ((size_t)heap_sbrk(0)) ||
+            (size_t)cur < ((size_t)heap_start)) {
+            dbg_printf("boundry failed\n");
+            return false;
+        }
+        // back link consistency
+        if ((cur->header & mini_link_mask) == 0 || get_alloc(cur) ||
+            get_mini_prev(cur) != cur_prev) {
+            dbg_printf("mini link failed\n");
+            return false;
+        }
+        cur_prev = cur;
+        cur = cur->next;
+    }
+
+    // checking the non-empty bitmap against the bucket heads
+    for (int j = 0; j < seg_classes; j++) {
+        bool marked = (seg_bitmap[j / bitmap_bits] >> (j % bitmap_bits)) & 1;
+        if (marked != (seglist[j] != NULL)) {
+            dbg_printf("bucket bitmap failed\n");
+            return false;
+        }
+    }
+
+    // checking the tree of large blocks, and that no bucket after it is used
+    if (!check_tree()) {
+        dbg_printf("tree failed\n");
+        return false;
+    }
+    for (int j = tree_class + 1; j < seg_classes; j++) {
+        if (seglist[j] != NULL) {
+            dbg_printf("bucket after tree failed\n");
+            return false;
+        }
+    }
+
+    // checking seglist for regular blocks
+    while (i < tree_class) {
+        block_t *temp = seglist[i];
+        block_t *end = NULL;
+        size_t count = 0;
+        if (seglist[i] == NULL) {
+        }
+        while (temp != NULL) {
+            block_t *next = get_next(temp);
+            // consistency
+            if (next != NULL && temp != get_prev(next)) {
+                dbg_printf("consistency failed\n");
+                return false;
+            }
+            // boundry
+            if ((size_t)temp >= ((size_t)heap_sbrk(0)) ||
+                (size_t)temp < ((size_t)heap_start)) {
+                dbg_printf("boundry failed\n");
+                return false;
+            }
+            if (next == NULL) {
+                end = temp;
+            }
+            count++;
+            temp = next;
+        }
+        // looping backwards to check if # of blocks match
+        while (end != NULL) {
+            count--;
+            end = get_prev(end);
+        }
+        if (count != 0) {
+            dbg_printf("# of nodes failed\n");
+            return false;
+        }
+        i++;
+    }
+    return true;
+}
+
+/**
+ * @brief check the prologue and epilogue of the heap
+ * @return if both are valid
+ */
+static bool check_ends(void) {
+    block_t *prologue = (block_t *)((word_t *)heap_start - 1);
+    block_t *epilogue = payload_to_header(heap_sbrk(0));
+
+    // check prologue
+    if ((size_t)prologue < (size_t)mem_heap_lo() || get_size(prologue) != 0 ||
+        get_alloc(prologue) == false) {
+        dbg_printf("prologue returns false\n");
+        return false;
+    }
+
+    // check epilogue
+    if ((size_t)epilogue < (size_t)heap_sbrk(0) - wsize ||
+        get_size(epilogue) != 0 || get_alloc(epilogue) == false) {
+        dbg_printf("epilogue returns false\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief check one block of the heap
+ *
+ * checks the boundry, allignment, last alloc/mini bit/header/footer
+ * consistency and size of the block, and that a free block is coalesced
+ * with its neighbours
+ *
+ * @param[in] temp a block of the heap other than the epilogue
+ * @return if the block is valid
+ */
+static bool check_block(block_t *temp) {
+    block_t *prologue = (block_t *)((word_t *)heap_start - 1);
+    block_t *epilogue = payload_to_header(heap_sbrk(0));
+    word_t *temp_payload = header_to_payload(temp);
+    word_t *temp_footer = header_to_footer(temp);
+    block_t *temp_prev;
+    block_t *temp_next = find_next(temp);
+    bool next_alloc = get_alloc(temp);
+    if (temp == heap_start) {
+        temp_prev = prologue;
+    } else {
+        temp_prev = find_prev(temp);
+    }
+
+    // last alloc bit consistency
+    if (get_last_alloc(temp_next) != next_alloc) {
+        dbg_printf("last alloc consistency failed\n");
+        return false;
+    }
+    // mini check
+    if ((get_last_mini(temp_next) == true && get_size(temp) != 16) ||
+        (get_last_mini(temp_next) == false && get_size(temp) == 16)) {
+        dbg_printf("mini check returns false\n");
+        return false;
+    }
+    // boundry
+    if ((size_t)temp > ((size_t)heap_sbrk(0) - wsize - min_block_size) ||
+        (size_t)temp < (size_t)heap_start) {
+        dbg_printf("boundry returns false\n");
+        return false;
+    }
+    // alignment
+    if (((size_t)temp & 0x7) != 0 || ((size_t)temp_payload & 0xF) != 0) {
+        dbg_printf("alignment returns false\n");
+        return false;
+    }
+    // header/footer check
+    if (get_alloc(temp) == 0 && get_size(temp) != 16) {
+        if (get_size(temp) != extract_size(*temp_footer) ||
+            get_alloc(temp) != extract_alloc(*temp_footer)) {
+            dbg_printf("header/footer returns false\n");
+            return false;
+        }
+    }
+    // check coalescing
+    if (get_alloc(temp) == 0) {
+        // first block / only block case
+        if (temp_prev == NULL) {
+            if (get_alloc(temp_next) == 0) {
+                dbg_printf("coalesce first returns false\n");
+                return false;
+            }
+        }
+        // last block case
+        if (temp_next == epilogue) {
+            if (get_last_alloc(temp) == 0) {
+                dbg_printf("coalesce last returns false\n");
+                return false;
+            }
+        }
+        // middle block case
+        else if (get_last_alloc(temp) == 0 || get_alloc(temp_next) == 0) {
+            dbg_printf("coalesce middle returns false\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief check that a free block is linked into the seglist
+ *
+ * looks only at the blocks linked to it: its neighbours in its bucket, or
+ * its parent and children in the tree, have to link back to it, and the
+ * first block of a bucket has to be its head
+ *
+ * @param[in] block a free block
+ * @return if the block is in its bucket or the tree
+ */
+static bool check_linked(block_t *block) {
+    size_t size = get_size(block);
+    int i = find_class(size);
+    if (i >= tree_class) {
+        block_t *parent = block->parent;
+        if ((parent == NULL && seglist[tree_class] != block) ||
+            (parent != NULL && parent->left != block &&
+             parent->right != block) ||
+            (block->left != NULL && block->left->parent != block) ||
+            (block->right != NULL && block->right->parent != block)) {
+            dbg_printf("tree link failed\n");
+            return false;
+        }
+        return true;
+    }
+
+    bool mini = is_mini_listed(size);
+    if (mini && (block->header & mini_link_mask) == 0) {
+        dbg_printf("mini link failed\n");
+        return false;
+    }
+    block_t *prev = mini ? get_mini_prev(block) : get_prev(block);
+    block_t *next = get_next(block);
+    if ((prev == NULL && seglist[i] != block) ||
+        (prev != NULL && get_next(prev) != block)) {
+        dbg_printf("list link failed\n");
+        return false;
+    }
+    if (next != NULL) {
+        if ((size_t)next >= ((size_t)heap_sbrk(0)) ||
+            (size_t)next < ((size_t)heap_start)) {
+            dbg_printf("boundry failed\n");
+            return false;
+        }
+        bool back = mini ? ((next->header & mini_link_mask) != 0 &&
+                            get_mini_prev(next) == block)
+                         : get_prev(next) == block;
+        if (!back) {
+            dbg_printf("list link failed\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief check if a heap is valid
+ *
+ * looping though the blocks on a heap and check for prologue/epilogue,
+ * boundry, allignment, last alloc/mini bit/header/footer consistency, size,
+ * coalesce and seglist
+ *
+ * @param[in] line
+ * @return if a heap is valid
+ */
+static bool check_heap(int line) {
+    block_t *temp = heap_start;
+
+    if (!check_ends()) {
+        return false;
+    }
+
+    // looping through the heap block by block
+    while (get_size(temp) != 0) {
+        if (!check_block(temp)) {
+            return false;
+        }
+        temp = find_next(temp);
+    }
+    // check seglists
+    if (!checkFree(line)) {
+        dbg_printf("checkFree returns false\n");
+
+        return false;
+    }
+    // check slabs
+    if (!check_slabs()) {
+        dbg_printf("check_slabs returns false\n");
+        return false;
+    }
+    // check quick bins
+    if (!check_quick()) {
+        dbg_printf("check_quick returns false\n");
+        return false;
+    }
+    // check the chunks of the open region
+    if (!check_region()) {
+        dbg_printf("check_region returns false\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief check the blocks written since the last call
+ *
+ * every block in the log, and the block after it, gets the checks the full
+ * walk makes of each block, and a free one has to be linked into its
+ * bucket. The prologue, epilogue and bucket bitmap are checked as well;
+ * the slabs and quick bins are left to the full walk.
+ *
+ * @return if the blocks logged are valid
+ */
+static bool check_logged(void) {
+    check_log_t *log = heap_check_log();
+    block_t *epilogue = payload_to_header(heap_sbrk(0));
+
+    if (!check_ends()) {
+        return false;
+    }
+    for (int j = 0; j < seg_classes; j++) {
+        bool marked = (seg_bitmap[j / bitmap_bits] >> (j % bitmap_bits)) & 1;
+        if (marked != (seglist[j] != NULL)) {
+            dbg_printf("bucket bitmap failed\n");
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < log->count; i++) {
+        block_t *block = log->block[i];
+        // blocks given back by trimming the heap are gone
+        if ((char *)block >= (char *)epilogue) {
+            continue;
+        }
+        if (!check_block(block) ||
+            (!get_alloc(block) && !check_linked(block))) {
+            return false;
+        }
+        block_t *next = find_next(block);
+        if (next != epilogue && !check_block(next)) {
+            return false;
+        }
+    }
+    log->count = 0;
+    return true;
+}
+
+/**
+ * @brief check if a heap is valid
+ *
+ * walks the whole heap every check_sweep calls, or when more blocks were
+ * written since the last call than were logged, and otherwise checks just
+ * the blocks written since then
+ *
+ * @param[in] line
+ * @return if a heap is valid
+ */
+bool mm_checkheap(int line) {
+    if (use_check_log) {
+        check_log_t *log = heap_check_log();
+        if (!log->overflow && ++log->calls < check_sweep) {
+            return check_logged();
+        }
+        log->count = 0;
+        log->overflow = false;
+        log->calls = 0;
+    }
+    return check_heap(line);
+}
+
+/**
+ * @brief lay out an empty heap
+ *
+ * request space on an empty heap, add the block containing the space
+ * requested into the corresponding seglist, write the prologue and epilogue,
+ * and initialize the seglist buckets.
+ *
+ * @return if init was successful
+ */
+static bool heap_init(void) {
+    // Create the initial empty heap, with room for the seglist heads, the
+    // non-empty bucket bitmap, the slab state, the growth state and the
+    // quick bins; the log of mm_checkheap is kept outside, so that debug
+    // builds lay out the heap the same way
+    size_t table_size = round_up(seg_classes * sizeof(block_t *) +
+                                     bitmap_words * sizeof(word_t) +
+                                     sizeof(slab_pool_t) + sizeof(heap_grow_t) +
+                                     (use_quick ? sizeof(quick_bins_t) : 0),
+                                 dsize);
+    word_t *start = (word_t *)(heap_sbrk(table_size + 2 * wsize));
+
+    if (start == (void *)-1) {
+        return false;
+    }
+
+    seglist = (block_t **)start;
+    seg_bitmap = (word_t *)&seglist[seg_classes];
+    start = (word_t *)((char *)start + table_size);
+
+    start[0] = pack(0, true, false, false); // Heap prologue (block footer)
     start[1] = pack(0, true, true, false);  // Heap epilogue (block header)
 
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
-    for (int i = 0; i < 15; i++) {
-        seglist[i] = NULL;
+    // Heap starts with first "block header", currently the epilogue
+    heap_start = (block_t *)&(start[1]);
+    for (int i = 0; i < seg_classes; i++) {
+        seglist[i] = NULL;
+    }
+    for (int i = 0; i < bitmap_words; i++) {
+        seg_bitmap[i] = 0;
+    }
+
+    // No slabs yet; the page map is allocated with the first one
+    slab_pool_t *pool = slab_pool();
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        pool->partial[i] = NULL;
+    }
+    for (int i = 0; i < SLAB_KEYS; i++) {
+        pool->live[i] = 0;
+    }
+    pool->map = NULL;
+    pool->map_words = 0;
+    pool->map_base = (char *)((word_t)heap_start & ~(word_t)(slab_size - 1));
+
+    // Growth starts in steps of chunksize
+    heap_grow()->step = chunksize;
+    heap_grow()->reqs = 0;
+
+    // No deferred frees yet
+    if (use_quick) {
+        quick_bins_t *quick = heap_quick();
+        for (int i = 0; i < QUICK_BINS; i++) {
+            quick->head[i] = NULL;
+        }
+        quick->count = 0;
+    }
+
+    // Nothing written yet
+    if (use_check_log) {
+        check_log_t *log = heap_check_log();
+        log->count = 0;
+        log->overflow = false;
+        log->calls = 0;
+    }
+
+    // Extend the empty heap with a free block of chunksize bytes
+    if (extend_heap(chunksize) == NULL) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief initialize the heap
+ *
+ * In the thread-safe build this also drops every arena but the main heap,
+ * and invalidates the cache of every thread.
+ *
+ * @return if init was successful
+ */
+bool mm_init(void) {
+    stats = (mm_stats_t){0};
+    bump_region = (region_t){0};
+#if MM_THREADS
+    for (int i = 0; i < MM_ARENAS; i++) {
+        arenas[i].ready = false;
+        arenas[i].remote = NULL;
+    }
+    arena_next = 0;
+
+    heap_region = 0;
+    check_log = &arenas[0].check_log;
+    bool ok = heap_init();
+    arenas[0].region = 0;
+    arenas[0].heap_start = heap_start;
+    arenas[0].seglist = seglist;
+    arenas[0].seg_bitmap = seg_bitmap;
+    arenas[0].ready = ok;
+    __atomic_add_fetch(&heap_gen, 1, __ATOMIC_RELEASE);
+    return ok;
+#else
+    return heap_init();
+#endif
+}
+
+/**
+ * @brief allocate a request too large for slabs and quick bins, given
+ *        what find_fit found for it
+ * @param[in] fit the block find_fit returned for the adjusted size, or NULL
+ * @param[in] size
+ * @param[out] zero as for heap_alloc
+ * @return pointer to the payload of a block
+ * @pre the heap must be initialized
+ */
+static void *heap_alloc_fit(block_t *fit, size_t size, char **zero) {
+    block_t *block = alloc_fit(fit, adjust_size(size), zero);
+    if (block == NULL) {
+        return NULL;
+    }
+    slab_count(block, true);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return header_to_payload(block);
+}
+
+/**
+ * @brief allocate space of a given size
+ *
+ * Initialize the heap for the first request. Search for the free list for
+ * a block of good fit. If a free block is found, split the free block and
+ * add the extra space into seglist. If no fit is found, request for more
+ * space. It updates the alloc/last alloc/mini bits, and returns a pointer
+ * to the payload of the block allocated.
+ *
+ * @param[in] size
+ * @param[out] zero if not NULL, set to the address from which the payload
+ *                  is known to hold zeros, which is past the size requested
+ *                  if none of it is
+ * @return pointer to the payload of a block
+ * @pre the heap and seglists must be valid
+ */
+static void *heap_alloc(size_t size, char **zero) {
+    dbg_requires(mm_checkheap(__LINE__));
+    dbg_printf("CALLING MALLOC\n");
+    block_t *block;
+    void *bp = NULL;
+
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+        dbg_printf("MALLOC CALLING MM_INIT()\n");
+        heap_init();
+    }
+
+    // Ignore spurious request
+    if (size == 0) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Small requests come from a slab of their size class when there is one
+    if (use_slabs && size <= slab_max && (bp = slab_malloc(size)) != NULL) {
+        if (zero != NULL) {
+            *zero = (char *)bp + size;
+        }
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Adjust block size to include overhead and to meet alignment
+    // requirements
+    size_t asize = adjust_size(size);
+
+    // Large requests no free block can hold get a mapping of their own
+    // rather than growing the heap; the thread-safe build maps them in
+    // arena_malloc, once the lock of the arena is dropped. The fit found
+    // is the one taken, so the free list is searched once.
+    if (size >= map_threshold) {
+        block = find_fit(asize);
+        if (!MM_THREADS && block == NULL &&
+            (bp = map_malloc(size, zero)) != NULL) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return bp;
+        }
+        return heap_alloc_fit(block, size, zero);
+    }
+
+    // Take a block of that size off the free list
+    block = alloc_block(asize, zero);
+    if (block == NULL) {
+        return bp;
+    }
+    slab_count(block, true);
+
+    bp = header_to_payload(block);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
+}
+
+/**
+ * @brief allocate space of a given size
+ * @param[in] size
+ * @return pointer to the payload of a block
+ */
+static void *heap_malloc(size_t size) {
+    return heap_alloc(size, NULL);
+}
+
+/**
+ * @brief allocate space whose payload is aligned to a power of two
+ *
+ * A block with room for any shift is taken, and the free space in front of
+ * the aligned payload is cut off as a block of its own, so it needs at
+ * least min_block_size bytes; the end of the block goes back too.
+ *
+ * @param[in] align a power of two larger than dsize
+ * @param[in] size
+ * @return pointer to the aligned payload of a block, or NULL if the heap is
+ *         out of memory
+ */
+static void *heap_memalign(size_t align, size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+    if (heap_start == NULL && !heap_init()) {
+        return NULL;
+    }
+    if (size == 0) {
+        return NULL;
+    }
+
+    size_t asize = adjust_size(size);
+    block_t *block = alloc_block(asize + align, NULL);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    // payloads are dsize-aligned, so the lead is 0 or a multiple of dsize
+    // below align; min_block_size is dsize, so a nonzero lead is never too
+    // small to free, and a lead of exactly min_block_size is a mini block,
+    // which the aligned block records in its last-mini bit
+    char *bp = header_to_payload(block);
+    size_t lead = (size_t)(-(uintptr_t)bp & (align - 1));
+    if (lead > 0) {
+        size_t block_size = get_size(block);
+        bool last = get_last_alloc(block);
+        bool mini = get_last_mini(block);
+        block_t *aligned = (block_t *)((char *)block + lead);
+        write_block(aligned, block_size - lead, true, false,
+                    lead == min_block_size);
+        write_block(block, lead, false, last, mini);
+        insert(coalesce_block(block));
+        block = aligned;
+    }
+
+    block_t *excess = split_block(block, asize);
+    if (excess != NULL) {
+        excess = coalesce_block(excess);
+        insert_or_trim(excess);
+    }
+    slab_count(block, true);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return header_to_payload(block);
+}
+
+/**
+ * @brief find how many bytes of payload a block has
+ * @param[in] bp payload of an allocated block
+ * @return the size of the payload, at least what was requested
+ */
+static size_t heap_usable_size(void *bp) {
+    slab_t *slab;
+    if (use_slabs && (slab = slab_find(bp)) != NULL) {
+        return slab->size;
+    }
+    return get_payload_size(payload_to_header(bp));
+}
+
+/**
+ * @brief free a block containing payload where the pointer points to
+ *
+ * This function update the header/footer of the block being freed and
+ * the block next to it on heap. It then coalesce the block with adjacent
+ * free block and update the seglist.
+ *
+ * @param[in] bp
+ */
+static void heap_free(void *bp) {
+    dbg_requires(mm_checkheap(__LINE__));
+    dbg_printf("CALLING FREE\n");
+    if (bp == NULL) {
+        return;
+    }
+
+    // Slab objects have no header, so they are told apart first
+    slab_t *slab = slab_find(bp);
+    block_t *block = payload_to_header(bp);
+    if (slab != NULL) {
+        slab_free(slab, bp);
+    } else if (is_mapped(block)) {
+        map_free(block);
+    } else if (!is_region(block)) {
+        // Region objects are only given back with their region
+        slab_count(block, false);
+        free_block(block);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief free a block whose size the caller knows
+ *
+ * Only requests of up to slab_max bytes come from slabs, and only those of
+ * map_threshold bytes or more get mappings, so for a size in between the
+ * block is freed without looking it up in the slab page map or reading its
+ * header for the mapping bits.
+ *
+ * @param[in] bp
+ * @param[in] size the size last asked for the block by malloc, calloc,
+ *                 realloc or mm_memalign
+ */
+static void heap_free_sized(void *bp, size_t size) {
+    if (bp == NULL || (use_slabs && size <= slab_max) ||
+        size >= map_threshold) {
+        heap_free(bp);
+        return;
+    }
+
+    dbg_requires(mm_checkheap(__LINE__));
+    block_t *block = payload_to_header(bp);
+    dbg_requires(slab_find(bp) == NULL && !is_mapped(block));
+    dbg_requires(size <= get_payload_size(block));
+    if (!is_region(block)) {
+        slab_count(block, false);
+        free_block(block);
+    }
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief allocate many blocks of one size, carving each group of them out
+ *        of a single free block
+ *
+ * A group is as many blocks as fit in batch_bytes; one free block is found
+ * and split for the whole group, and then cut into its blocks. Requests
+ * served from slabs or mappings, and larger than batch_bytes, are
+ * allocated one at a time, as is a group no free block can hold.
+ *
+ * @param[in] size
+ * @param[in] n number of blocks
+ * @param[out] ptrs where the payloads are stored
+ * @return number of payloads stored, less than n if the heap ran out
+ */
+static size_t heap_malloc_batch(size_t size, size_t n, void **ptrs) {
+    dbg_requires(mm_checkheap(__LINE__));
+    if (heap_start == NULL && !heap_init()) {
+        return 0;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    // Slab objects are taken straight off the free list of their slab
+    size_t done = 0;
+    if (use_slabs && size <= slab_max) {
+        while (done < n && (ptrs[done] = slab_malloc(size)) != NULL) {
+            done++;
+        }
+    }
+
+    size_t asize = adjust_size(size);
+    size_t group = batch_bytes / asize;
+    if (group == 0 || (use_slabs && size <= slab_max) ||
+        size >= map_threshold) {
+        group = 1;
+    }
+    while (done < n) {
+        // A group only takes a block that is free already; otherwise its
+        // blocks fill smaller holes one at a time, as mm_malloc would
+        size_t k = n - done < group ? n - done : group;
+        block_t *block = (k > 1) ? find_fit(asize * k) : NULL;
+        if (block == NULL) {
+            for (; k > 0; k--, done++) {
+                if ((ptrs[done] = heap_malloc(size)) == NULL) {
+                    return done;
+                }
+            }
+            continue;
+        }
+        heap_grow()->reqs += k;
+        block = place_block(block, asize * k, NULL);
+
+        // Blocks are cut from the end, so that each one written updates the
+        // header of a block rather than payload; the last one takes whatever
+        // split_block left over
+        size_t block_size = get_size(block);
+        bool last = get_last_alloc(block);
+        bool mini = get_last_mini(block);
+        bool cut_mini = (asize == min_block_size);
+        for (size_t i = k; i-- > 0;) {
+            block_t *piece = (block_t *)((char *)block + i * asize);
+            size_t piece_size = (i + 1 < k) ? asize : block_size - i * asize;
+            write_block(piece, piece_size, true, i == 0 ? last : true,
+                        i == 0 ? mini : cut_mini);
+            slab_count(piece, true);
+            ptrs[done + i] = header_to_payload(piece);
+        }
+        done += k;
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return done;
+}
+
+/**
+ * @brief sort pointers by address in place
+ *
+ * Pointers freed together often come in order already, which is checked
+ * first; otherwise a shell sort is used, which needs no memory.
+ *
+ * @param[in,out] ptrs
+ * @param[in] n number of pointers
+ */
+static void sort_ptrs(void **ptrs, size_t n) {
+    size_t sorted = 1;
+    while (sorted < n &&
+           (uintptr_t)ptrs[sorted - 1] < (uintptr_t)ptrs[sorted]) {
+        sorted++;
+    }
+    if (sorted >= n) {
+        return;
+    }
+
+    // Ciura's gaps, which do well on the few hundred pointers of a batch
+    static const size_t gaps[] = {701, 301, 132, 57, 23, 10, 4, 1};
+    for (size_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+        size_t gap = gaps[g];
+        for (size_t i = gap; i < n; i++) {
+            void *p = ptrs[i];
+            size_t j = i;
+            for (; j >= gap && (uintptr_t)ptrs[j - gap] > (uintptr_t)p;
+                 j -= gap) {
+                ptrs[j] = ptrs[j - gap];
+            }
+            ptrs[j] = p;
+        }
+    }
+}
+
+/**
+ * @brief free many blocks at once
+ *
+ * Slab objects and mapped blocks are freed one at a time, and region
+ * objects are left to their region. The other pointers are sorted by
+ * address, so blocks that follow each other on the heap come together;
+ * each run of them is written as one block and freed, which coalesces it
+ * with its neighbours once instead of once per block.
+ *
+ * @param[in,out] ptrs payloads of allocated blocks, or NULL; their order
+ *                     is changed
+ * @param[in] n number of pointers
+ */
+static void heap_free_batch(void **ptrs, size_t n) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    // Objects of slabs and mapped blocks have no neighbours to coalesce
+    // with, so they are freed first, region objects are skipped, and only
+    // the rest is sorted
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        void *bp = ptrs[i];
+        if (bp == NULL) {
+            continue;
+        }
+        slab_t *slab = slab_find(bp);
+        if (slab != NULL) {
+            slab_free(slab, bp);
+        } else if (is_mapped(payload_to_header(bp))) {
+            map_free(payload_to_header(bp));
+        } else if (!is_region(payload_to_header(bp))) {
+            slab_count(payload_to_header(bp), false);
+            ptrs[m++] = bp;
+        }
+    }
+    sort_ptrs(ptrs, m);
+
+    size_t i = 0;
+    while (i < m) {
+        block_t *block = payload_to_header(ptrs[i++]);
+
+        // Take in the blocks right after this one that are freed too
+        size_t size = get_size(block);
+        block_t *next = find_next(block);
+        while (i < m && get_size(next) != 0 &&
+               ptrs[i] == header_to_payload(next)) {
+            size += get_size(next);
+            next = find_next(next);
+            i++;
+        }
+        if (size != get_size(block)) {
+            write_block(block, size, true, get_last_alloc(block),
+                        get_last_mini(block));
+        }
+        free_block(block);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief resize a block in place without moving its payload
+ *
+ * Shrinking splits the leftover off the end of the block and returns it to
+ * the seglist. Growing absorbs the next block on the heap if it is free and
+ * large enough; if the block (or its free right neighbour) is the last one
+ * before the epilogue, the heap is extended by only the missing amount.
+ *
+ * @param[in] block An allocated block
+ * @param[in] asize The adjusted block size requested
+ * @return true if the block now holds at least asize bytes, false if the
+ *         caller has to fall back to malloc + memcpy + free
+ */
+static bool resize_in_place(block_t *block, size_t asize) {
+    size_t block_size = get_size(block);
+    bool last = get_last_alloc(block);
+    bool mini = get_last_mini(block);
+
+    // shrink: give the tail back, merging it with a free right neighbour
+    if (asize <= block_size) {
+        block_t *excess = split_block(block, asize);
+        if (excess != NULL) {
+            excess = coalesce_block(excess);
+            insert_or_trim(excess);
+        }
+        return true;
     }
 
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
+    block_t *next = find_next(block);
+    size_t avail = block_size;
+    bool next_free = !get_alloc(next);
+    if (next_free) {
+        avail += get_size(next);
+    }
+
+    // tail block: ask for just the difference, which coalesces into next
+    bool next_tail = next_free && get_size(find_next(next)) == 0;
+    bool at_tail = get_size(next) == 0 || next_tail;
+    if (avail < asize && at_tail) {
+        if (extend_heap(asize - avail) == NULL) {
+            return false;
+        }
+        next = find_next(block);
+        next_free = true;
+        next_tail = true;
+        avail = block_size + get_size(next);
+    }
+
+    if (!next_free || avail < asize) {
         return false;
     }
+
+    // absorb the free neighbour and split off whatever is not needed
+    delete (next);
+    write_block(block, avail, true, last, mini);
+    block_t *excess = split_block(block, asize);
+    if (excess != NULL) {
+        insert(excess);
+    }
+    if (next_tail) {
+        cut_tail(excess);
+    }
     return true;
 }
 
 /**
- * @brief allocate space of a given size
+ * @brief resize allocated memory
  *
- * Initialize the heap for the first request. Search for the free list for
- * a block of good fit. If a free block is found, split the free block and
- * add the extra space into seglist. If no fit is found, request for more
- * space. It updates the alloc/last alloc/mini bits, and returns a pointer
- * to the payload of the block allocated.
+ * This function is used to resize the memory block
+ * which is allocated bny malloc or calloc before,
+ * and returns a pointer to the new, resized memory.
+ * The block is resized in place whenever its neighbours allow it; only
+ * otherwise is the payload copied to a newly allocated block.
  *
+ * @param[in] ptr
  * @param[in] size
- * @return pointer to the payload of a block
- * @pre the heap and seglists must be valid
+ * @return a pointer to the resized memory
  */
-void *malloc(size_t size) {
+static void *heap_realloc(void *ptr, size_t size) {
+    block_t *block = payload_to_header(ptr);
+    size_t copysize;
+    void *newptr;
+
+    // If size == 0, then free block and return NULL
+    if (size == 0) {
+        heap_free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL) {
+        return heap_malloc(size);
+    }
+
     dbg_requires(mm_checkheap(__LINE__));
-    dbg_printf("CALLING MALLOC\n");
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
 
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        dbg_printf("MALLOC CALLING MM_INIT()\n");
-        mm_init();
+    // A slab object stays put while it still fits, otherwise it moves
+    slab_t *slab = slab_find(ptr);
+    if (slab != NULL) {
+        copysize = slab->size;
+        if (size <= copysize) {
+            return ptr;
+        }
+    } else if (is_mapped(block)) {
+        // A mapped block is resized by remapping it
+        newptr = map_realloc(block, size);
+        if (newptr != NULL) {
+            return newptr;
+        }
+        copysize = get_payload_size(block);
+    } else if (is_region(block)) {
+        // A region object stays put while it still fits, and otherwise
+        // moves to a new one, leaving the old one to the region
+        copysize = get_payload_size(block);
+        if (size <= copysize) {
+            return ptr;
+        }
+        if (bump_region.open && size <= region_max &&
+            (newptr = region_malloc(size)) != NULL) {
+            memcpy(newptr, ptr, copysize);
+            stat_add(&stats.realloc_copies, 1);
+            stat_add(&stats.realloc_copy_bytes, copysize);
+            return newptr;
+        }
+    } else {
+        dbg_assert(get_alloc(block));
+
+        // Try to grow or shrink without moving the payload, counting the
+        // block again at whatever size it ends up
+        slab_count(block, false);
+        bool resized = resize_in_place(block, adjust_size(size));
+        slab_count(block, true);
+        if (resized) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return ptr;
+        }
+        copysize = get_payload_size(block); // gets size of old payload
     }
 
-    // Ignore spurious request
-    if (size == 0) {
+    // Otherwise, proceed with reallocation
+    newptr = heap_malloc(size);
+
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL) {
+        return NULL;
+    }
+
+    // Copy the old data
+    if (size < copysize) {
+        copysize = size;
+    }
+    memcpy(newptr, ptr, copysize);
+    stat_add(&stats.realloc_copies, 1);
+    stat_add(&stats.realloc_copy_bytes, copysize);
+
+    // Free the old block
+    heap_free(ptr);
+
+    return newptr;
+}
+
+/**
+ * @brief resize a block whose size the caller knows
+ *
+ * As in heap_free_sized, an old size between slab_max and map_threshold
+ * shows that the block is an ordinary heap block, so it is resized without
+ * the slab and mapping checks. If it has to move, only the old size is
+ * copied, rather than the whole payload of the block.
+ *
+ * @param[in] ptr
+ * @param[in] old_size the size last asked for the block
+ * @param[in] size
+ * @return a pointer to the resized memory
+ */
+static void *heap_realloc_sized(void *ptr, size_t old_size, size_t size) {
+    if (ptr == NULL || size == 0 || (use_slabs && old_size <= slab_max) ||
+        old_size >= map_threshold) {
+        return heap_realloc(ptr, size);
+    }
+
+    dbg_requires(mm_checkheap(__LINE__));
+    block_t *block = payload_to_header(ptr);
+    dbg_requires(slab_find(ptr) == NULL && !is_mapped(block));
+    dbg_requires(old_size <= get_payload_size(block));
+    if (is_region(block)) {
+        return heap_realloc(ptr, size);
+    }
+
+    slab_count(block, false);
+    bool resized = resize_in_place(block, adjust_size(size));
+    slab_count(block, true);
+    if (resized) {
         dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+        return ptr;
+    }
+
+    void *newptr = heap_malloc(size);
+    if (newptr == NULL) {
+        return NULL;
+    }
+    size_t copysize = (size < old_size) ? size : old_size;
+    memcpy(newptr, ptr, copysize);
+    stat_add(&stats.realloc_copies, 1);
+    stat_add(&stats.realloc_copy_bytes, copysize);
+    heap_free_sized(ptr, old_size);
+    return newptr;
+}
+
+/**
+ * @brief give the free space at the end of the heap back to memlib
+ * @param[in] pad number of free bytes to keep at the end of the heap
+ * @return true if the heap was shrunk
+ */
+static bool heap_trim(size_t pad) {
+    if (heap_start == NULL) {
+        return false;
+    }
+    dbg_requires(mm_checkheap(__LINE__));
+
+    // Deferred frees at the end of the heap have to be coalesced first
+    if (use_quick) {
+        quick_flush();
+    }
+
+    block_t *epilogue = payload_to_header(heap_sbrk(0));
+    if (get_last_alloc(epilogue)) {
+        return false;
+    }
+
+    block_t *block = find_prev(epilogue);
+    size_t size = get_size(block);
+    delete (block);
+    block_t *rest = trim_block(block, pad);
+    if (rest != NULL) {
+        insert(rest);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return rest == NULL || get_size(rest) < size;
+}
+
+#if MM_THREADS
+/*
+ * Arenas: each thread is handed an arena on its first request and does all
+ * of its heap work there, holding only that arena's lock. While a thread
+ * holds an arena, heap_start, seglist, seg_bitmap and heap_region (which
+ * are thread-local in this build) describe that arena's heap, so the
+ * single-heap code above runs unchanged on it.
+ */
+
+/**
+ * @brief lock an arena and make its heap the one being worked on
+ *
+ * Blocks other threads have freed into the arena meanwhile are returned to
+ * its heap first.
+ *
+ * @param[in] a an arena
+ */
+static void arena_lock(arena_t *a) {
+    pthread_mutex_lock(&a->lock);
+    heap_region = a->region;
+    heap_start = a->heap_start;
+    seglist = a->seglist;
+    seg_bitmap = a->seg_bitmap;
+    check_log = &a->check_log;
+
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) != NULL) {
+        block_t *block =
+            __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+        while (block != NULL) {
+            block_t *next = block->next;
+            heap_free(header_to_payload(block));
+            block = next;
+        }
+    }
+}
+
+/**
+ * @brief unlock an arena, saving its heap if it was initialized lazily
+ *
+ * Only the main heap is initialized lazily, when mm_init was never called
+ * (as in mm-preload.so); it is then marked ready, so that mm_trim sees it.
+ *
+ * @param[in] a an arena locked by the calling thread
+ */
+static void arena_unlock(arena_t *a) {
+    a->heap_start = heap_start;
+    a->seglist = seglist;
+    a->seg_bitmap = seg_bitmap;
+    if (heap_start != NULL && !a->ready) {
+        __atomic_store_n(&a->ready, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * @brief find the arena a block belongs to
+ *
+ * Every block outside the regions of the other arenas is on the main heap.
+ *
+ * @param[in] block
+ * @return the arena whose heap holds the block
+ */
+static arena_t *arena_of(block_t *block) {
+    for (int i = 1; i < MM_ARENAS; i++) {
+        arena_t *a = &arenas[i];
+        if (__atomic_load_n(&a->ready, __ATOMIC_ACQUIRE) &&
+            (char *)block >= a->lo && (char *)block < a->hi) {
+            return a;
+        }
     }
+    return &arenas[0];
+}
+
+/**
+ * @brief hand a block back to an arena the calling thread does not hold
+ *
+ * The block is pushed onto the arena's remote-free stack without taking
+ * any lock; the arena frees it on its next arena_lock.
+ *
+ * @param[in] a the arena owning the block
+ * @param[in] block an allocated block
+ */
+static void arena_remote_free(arena_t *a, block_t *block) {
+    block_t *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do {
+        block->next = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, block, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief map a region for an arena and lay out an empty heap in it
+ * @param[in] a an arena that is not ready
+ * @pre arena 0 must be locked, since the region is carved out of the space
+ *      the main heap grows into
+ */
+static void arena_create(arena_t *a) {
+    int region = mem_map_region(arena_reserve);
+    if (region < 0) {
+        return;
+    }
+
+    heap_region = region;
+    check_log = &a->check_log;
+    char *lo = heap_sbrk(0);
+    if (!heap_init()) {
+        return;
+    }
+    a->region = region;
+    a->heap_start = heap_start;
+    a->seglist = seglist;
+    a->seg_bitmap = seg_bitmap;
+    a->lo = lo;
+    a->hi = lo + arena_reserve;
+    __atomic_store_n(&a->ready, true, __ATOMIC_RELEASE);
+}
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    if (size <= 8) {
-        asize = 16;
+/**
+ * @brief pick the arena for a thread, round-robin
+ * @return the arena, or arena 0 if there is no room for another one
+ */
+static arena_t *arena_pick(void) {
+    unsigned i = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+    arena_t *a = &arenas[i % MM_ARENAS];
+    if (a == &arenas[0] || __atomic_load_n(&a->ready, __ATOMIC_ACQUIRE)) {
+        return a;
+    }
+
+    pthread_mutex_lock(&arenas[0].lock);
+    if (!a->ready) {
+        arena_create(a);
+    }
+    pthread_mutex_unlock(&arenas[0].lock);
+    return a->ready ? a : &arenas[0];
+}
+
+/**
+ * @brief allocate from an arena, falling back to the main heap when the
+ *        region of the arena is full
+ *
+ * As in heap_alloc, a large request no free block of the arena can hold
+ * gets a mapping of its own; it is mapped once the arena lock is dropped,
+ * since mappings are made under the lock of arena 0.
+ *
+ * @param[in] a an arena
+ * @param[in] size
+ * @return pointer to the payload of a block
+ */
+static void *arena_malloc(arena_t *a, size_t size) {
+    void *bp = NULL;
+    block_t *fit;
+    bool map = false;
+    arena_lock(a);
+    if (size < map_threshold) {
+        bp = heap_malloc(size);
+    } else if ((heap_start != NULL || heap_init()) &&
+               (fit = find_fit(adjust_size(size))) != NULL) {
+        // the fit is taken while the lock is still held
+        bp = heap_alloc_fit(fit, size, NULL);
     } else {
-        asize = round_up(size + wsize, dsize);
+        map = true;
+    }
+    arena_unlock(a);
+    if (map && (bp = map_malloc(size, NULL)) == NULL) {
+        arena_lock(a);
+        bp = heap_malloc(size);
+        arena_unlock(a);
+    }
+    if (bp == NULL && size != 0 && a != &arenas[0]) {
+        return arena_malloc(&arenas[0], size);
     }
+    return bp;
+}
 
-    // Search the free list for a fit
-    block = find_fit(asize);
+/**
+ * @brief free a block on behalf of a thread working in arena a
+ * @param[in] a the calling thread's arena
+ * @param[in] block an allocated block
+ */
+static void arena_free(arena_t *a, block_t *block) {
+    arena_t *owner = arena_of(block);
+    if (owner != a) {
+        arena_remote_free(owner, block);
+        return;
+    }
+    arena_lock(a);
+    heap_free(header_to_payload(block));
+    arena_unlock(a);
+}
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
+/*
+ * Thread cache: every thread keeps up to tcache_max blocks of each small
+ * block size, linked through their first payload word. Cached blocks stay
+ * marked as allocated on the heap, so the arenas never see them and
+ * mm_checkheap stays valid. Blocks move between a cache and the thread's
+ * arena in batches of tcache_fill under one acquisition of its lock.
+ */
 
-        // extend_heap returns an error
-        if (block == NULL) {
+/* Number of cache bins; bin i holds blocks of (i + 1) * dsize bytes */
+#define TCACHE_BINS 32
+
+/** @brief Number of blocks moved per refill or flush */
+static const unsigned tcache_fill = 8;
+
+/** @brief Maximum number of blocks cached per bin */
+static const unsigned tcache_max = 16;
+
+/** @brief Per-thread block cache */
+typedef struct {
+    block_t *head[TCACHE_BINS];
+    unsigned count[TCACHE_BINS];
+    /** @brief The arena the thread allocates from */
+    arena_t *arena;
+    /** @brief Value of heap_gen when the cache was filled */
+    word_t gen;
+} tcache_t;
+
+/** @brief The calling thread's cache */
+static _Thread_local tcache_t tcache;
+
+/**
+ * @brief take the lock of every arena before a fork, so that the child
+ *        does not inherit a heap another thread was in the middle of
+ *        changing
+ */
+static void arena_fork_prepare(void) {
+    for (int i = 0; i < MM_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+}
+
+/**
+ * @brief release the arena locks taken by arena_fork_prepare, in the
+ *        parent and in the child of a fork
+ */
+static void arena_fork_release(void) {
+    for (int i = MM_ARENAS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+/** @brief Key whose destructor flushes a cache on thread exit */
+static pthread_key_t tcache_key;
+
+/** @brief Creates tcache_key once */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief return the first n blocks of a cache bin to their arenas
+ * @param[in] tc a thread cache
+ * @param[in] bin index of the bin
+ * @param[in] n number of blocks to return
+ * @pre the lock of tc->arena must be held
+ */
+static void tcache_flush_bin(tcache_t *tc, size_t bin, unsigned n) {
+    while (n > 0 && tc->head[bin] != NULL) {
+        block_t *block = tc->head[bin];
+        tc->head[bin] = block->next;
+        tc->count[bin]--;
+        arena_t *owner = arena_of(block);
+        if (owner == tc->arena) {
+            heap_free(header_to_payload(block));
+        } else {
+            arena_remote_free(owner, block);
+        }
+        n--;
+    }
+}
+
+/**
+ * @brief return every cached block of an exiting thread to the heap
+ * @param[in] arg the thread's cache
+ */
+static void tcache_destroy(void *arg) {
+    tcache_t *tc = (tcache_t *)arg;
+    if (tc->gen != __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    arena_lock(tc->arena);
+    for (size_t bin = 0; bin < TCACHE_BINS; bin++) {
+        tcache_flush_bin(tc, bin, tc->count[bin]);
+    }
+    arena_unlock(tc->arena);
+}
+
+/** @brief create the key used to flush caches on thread exit */
+static void tcache_init_key(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+    pthread_atfork(arena_fork_prepare, arena_fork_release,
+                   arena_fork_release);
+}
+
+/**
+ * @brief get the calling thread's cache, emptying it, closing its region
+ *        and picking a new arena if the heap has been reinitialized
+ *        since it was filled
+ * @return the calling thread's cache
+ */
+static tcache_t *tcache_get(void) {
+    tcache_t *tc = &tcache;
+    word_t gen = __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE);
+    if (tc->gen != gen) {
+        if (tc->gen == 0) {
+            pthread_once(&tcache_once, tcache_init_key);
+            pthread_setspecific(tcache_key, tc);
+        }
+        for (size_t bin = 0; bin < TCACHE_BINS; bin++) {
+            tc->head[bin] = NULL;
+            tc->count[bin] = 0;
+        }
+        // a region left open on an older heap is gone with it
+        bump_region = (region_t){0};
+        tc->arena = arena_pick();
+        tc->gen = gen;
+    }
+    return tc;
+}
+
+/**
+ * @brief take tcache_fill blocks for a bin from the thread's arena
+ *
+ * @param[in] tc a thread cache
+ * @param[in] bin index of the bin
+ * @return one of the new blocks for the caller, the rest go to the bin,
+ *         or NULL if the heap is out of memory
+ */
+static block_t *tcache_refill(tcache_t *tc, size_t bin) {
+    size_t size = (bin + 1) * dsize - wsize;
+    void *bp;
+    arena_lock(tc->arena);
+    bp = heap_malloc(size);
+    for (unsigned k = 1; bp != NULL && k < tcache_fill; k++) {
+        void *extra = heap_malloc(size);
+        if (extra == NULL) {
+            break;
+        }
+        block_t *block = payload_to_header(extra);
+        block->next = tc->head[bin];
+        tc->head[bin] = block;
+        tc->count[bin]++;
+    }
+    arena_unlock(tc->arena);
+    if (bp == NULL && tc->arena != &arenas[0]) {
+        bp = arena_malloc(&arenas[0], size);
+    }
+    return (bp == NULL) ? NULL : payload_to_header(bp);
+}
+#endif /* MM_THREADS */
+
+/**
+ * @brief allocate space of a given size
+ *
+ * In the thread-safe build, small requests are served from the calling
+ * thread's cache, which is refilled from its arena in batches, and
+ * everything else goes to the arena under its lock, where large ones no
+ * free block fits get a mapping of their own. Inside a region, small
+ * requests are bumped out of its chunks, and only a new chunk takes the
+ * arena lock.
+ *
+ * @param[in] size
+ * @return pointer to the payload of a block
+ */
+void *malloc(size_t size) {
+#if MM_THREADS
+    tcache_t *tc = tcache_get();
+    if (bump_region.open && size != 0 && size <= region_max) {
+        void *bp = region_bump(size);
+        if (bp == NULL) {
+            arena_lock(tc->arena);
+            if (heap_start != NULL || heap_init()) {
+                bp = region_malloc(size);
+            }
+            arena_unlock(tc->arena);
+        }
+        if (bp != NULL) {
             return bp;
         }
     }
-
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
-
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-    bool last = get_last_alloc(block);
-    bool mini = get_last_mini(block);
-    write_block(block, block_size, true, last, mini);
-    // at this point, allocated block is still in free list
-
-    // Try to split the block if too large, upload the free list
-    delete (block);
-    block_t *excess = split_block(block, asize);
-    dbg_assert(get_alloc(block));
-
-    // add the extra free space to its correponding seglist bucket
-    if (excess != NULL) {
-        dbg_assert(!get_alloc(excess));
-        insert(excess);
+    size_t bin = adjust_size(size) / dsize - 1;
+    if (size != 0 && bin < TCACHE_BINS) {
+        block_t *block = tc->head[bin];
+        if (block != NULL) {
+            tc->head[bin] = block->next;
+            tc->count[bin]--;
+        } else {
+            block = tcache_refill(tc, bin);
+        }
+        return (block == NULL) ? NULL : header_to_payload(block);
     }
-
-    bp = header_to_payload(block);
-
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+    return arena_malloc(tc->arena, size);
+#else
+    void *bp;
+    if (bump_region.open && size != 0 && size <= region_max &&
+        (heap_start != NULL || heap_init()) &&
+        (bp = region_malloc(size)) != NULL) {
+        return bp;
+    }
+    return heap_malloc(size);
+#endif
 }
 
 /**
  * @brief free a block containing payload where the pointer points to
  *
- * This function update the header/footer of the block being freed and
- * the block next to it on heap. It then coalesce the block with adjacent
- * free block and update the seglist.
+ * In the thread-safe build, small blocks go to the calling thread's cache;
+ * a full bin first hands tcache_fill blocks back to their arenas. Mapped
+ * blocks are unmapped, region objects are left to their region, and other
+ * blocks go straight back to their arena.
  *
  * @param[in] bp
  */
 void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
-    dbg_printf("CALLING FREE\n");
+#if MM_THREADS
     if (bp == NULL) {
         return;
     }
-
     block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
-
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
-
-    // Mark the block as free
-    bool last = get_last_alloc(block);
-    bool mini = get_last_mini(block);
-    write_block(block, size, false, last, mini);
-
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
-    insert(block);
-
-    dbg_ensures(mm_checkheap(__LINE__));
+    if (is_mapped(block)) {
+        map_free(block);
+        return;
+    }
+    if (is_region(block)) {
+        return;
+    }
+    tcache_t *tc = tcache_get();
+    size_t bin = get_size(block) / dsize - 1;
+    if (bin < TCACHE_BINS) {
+        if (tc->count[bin] >= tcache_max) {
+            arena_lock(tc->arena);
+            tcache_flush_bin(tc, bin, tcache_fill);
+            arena_unlock(tc->arena);
+        }
+        block->next = tc->head[bin];
+        tc->head[bin] = block;
+        tc->count[bin]++;
+        return;
+    }
+    arena_free(tc->arena, block);
+#else
+    heap_free(bp);
+#endif
 }
 
 /**
  * @brief resize allocated memory
  *
- * This function is used to resize the memory block
- * which is allocated bny malloc or calloc before,
- * and returns a pointer to the new, resized memory.
+ * In the thread-safe build a mapped block is remapped, and a block of the
+ * calling thread's arena is resized under the arena's lock. A block of
+ * another arena, or one that cannot be resized there, is moved with
+ * malloc + memcpy + free. Only a region object moves to a new one in the
+ * region.
  *
  * @param[in] ptr
  * @param[in] size
  * @return a pointer to the resized memory
  */
 void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
-
-    // If size == 0, then free block and return NULL
+#if MM_THREADS
+    if (ptr == NULL) {
+        return malloc(size);
+    }
     if (size == 0) {
         free(ptr);
         return NULL;
     }
 
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL) {
-        return malloc(size);
+    tcache_t *tc = tcache_get();
+    block_t *block = payload_to_header(ptr);
+    void *newptr;
+    if (is_mapped(block)) {
+        newptr = map_realloc(block, size);
+        if (newptr != NULL) {
+            return newptr;
+        }
+    } else if (arena_of(block) == tc->arena) {
+        arena_lock(tc->arena);
+        newptr = heap_realloc(ptr, size);
+        arena_unlock(tc->arena);
+        if (newptr != NULL) {
+            return newptr;
+        }
     }
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
-
-    // If malloc fails, the original block is left untouched
+    // A block from outside the region is not moved into it
+    if (bump_region.open && size <= region_max) {
+        newptr = arena_malloc(tc->arena, size);
+    } else {
+        newptr = malloc(size);
+    }
     if (newptr == NULL) {
         return NULL;
     }
-
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
+    size_t copysize = get_payload_size(block);
     if (size < copysize) {
         copysize = size;
     }
     memcpy(newptr, ptr, copysize);
-
-    // Free the old block
+    stat_add(&stats.realloc_copies, 1);
+    stat_add(&stats.realloc_copy_bytes, copysize);
     free(ptr);
-
     return newptr;
+#else
+    return heap_realloc(ptr, size);
+#endif
 }
 
 /**
  * @brief allocate memory and set its content to 0
  *
  * This function allocate the requested memory, initialize its content to 0,
- * and returns a pointer to the block payload.
+ * and returns a pointer to the block payload. A block cut from the end of
+ * the heap, or with a mapping of its own, is only cleared up to where the
+ * memory memlib handed out as zeros starts.
  *
  * @param[in] elements
  * @param[in] size
@@ -1249,6 +4433,7 @@ void *calloc(size_t elements, size_t size) {
         return NULL;
     }
 
+#if MM_THREADS
     bp = malloc(asize);
     if (bp == NULL) {
         return NULL;
@@ -1256,8 +4441,376 @@ void *calloc(size_t elements, size_t size) {
 
     // Initialize all bits to 0
     memset(bp, 0, asize);
+#else
+    // A region object is bumped out of a chunk that may hold old data
+    if (bump_region.open && asize <= region_max) {
+        bp = malloc(asize);
+        if (bp != NULL) {
+            memset(bp, 0, asize);
+        }
+        return bp;
+    }
+
+    char *zero;
+    bp = heap_alloc(asize, &zero);
+    if (bp == NULL) {
+        return NULL;
+    }
+
+    // Initialize all bits to 0, but for those still untouched since memlib
+    // handed them out
+    size_t dirty = (size_t)(zero - (char *)bp);
+    memset(bp, 0, dirty < asize ? dirty : asize);
+#endif
+
+    return bp;
+}
 
+/**
+ * @brief allocate memory whose address is a multiple of an alignment
+ *
+ * Payloads are always dsize-aligned; for larger alignments a block is cut
+ * out of the heap around an aligned payload. In the thread-safe build that
+ * happens in the thread's arena under its lock.
+ *
+ * @param[in] align a power of two
+ * @param[in] size
+ * @return pointer to the payload of a block, or NULL if align is not a
+ *         power of two or the heap is out of memory
+ */
+void *mm_memalign(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= dsize) {
+        return malloc(size);
+    }
+    if (size > SIZE_MAX / 2 - align) {
+        return NULL;
+    }
+#if MM_THREADS
+    tcache_t *tc = tcache_get();
+    arena_lock(tc->arena);
+    void *bp = heap_memalign(align, size);
+    arena_unlock(tc->arena);
+    if (bp == NULL && size != 0 && tc->arena != &arenas[0]) {
+        arena_lock(&arenas[0]);
+        bp = heap_memalign(align, size);
+        arena_unlock(&arenas[0]);
+    }
     return bp;
+#else
+    return heap_memalign(align, size);
+#endif
+}
+
+/**
+ * @brief find how many bytes an allocated block can hold
+ *
+ * The caller may use all of them, not only the size it asked for.
+ *
+ * @param[in] bp pointer to the payload of an allocated block, or NULL
+ * @return the size of the payload, or 0 for NULL
+ */
+size_t mm_usable_size(void *bp) {
+    if (bp == NULL) {
+        return 0;
+    }
+    return heap_usable_size(bp);
+}
+
+/**
+ * @brief free a block whose size the caller knows
+ *
+ * In the thread-safe build, a size too large for the thread cache and too
+ * small for a mapping is freed in its arena without the checks of free;
+ * other sizes go through free.
+ *
+ * @param[in] bp
+ * @param[in] size the size last asked for the block
+ */
+void mm_free_sized(void *bp, size_t size) {
+#if MM_THREADS
+    if (bp == NULL || size >= map_threshold ||
+        adjust_size(size) / dsize - 1 < TCACHE_BINS) {
+        free(bp);
+        return;
+    }
+    block_t *block = payload_to_header(bp);
+    arena_t *owner = arena_of(block);
+    if (owner != tcache_get()->arena) {
+        arena_remote_free(owner, block);
+        return;
+    }
+    arena_lock(owner);
+    heap_free_sized(bp, size);
+    arena_unlock(owner);
+#else
+    heap_free_sized(bp, size);
+#endif
+}
+
+/**
+ * @brief resize a block whose size the caller knows
+ *
+ * In the thread-safe build, a block too large for the thread cache and too
+ * small for a mapping is resized in the calling thread's arena without the
+ * checks of realloc, if the arena holds it; otherwise it is moved, copying
+ * only the old size. Other sizes go through realloc.
+ *
+ * @param[in] bp
+ * @param[in] old_size the size last asked for the block
+ * @param[in] size
+ * @return a pointer to the resized memory
+ */
+void *mm_realloc_sized(void *bp, size_t old_size, size_t size) {
+#if MM_THREADS
+    if (bp == NULL || size == 0 || old_size >= map_threshold ||
+        adjust_size(old_size) / dsize - 1 < TCACHE_BINS) {
+        return realloc(bp, size);
+    }
+    tcache_t *tc = tcache_get();
+    void *newptr;
+    if (arena_of(payload_to_header(bp)) == tc->arena) {
+        arena_lock(tc->arena);
+        newptr = heap_realloc_sized(bp, old_size, size);
+        arena_unlock(tc->arena);
+        if (newptr != NULL) {
+            return newptr;
+        }
+    }
+
+    // A block from outside the region is not moved into it
+    if (bump_region.open && size <= region_max) {
+        newptr = arena_malloc(tc->arena, size);
+    } else {
+        newptr = malloc(size);
+    }
+    if (newptr == NULL) {
+        return NULL;
+    }
+    size_t copysize = (size < old_size) ? size : old_size;
+    memcpy(newptr, bp, copysize);
+    stat_add(&stats.realloc_copies, 1);
+    stat_add(&stats.realloc_copy_bytes, copysize);
+    mm_free_sized(bp, old_size);
+    return newptr;
+#else
+    return heap_realloc_sized(bp, old_size, size);
+#endif
+}
+
+/**
+ * @brief allocate many blocks of one size at once
+ *
+ * In the thread-safe build, sizes the thread cache serves and mapped sizes
+ * are allocated one at a time; other sizes are carved from the thread's
+ * arena under one acquisition of its lock.
+ *
+ * @param[in] size
+ * @param[in] n number of blocks
+ * @param[out] ptrs where the n payloads are stored
+ * @return number of payloads stored, less than n if memory ran out
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+#if MM_THREADS
+    size_t done = 0;
+    if (size != 0 && size < map_threshold &&
+        adjust_size(size) / dsize - 1 >= TCACHE_BINS) {
+        tcache_t *tc = tcache_get();
+        arena_lock(tc->arena);
+        done = heap_malloc_batch(size, n, ptrs);
+        arena_unlock(tc->arena);
+    }
+    for (; done < n; done++) {
+        if ((ptrs[done] = malloc(size)) == NULL) {
+            break;
+        }
+    }
+    return done;
+#else
+    return heap_malloc_batch(size, n, ptrs);
+#endif
+}
+
+/**
+ * @brief free many blocks at once
+ *
+ * In the thread-safe build, blocks the thread cache takes, mapped blocks
+ * and blocks of other arenas are freed one at a time; the rest are freed
+ * together in the thread's arena under one acquisition of its lock.
+ *
+ * @param[in,out] ptrs payloads of allocated blocks, or NULL; their order
+ *                     may be changed
+ * @param[in] n number of pointers
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+#if MM_THREADS
+    tcache_t *tc = tcache_get();
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        block_t *block;
+        if (ptrs[i] == NULL) {
+            continue;
+        }
+        block = payload_to_header(ptrs[i]);
+        if (is_mapped(block) || get_size(block) / dsize - 1 < TCACHE_BINS ||
+            arena_of(block) != tc->arena) {
+            free(ptrs[i]);
+        } else {
+            ptrs[m++] = ptrs[i];
+        }
+    }
+    if (m > 0) {
+        arena_lock(tc->arena);
+        heap_free_batch(ptrs, m);
+        arena_unlock(tc->arena);
+    }
+#else
+    heap_free_batch(ptrs, n);
+#endif
+}
+
+/**
+ * @brief give the free space at the end of the heap back to the system
+ *
+ * Free blocks at the end of the heap are given back to memlib on their own
+ * once they reach trim_threshold bytes; this trims whatever is there. In
+ * the thread-safe build every arena is trimmed.
+ *
+ * @param[in] pad number of free bytes to keep at the end of each heap
+ * @return true if any memory was released
+ */
+bool mm_trim(size_t pad) {
+#if MM_THREADS
+    bool trimmed = false;
+    for (int i = 0; i < MM_ARENAS; i++) {
+        arena_t *a = &arenas[i];
+        if (!__atomic_load_n(&a->ready, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        arena_lock(a);
+        trimmed |= heap_trim(pad);
+        arena_unlock(a);
+    }
+    return trimmed;
+#else
+    return heap_trim(pad);
+#endif
+}
+
+/**
+ * @brief open a region for the calling thread
+ *
+ * Until mm_region_release, requests of up to region_max bytes are bumped
+ * out of chunks of the heap, and freeing them does nothing.
+ *
+ * @return false if the thread already has a region open
+ */
+bool mm_region_begin(void) {
+#if MM_THREADS
+    tcache_get();
+#endif
+    if (bump_region.open) {
+        return false;
+    }
+    bump_region = (region_t){.open = true};
+    return true;
+}
+
+/**
+ * @brief release the region of the calling thread, freeing every object
+ *        allocated in it at once
+ *
+ * The chunks go back to the heap one free_block each. In the thread-safe
+ * build that happens under the lock of the thread's arena, which is where
+ * its chunks came from.
+ */
+void mm_region_release(void) {
+#if MM_THREADS
+    tcache_t *tc = tcache_get();
+    if (!bump_region.open) {
+        return;
+    }
+    arena_lock(tc->arena);
+    region_release();
+    arena_unlock(tc->arena);
+#else
+    if (!bump_region.open) {
+        return;
+    }
+    dbg_requires(mm_checkheap(__LINE__));
+    region_release();
+    dbg_ensures(mm_checkheap(__LINE__));
+#endif
+}
+
+/**
+ * @brief get the counters of the allocator and the occupancy of its buckets
+ *
+ * The counters cover everything since mm_init. The occupancy is found by
+ * walking the heap for free blocks, so that blocks of the tree are binned
+ * by size like the others; in the thread-safe build only the heap of the
+ * calling thread's arena is walked. Blocks waiting in quick bins, thread
+ * caches or slabs are allocated as far as the heap is concerned, and are
+ * not counted.
+ *
+ * @param[out] out where to store the stats
+ * @return true if the counters are kept, false if mm.c is built without
+ *         MM_STATS, in which case out is left alone
+ */
+bool mm_get_stats(mm_stats_t *out) {
+    if (!use_stats) {
+        return false;
+    }
+    *out = stats;
+    for (int i = 0; i < MM_STATS_BUCKETS; i++) {
+        out->bucket_blocks[i] = 0;
+        out->bucket_bytes[i] = 0;
+    }
+    if (heap_start == NULL) {
+        return true;
+    }
+    for (block_t *block = heap_start; get_size(block) > 0;
+         block = find_next(block)) {
+        if (get_alloc(block)) {
+            continue;
+        }
+        int i = find_class(get_size(block));
+        if (i > tree_class) {
+            i = tree_class;
+        }
+        if (i >= MM_STATS_BUCKETS) {
+            i = MM_STATS_BUCKETS - 1;
+        }
+        out->bucket_blocks[i]++;
+        out->bucket_bytes[i] += get_size(block);
+    }
+    return true;
+}
+
+/**
+ * @brief visit each block of the heap in address order
+ *
+ * This is the walk mm_checkheap makes, for profilers outside the allocator.
+ * Slabs and the blocks waiting in quick bins or thread caches are seen as
+ * allocated, and mapped blocks are not part of the heap. In the thread-safe
+ * build only the heap of the calling thread's arena is walked.
+ *
+ * @param[in] visit called with each block, its size and whether it is
+ *            allocated, and arg
+ * @param[in] arg passed on to visit
+ */
+void mm_heap_walk(void (*visit)(void *block, size_t size, bool alloc,
+                                void *arg),
+                  void *arg) {
+    if (heap_start == NULL) {
+        return;
+    }
+    for (block_t *block = heap_start; get_size(block) > 0;
+         block = find_next(block)) {
+        visit(block, get_size(block), get_alloc(block), arg);
+    }
 }
 
 /*
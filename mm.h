@@ -65,6 +65,154 @@ extern void *calloc(size_t nmemb, size_t size);
  */
 extern bool mm_init(void);
 
+/**
+ * @brief  Give the free memory at the end of the heap back to the system.
+ *
+ * @param[in] pad  The number of free bytes to keep at the end of the heap.
+ *
+ * @return  True if any memory was released, False otherwise.
+ */
+extern bool mm_trim(size_t pad);
+
+/**
+ * @brief  Allocate memory whose address is a multiple of `alignment`.
+ *
+ * The memory is freed and resized like any other.
+ *
+ * @param[in] alignment  A power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL if
+ *          `alignment` is not a power of two or no memory is left.
+ */
+extern void *mm_memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  Marks an allocated block of a known size as free.
+ *
+ * Faster than free for sizes that show which kind of block it is.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size last asked for the block by malloc, calloc,
+ *                  realloc or mm_memalign.
+ */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Resize an allocated block of a known size.
+ *
+ * Faster than realloc for sizes that show which kind of block it is, and
+ * a block that has to move only has `old_size` bytes copied.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] old_size  The size last asked for the block by malloc,
+ *                      calloc, realloc or mm_memalign.
+ * @param[in] size  The new size of the allocated block.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *mm_realloc_sized(void *ptr, size_t old_size, size_t size);
+
+/**
+ * @brief  Find the number of bytes an allocated block can hold.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ *
+ * @return  The size of the payload, at least the size requested, or 0 if
+ *          `ptr` is NULL.
+ */
+extern size_t mm_usable_size(void *ptr);
+
+/**
+ * @brief  Allocate `n` blocks of at least `size` bytes each.
+ *
+ * Neighbouring blocks are carved out of one free block where possible,
+ * which is cheaper than `n` calls to malloc.
+ *
+ * @param[in] size  The minimum size of bytes of each block.
+ * @param[in] n  The number of blocks.
+ * @param[out] ptrs  Where the pointers to the blocks are stored.
+ *
+ * @return  The number of blocks allocated, less than `n` if no memory is
+ *          left.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+
+/**
+ * @brief  Free `n` blocks at once.
+ *
+ * Blocks next to each other in the heap are coalesced in one step.
+ *
+ * @param[in,out] ptrs  Pointers to the beginning of allocated payloads, or
+ *                      NULL. Their order is changed.
+ * @param[in] n  The number of pointers.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief  Open a region for the calling thread.
+ *
+ * Until `mm_region_release`, small allocations are cut one after the other
+ * out of large chunks, and freeing them does nothing. Larger ones are
+ * ordinary blocks and still have to be freed.
+ *
+ * @return  True if the region was opened, False if one is open already.
+ */
+extern bool mm_region_begin(void);
+
+/**
+ * @brief  Release the region of the calling thread.
+ *
+ * Every object allocated in the region is freed at once, whether or not it
+ * was passed to free, and must not be used afterwards.
+ */
+extern void mm_region_release(void);
+
+/** @brief Number of seglist buckets whose occupancy mm_get_stats reports */
+#define MM_STATS_BUCKETS 64
+
+/**
+ * @brief  What the allocator has done since mm_init, and what its free
+ *         lists hold. The counters are only kept when mm.c is built with
+ *         MM_STATS, which debug builds are by default.
+ */
+typedef struct mm_stats {
+    size_t fits;               /**< find_fit searches */
+    size_t fit_probes;         /**< free blocks looked at by those searches */
+    size_t fit_misses;         /**< searches that found no block */
+    size_t splits;             /**< blocks split into two */
+    size_t coalesces[4];       /**< coalesce calls: no neighbour free, next
+                                    free, previous free, both free */
+    size_t extends;            /**< calls that grew the heap */
+    size_t extend_bytes;       /**< bytes they grew it by */
+    size_t realloc_copies;     /**< reallocs that moved the payload */
+    size_t realloc_copy_bytes; /**< bytes those copied */
+    /** Free blocks and bytes in each bucket; the last one counts the rest */
+    size_t bucket_blocks[MM_STATS_BUCKETS];
+    size_t bucket_bytes[MM_STATS_BUCKETS];
+} mm_stats_t;
+
+/**
+ * @brief  Get the counters of the allocator and the occupancy of its
+ *         seglist buckets.
+ *
+ * @param[out] stats  Where to store them.
+ *
+ * @return  True if mm.c keeps counters, False otherwise.
+ */
+extern bool mm_get_stats(mm_stats_t *stats);
+
+/**
+ * @brief  Visit each block of the heap in address order.
+ *
+ * @param[in] visit  Called with the address and size of each block and
+ *                   whether it is allocated, and with arg.
+ * @param[in] arg  Passed on to visit.
+ */
+extern void mm_heap_walk(void (*visit)(void *block, size_t size, bool alloc,
+                                       void *arg),
+                         void *arg);
+
 /* This is for debugging.  Returns false if error encountered */
 /**
  * @brief  Check the heap for inconsistencies.
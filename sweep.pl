@@ -0,0 +1,131 @@
+#!/usr/bin/perl
+use Getopt::Std;
+
+##############################################################################
+#
+# This program sweeps workloads generated by tracegen through the drivers,
+# to find where mm.c stops scaling.  Each sweep varies one parameter around
+# a baseline workload, and each point of it is a trace replayed by mdriver
+# (mdriver-emulate for live sets beyond the dense heap, mdriver-threads for
+# thread counts).  The results go to a tab-separated file with one row per
+# point, so that the util or kops column of a sweep gives its curve.
+#
+##############################################################################
+
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-q] [-k] [-d DIR] [-o FILE] [-s SWEEPS]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h              Print this message\n";
+    printf STDERR "  -q              Quick sweep, with shorter traces\n";
+    printf STDERR "  -k              Keep the generated traces\n";
+    printf STDERR "  -d DIR          Write the traces to DIR (default sweep)\n";
+    printf STDERR "  -o FILE         Write the results to FILE (default sweep.tsv)\n";
+    printf STDERR "  -s SWEEPS       Only run the sweeps in this comma-separated list\n";
+    die "\n";
+}
+
+$| = 1;       # Autoflush output on every print statement
+
+getopts('hqkd:o:s:');
+
+if ($opt_h) {
+    &usage();
+}
+
+$tracegen = "./tracegen";
+$dir = $opt_d ? $opt_d : "sweep";
+$outfile = $opt_o ? $opt_o : "sweep.tsv";
+$allocs = $opt_q ? 20000 : 100000;
+
+# The baseline workload, as tracegen options
+%base = (
+    d => "lognormal",
+    s => "1:4K",
+    m => "64",
+    g => "1.0",
+    n => $allocs,
+    L => "1000",
+    r => "0",
+);
+
+# Each sweep: the parameter it varies, its values, the tracegen options
+# of each value on top of the baseline, and the driver and its flags
+@sweeps = (
+    ["dist", "dist", [qw(uniform zipf lognormal)],
+     sub { (d => $_[0]) }, "mdriver", ""],
+    ["sigma", "sigma", [qw(0.25 0.5 1 1.5 2 2.5)],
+     sub { (s => "1:64K", g => $_[0]) }, "mdriver", ""],
+    ["maxsize", "bytes", [qw(256 4K 64K 1M)],
+     sub { (d => "uniform", s => "1:$_[0]", n => int($allocs / 4),
+            l => "32M") },
+     "mdriver", ""],
+    ["lifetime", "allocs", [qw(10 100 1000 10000 100000)],
+     sub { (L => $_[0]) }, "mdriver", ""],
+    ["realloc", "frac", [qw(0 0.05 0.1 0.2 0.4)],
+     sub { (r => $_[0]) }, "mdriver", ""],
+    ["live", "bytes", [qw(1M 4M 16M 48M)],
+     sub { (s => "1:64K", m => "1K", L => "1e12", l => $_[0]) },
+     "mdriver", ""],
+    ["sparse-live", "bytes", [qw(1G 4G 16G 64G)],
+     sub { (s => "4K:256M", m => "1M", g => "1.5", n => 20000, L => "1e12",
+            l => $_[0]) }, "mdriver-emulate", ""],
+    ["threads", "threads", [qw(1 2 4 8)],
+     sub { () }, "mdriver-threads", "-N"],
+);
+
+%only = ();
+if ($opt_s) {
+    %only = map { $_ => 1 } split(/,/, $opt_s);
+}
+
+if (!-x $tracegen) {
+    die "Cannot find $tracegen, run \"make tracegen\"\n";
+}
+mkdir($dir) unless -d $dir;
+open(OUT, ">$outfile") || die "Cannot write $outfile\n";
+print OUT "sweep\tparam\tvalue\tdriver\tvalid\tutil\tkops\n";
+
+for $sweep (@sweeps) {
+    ($name, $param, $values, $opts, $driver, $flag) = @$sweep;
+    next if %only && !$only{$name};
+    if (!-x "./$driver") {
+        print "Skipping sweep $name: cannot find $driver\n";
+        next;
+    }
+    print "Sweep $name:\n";
+    for $value (@$values) {
+        %args = (%base, &$opts($value));
+        $args = join(" ", map { "-$_ $args{$_}" } sort keys %args);
+        $trace = "$dir/$name-$value.rep";
+        $trace = "$dir/$name.rep" if $flag;     # one trace for all values
+        # A shared trace is made afresh for the first value of each run,
+        # so that one kept by -k from another run is never replayed
+        if (!$flag || $value eq $values->[0]) {
+            system("$tracegen $args -o $trace") == 0 ||
+                die "Failed: $tracegen $args -o $trace\n";
+        }
+        $dflags = $flag ? "$flag $value" : "";
+        $dstring = `./$driver -T -v 1 $dflags -f $trace 2>&1`;
+
+        # The row of the trace in the tab-mode results
+        ($valid, $util, $kops) = ("0", "-", "-");
+        for $line (split "\n", $dstring) {
+            @fields = split "\t", $line;
+            next unless @fields > 1 && $fields[-1] =~ /\Q$trace\E$/;
+            if ($fields[0] eq "1") {
+                ($valid, $util, $kops) = ("1", $fields[3], $fields[6]);
+            }
+            last;
+        }
+        printf "  %-8s %10s  util %6s%%  Kops/s %7s%s\n", $param, $value,
+            $util, $kops, $valid ? "" : "  (failed)";
+        print OUT "$name\t$param\t$value\t$driver\t$valid\t$util\t$kops\n";
+        unlink($trace) unless $opt_k || $flag;
+    }
+    unlink("$dir/$name.rep") if $flag && !$opt_k;
+}
+close(OUT);
+rmdir($dir) unless $opt_k;
+print "Results in $outfile\n";
@@ -0,0 +1,541 @@
+/*
+ * tracegen.c - Generate synthetic malloc lab traces
+ *
+ * Writes a trace (see traces/README) of a workload drawn from simple
+ * distributions, so that mdriver can be run over a sweep of workloads
+ * instead of the fixed traces only:
+ *
+ *   - Block sizes are uniform, Zipf or lognormal between a minimum and a
+ *     maximum size.
+ *   - Each block lives for an exponentially distributed number of
+ *     allocations, with a given mean.
+ *   - The live payload is capped: an allocation that would exceed the cap
+ *     first frees the blocks that were to die soonest.
+ *   - A given fraction of the requests reallocate a random live block to
+ *     grow it (3 in 4) or shrink it.
+ *
+ * Blocks still live at the end are freed, soonest to die first.  The same
+ * seed always gives the same trace.  The generator runs twice, first to
+ * count the ids, requests and peak payload that the header needs, then to
+ * write the requests, so that traces of any size can be written without
+ * keeping them in memory.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Most sizes a Zipf table holds; wider ranges use a coarser step */
+#define ZIPF_MAX_SIZES (1 << 20)
+
+/* Size distributions */
+typedef enum
+{
+    DIST_UNIFORM,
+    DIST_ZIPF,
+    DIST_LOGNORMAL
+} dist_t;
+
+static const char *const dist_names[] = {
+    [DIST_UNIFORM] = "uniform",
+    [DIST_ZIPF] = "zipf",
+    [DIST_LOGNORMAL] = "lognormal",
+};
+
+/* The workload, as set by the command line */
+typedef struct
+{
+    dist_t dist;         /* distribution of sizes */
+    size_t min_size;     /* smallest block asked for */
+    size_t max_size;     /* largest block asked for */
+    double zipf_alpha;   /* exponent of Zipf */
+    double median;       /* median of lognormal */
+    double sigma;        /* sigma of the log of lognormal */
+    long num_allocs;     /* number of allocations */
+    double lifetime;     /* mean lifetime in allocations */
+    size_t live_cap;     /* most live payload, 0 for none */
+    double realloc_frac; /* fraction of requests that are reallocs */
+    int weight;          /* weight in the trace header */
+    uint64_t seed;       /* random seed */
+} params_t;
+
+/* What a pass of the generator counts, for the header */
+typedef struct
+{
+    long num_ids;
+    long num_ops;
+    size_t peak_bytes;
+} counts_t;
+
+/* A live block, in a min-heap ordered by the time it dies */
+typedef struct
+{
+    double death;
+    long id;
+} live_t;
+
+/* State of one pass of the generator */
+typedef struct
+{
+    uint64_t rng;      /* splitmix64 state */
+    live_t *heap;      /* live blocks, soonest to die on top */
+    long heap_len;
+    size_t *sizes;     /* size of each id */
+    long *heap_pos;    /* position of each id in the heap */
+    size_t live_bytes; /* payload of the live blocks */
+    counts_t counts;
+    FILE *out; /* NULL while counting */
+} gen_t;
+
+/* Zipf cumulative distribution over min_size, min_size + zipf_step, ... */
+static double *zipf_cdf = NULL;
+static long zipf_len = 0;
+static size_t zipf_step = 0;
+
+/*
+ * app_error - Report an error and exit
+ */
+static void app_error(const char *msg)
+{
+    fprintf(stderr, "tracegen: %s\n", msg);
+    exit(1);
+}
+
+/*
+ * next_random - splitmix64, which is fast and has no bad seeds
+ */
+static uint64_t next_random(gen_t *g)
+{
+    uint64_t z = (g->rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * uniform - A random double in (0, 1)
+ */
+static double uniform(gen_t *g)
+{
+    return ((double)(next_random(g) >> 11) + 0.5) / (double)(1ULL << 53);
+}
+
+/*
+ * normal - A random standard normal, by Box-Muller
+ */
+static double normal(gen_t *g)
+{
+    double u = uniform(g);
+    double v = uniform(g);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/*
+ * init_zipf - Build the distribution of Zipf sizes, rank k having
+ *     probability proportional to 1 / k^alpha
+ */
+static void init_zipf(const params_t *p)
+{
+    size_t range = p->max_size - p->min_size;
+    long k;
+    zipf_step = 1;
+    while (range / zipf_step + 1 > ZIPF_MAX_SIZES)
+        zipf_step *= 2;
+    zipf_len = (long)(range / zipf_step + 1);
+    zipf_cdf = malloc((size_t)zipf_len * sizeof(double));
+    if (zipf_cdf == NULL)
+        app_error("out of memory for the Zipf table");
+    double sum = 0.0;
+    for (k = 0; k < zipf_len; k++)
+    {
+        sum += pow((double)(k + 1), -p->zipf_alpha);
+        zipf_cdf[k] = sum;
+    }
+    for (k = 0; k < zipf_len; k++)
+        zipf_cdf[k] /= sum;
+}
+
+/*
+ * random_size - A block size from the distribution of the workload
+ */
+static size_t random_size(gen_t *g, const params_t *p)
+{
+    size_t range = p->max_size - p->min_size;
+    int tries;
+
+    switch (p->dist)
+    {
+    case DIST_UNIFORM:
+        return p->min_size + (size_t)(uniform(g) * (double)(range + 1));
+
+    case DIST_ZIPF:
+    {
+        /* First rank whose cumulative probability reaches u */
+        double u = uniform(g);
+        long lo = 0, hi = zipf_len - 1;
+        while (lo < hi)
+        {
+            long mid = lo + (hi - lo) / 2;
+            if (zipf_cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return p->min_size + (size_t)lo * zipf_step;
+    }
+
+    case DIST_LOGNORMAL:
+        /* Redraw sizes outside the range, as a truncated lognormal */
+        for (tries = 0; tries < 100; tries++)
+        {
+            double size = p->median * exp(p->sigma * normal(g));
+            if (size >= (double)p->min_size && size <= (double)p->max_size)
+                return (size_t)size;
+        }
+        return (size_t)p->median;
+    }
+    return p->min_size;
+}
+
+/*
+ * heap_swap - Swap two live blocks in the heap
+ */
+static void heap_swap(gen_t *g, long i, long j)
+{
+    live_t tmp = g->heap[i];
+    g->heap[i] = g->heap[j];
+    g->heap[j] = tmp;
+    g->heap_pos[g->heap[i].id] = i;
+    g->heap_pos[g->heap[j].id] = j;
+}
+
+/*
+ * heap_push - Add a live block to the heap
+ */
+static void heap_push(gen_t *g, long id, double death)
+{
+    long i = g->heap_len++;
+    g->heap[i].death = death;
+    g->heap[i].id = id;
+    g->heap_pos[id] = i;
+    while (i > 0 && g->heap[(i - 1) / 2].death > g->heap[i].death)
+    {
+        heap_swap(g, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/*
+ * heap_pop - Remove the live block that dies soonest and return its id
+ */
+static long heap_pop(gen_t *g)
+{
+    long id = g->heap[0].id;
+    long i = 0;
+    heap_swap(g, 0, --g->heap_len);
+    for (;;)
+    {
+        long child = 2 * i + 1;
+        if (child >= g->heap_len)
+            break;
+        if (child + 1 < g->heap_len &&
+            g->heap[child + 1].death < g->heap[child].death)
+            child++;
+        if (g->heap[i].death <= g->heap[child].death)
+            break;
+        heap_swap(g, i, child);
+        i = child;
+    }
+    return id;
+}
+
+/*
+ * free_soonest - Free the live block that dies soonest
+ */
+static void free_soonest(gen_t *g)
+{
+    long id = heap_pop(g);
+    g->live_bytes -= g->sizes[id];
+    g->counts.num_ops++;
+    if (g->out)
+        fprintf(g->out, "f %ld\n", id);
+}
+
+/*
+ * make_room - Free the blocks that die soonest until size more bytes fit
+ *     under the cap on the live payload
+ */
+static void make_room(gen_t *g, const params_t *p, size_t size)
+{
+    while (p->live_cap > 0 && g->heap_len > 0 &&
+           g->live_bytes + size > p->live_cap)
+        free_soonest(g);
+}
+
+/*
+ * note_peak - Record the live payload, if it is the largest yet
+ */
+static void note_peak(gen_t *g)
+{
+    if (g->live_bytes > g->counts.peak_bytes)
+        g->counts.peak_bytes = g->live_bytes;
+}
+
+/*
+ * reallocate - Grow or shrink a random live block
+ */
+static void reallocate(gen_t *g, const params_t *p)
+{
+    long id = g->heap[next_random(g) % (uint64_t)g->heap_len].id;
+    size_t old_size = g->sizes[id];
+    double factor = (next_random(g) % 4 != 0) ? 1.25 + 0.75 * uniform(g)
+                                              : 0.5 + 0.5 * uniform(g);
+    size_t size = (size_t)((double)old_size * factor);
+    if (size < 1)
+        size = 1;
+    if (size > p->max_size && p->max_size >= old_size)
+        size = p->max_size;
+    if (size > old_size)
+        make_room(g, p, size - old_size);
+    /* make_room may have freed the block itself */
+    if (g->heap_pos[id] >= g->heap_len || g->heap[g->heap_pos[id]].id != id)
+        return;
+    g->live_bytes += size - g->sizes[id];
+    g->sizes[id] = size;
+    note_peak(g);
+    g->counts.num_ops++;
+    if (g->out)
+        fprintf(g->out, "r %ld %zu\n", id, size);
+}
+
+/*
+ * generate - One pass of the generator, returning what it counted
+ */
+static counts_t generate(const params_t *p, FILE *out)
+{
+    gen_t g;
+    long id;
+
+    memset(&g, 0, sizeof(g));
+    g.rng = p->seed;
+    g.out = out;
+    g.heap = malloc((size_t)p->num_allocs * sizeof(live_t));
+    g.sizes = malloc((size_t)p->num_allocs * sizeof(size_t));
+    g.heap_pos = malloc((size_t)p->num_allocs * sizeof(long));
+    if (g.heap == NULL || g.sizes == NULL || g.heap_pos == NULL)
+        app_error("out of memory for the live blocks");
+
+    for (id = 0; id < p->num_allocs; id++)
+    {
+        double now = (double)id;
+
+        /* Free the blocks whose time has come */
+        while (g.heap_len > 0 && g.heap[0].death <= now)
+            free_soonest(&g);
+
+        if (g.heap_len > 0 && uniform(&g) < p->realloc_frac)
+            reallocate(&g, p);
+
+        size_t size = random_size(&g, p);
+        make_room(&g, p, size);
+        g.sizes[id] = size;
+        g.live_bytes += size;
+        note_peak(&g);
+        heap_push(&g, id, now - p->lifetime * log(uniform(&g)));
+        g.counts.num_ops++;
+        if (out)
+            fprintf(out, "a %ld %zu\n", id, size);
+    }
+    while (g.heap_len > 0)
+        free_soonest(&g);
+
+    g.counts.num_ids = p->num_allocs;
+    free(g.heap);
+    free(g.sizes);
+    free(g.heap_pos);
+    return g.counts;
+}
+
+/*
+ * parse_bytes - Parse a byte count with an optional K, M or G suffix
+ */
+static size_t parse_bytes(const char *arg)
+{
+    char *end;
+    errno = 0;
+    double val = strtod(arg, &end);
+    if (errno != 0 || end == arg || val < 0)
+        app_error("bad byte count");
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        val *= 1024;
+        /* fall through */
+    case 'M':
+    case 'm':
+        val *= 1024;
+        /* fall through */
+    case 'K':
+    case 'k':
+        val *= 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end != '\0')
+        app_error("bad byte count");
+    return (size_t)val;
+}
+
+/*
+ * usage - Print the options
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-h] [-d <dist>] [-s <min>:<max>] [-a <alpha>] "
+            "[-m <median>] [-g <sigma>] [-n <allocs>] [-L <allocs>] "
+            "[-l <bytes>] [-r <frac>] [-w <weight>] [-S <seed>] "
+            "[-o <file>]\n",
+            prog);
+    fprintf(stderr, "Options (sizes may end in K, M or G)\n");
+    fprintf(stderr, "\t-d <dist>     Sizes are uniform, zipf or lognormal "
+                    "(default lognormal).\n");
+    fprintf(stderr, "\t-s <min>:<max> Range of sizes (default 1:4K).\n");
+    fprintf(stderr, "\t-a <alpha>    Zipf exponent (default 1.0).\n");
+    fprintf(stderr, "\t-m <median>   Lognormal median (default 64).\n");
+    fprintf(stderr, "\t-g <sigma>    Lognormal sigma (default 1.0).\n");
+    fprintf(stderr, "\t-n <allocs>   Number of allocations "
+                    "(default 100000).\n");
+    fprintf(stderr, "\t-L <allocs>   Mean lifetime in allocations "
+                    "(default 1000).\n");
+    fprintf(stderr, "\t-l <bytes>    Cap on the live payload "
+                    "(default none).\n");
+    fprintf(stderr, "\t-r <frac>     Fraction of reallocs (default 0).\n");
+    fprintf(stderr, "\t-w <weight>   Trace weight (default 1).\n");
+    fprintf(stderr, "\t-S <seed>     Random seed (default 1).\n");
+    fprintf(stderr, "\t-o <file>     Write to <file> (default stdout).\n");
+    fprintf(stderr, "\t-h            Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+    params_t p = {
+        .dist = DIST_LOGNORMAL,
+        .min_size = 1,
+        .max_size = 4096,
+        .zipf_alpha = 1.0,
+        .median = 64.0,
+        .sigma = 1.0,
+        .num_allocs = 100000,
+        .lifetime = 1000.0,
+        .live_cap = 0,
+        .realloc_frac = 0.0,
+        .weight = 1,
+        .seed = 1,
+    };
+    const char *outfile = NULL;
+    char *colon;
+    int c, d;
+
+    while ((c = getopt(argc, argv, "d:s:a:m:g:n:L:l:r:w:S:o:h")) != EOF)
+    {
+        switch (c)
+        {
+        case 'd':
+            for (d = 0; d <= DIST_LOGNORMAL; d++)
+                if (strcmp(optarg, dist_names[d]) == 0)
+                    break;
+            if (d > DIST_LOGNORMAL)
+                app_error("-d needs uniform, zipf or lognormal");
+            p.dist = (dist_t)d;
+            break;
+        case 's':
+            colon = strchr(optarg, ':');
+            if (colon == NULL)
+                app_error("-s needs <min>:<max>");
+            *colon = '\0';
+            p.min_size = parse_bytes(optarg);
+            p.max_size = parse_bytes(colon + 1);
+            break;
+        case 'a':
+            p.zipf_alpha = atof(optarg);
+            break;
+        case 'm':
+            p.median = (double)parse_bytes(optarg);
+            break;
+        case 'g':
+            p.sigma = atof(optarg);
+            break;
+        case 'n':
+            p.num_allocs = atol(optarg);
+            break;
+        case 'L':
+            p.lifetime = atof(optarg);
+            break;
+        case 'l':
+            p.live_cap = parse_bytes(optarg);
+            break;
+        case 'r':
+            p.realloc_frac = atof(optarg);
+            break;
+        case 'w':
+            p.weight = atoi(optarg);
+            break;
+        case 'S':
+            p.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (p.min_size < 1 || p.max_size < p.min_size)
+        app_error("-s needs 1 <= <min> <= <max>");
+    if (p.num_allocs < 1 || p.num_allocs > ((1L << 31) - 1) / 3)
+        app_error("-n is out of range");
+    if (p.lifetime <= 0.0)
+        app_error("-L needs a positive lifetime");
+    if (p.realloc_frac < 0.0 || p.realloc_frac >= 1.0)
+        app_error("-r needs a fraction in [0, 1)");
+    if (p.weight < 0 || p.weight > 3)
+        app_error("-w needs a weight in {0, 1, 2, 3}");
+    if (p.dist == DIST_LOGNORMAL &&
+        (p.median < (double)p.min_size || p.median > (double)p.max_size))
+        app_error("-m needs a median within the range of sizes");
+    if (p.dist == DIST_ZIPF)
+        init_zipf(&p);
+
+    FILE *out = stdout;
+    if (outfile != NULL && (out = fopen(outfile, "w")) == NULL)
+    {
+        perror(outfile);
+        exit(1);
+    }
+
+    counts_t counts = generate(&p, NULL);
+    fprintf(out, "%d\n%ld\n%ld\n%zu\n", p.weight, counts.num_ids,
+            counts.num_ops, counts.peak_bytes);
+    generate(&p, out);
+
+    if (fclose(out) != 0)
+    {
+        perror(outfile ? outfile : "stdout");
+        exit(1);
+    }
+    free(zipf_cdf);
+    return 0;
+}